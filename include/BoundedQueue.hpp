@@ -0,0 +1,96 @@
+#pragma once
+#include <pthread.h>
+#include <deque>
+using namespace std;
+
+
+// Blocking FIFO with a fixed capacity: push() waits while the queue is full, pop() while it is empty
+template <typename T>
+class BoundedQueue
+{
+public:
+    BoundedQueue(size_t capacity)
+    {
+        this->capacity = capacity;
+        pthread_mutex_init(&mutex, NULL);
+        pthread_cond_init(&notEmpty, NULL);
+        pthread_cond_init(&notFull, NULL);
+    }
+
+    ~BoundedQueue()
+    {
+        pthread_cond_destroy(&notFull);
+        pthread_cond_destroy(&notEmpty);
+        pthread_mutex_destroy(&mutex);
+    }
+
+    void push(const T& item)
+    {
+        pthread_mutex_lock(&mutex);
+        while (items.size() >= capacity)
+            pthread_cond_wait(&notFull, &mutex);
+        items.push_back(item);
+        pthread_cond_signal(&notEmpty);
+        pthread_mutex_unlock(&mutex);
+    }
+
+    // returns false instead of waiting when the queue is full
+    bool try_push(const T& item)
+    {
+        pthread_mutex_lock(&mutex);
+        if (items.size() >= capacity)
+        {
+            pthread_mutex_unlock(&mutex);
+            return false;
+        }
+        items.push_back(item);
+        pthread_cond_signal(&notEmpty);
+        pthread_mutex_unlock(&mutex);
+        return true;
+    }
+
+    T pop()
+    {
+        pthread_mutex_lock(&mutex);
+        while (items.empty())
+            pthread_cond_wait(&notEmpty, &mutex);
+        T item = items.front();
+        items.pop_front();
+        pthread_cond_signal(&notFull);
+        pthread_mutex_unlock(&mutex);
+        return item;
+    }
+
+    bool try_pop(T* item)
+    {
+        pthread_mutex_lock(&mutex);
+        if (items.empty())
+        {
+            pthread_mutex_unlock(&mutex);
+            return false;
+        }
+        *item = items.front();
+        items.pop_front();
+        pthread_cond_signal(&notFull);
+        pthread_mutex_unlock(&mutex);
+        return true;
+    }
+
+    size_t size()
+    {
+        pthread_mutex_lock(&mutex);
+        size_t n = items.size();
+        pthread_mutex_unlock(&mutex);
+        return n;
+    }
+
+private:
+    size_t capacity;
+    deque<T> items;
+    pthread_mutex_t mutex;
+    pthread_cond_t notEmpty;
+    pthread_cond_t notFull;
+
+    BoundedQueue(const BoundedQueue&);
+    BoundedQueue& operator=(const BoundedQueue&);
+};
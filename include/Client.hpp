@@ -7,7 +7,9 @@
 #include <vector>
 #include <map>
 #include <fstream>
+#include <atomic>
 #include "Socket.hpp"
+#include "PartitionMap.hpp"
 
 
 class ClientSocket : public Socket {
@@ -15,6 +17,7 @@ class ClientSocket : public Socket {
 		bool connectToServer();
 		bool connectToServer(const char* serverAddress, int serverPort);
         int getClientPort();
+        string getClientIP();
 };
 
 
@@ -24,13 +27,23 @@ public:
     string user;
     int originalClientPort;  // Required to inform in a reconnection which port it was firstly running, 
                              // which is an information used to control sessions.
-    map<string, int> possibleServerAddresses;   // <ip, port>
+    map<string, int> possibleServerAddresses;   // <ip, port> of the home shard's members
+    int homeShard;
+    PartitionMap partitionMap;  // cached in PARTITION_MAP_CACHE_FILE between runs
     ClientSocket socket;
+    ClientSocket querySocket;   // read-only connection to a replica of the home shard
+    bool queryConnected;
+    ClientSocket deliverySocket;    // REPLICA_DELIVERY: where a replica pushes our notifications
+    atomic<bool> deliveryConnected;     // cleared by the delivery receiver, read by the control thread
+    string originalClientIP;    // with originalClientPort, identifies the session to the replica
+    atomic<uint16_t> lastSeenSeqn;      // newest event the primary confirmed to us, queries can't read older state
+    bool behindGateway;         // possibleServerAddresses is the gateway, which stands in for every server
     
-    Client(string user, map<string, int> possibleServerAddresses);
+    Client(string user, map<string, int> possibleServerAddresses, int homeShard, bool behindGateway = false);
     static void *do_threadSender(void* arg);
 	static void *do_threadReceiver(void* arg);
     static void *controlThread(void* arg);
+    static void *do_threadDeliveryReceiver(void* arg);
 
     pthread_mutex_t mutex_print;
     pthread_mutex_t mutex_input;
@@ -40,9 +53,18 @@ public:
 	void cleanBuffer(void);
 	void executeSendCommand();
 	void executeFollowCommand();
+	void executeQueryCommand(string command, string target);
+	bool queryReplica(Packet query);
+	bool connectToQueryReplica();
+	bool connectToReplica(ClientSocket* replicaSocket);
+	bool connectToDeliveryReplica();
+	string userInfo();
+	void seeSeqn(uint16_t seqn);
     void establishConnection();
     void reestablishConnection();
     void connectToPrimaryServer(bool reestablishingConnection);
+    bool connectToCachedPrimary();
+    bool greetServer();
 
 };
 
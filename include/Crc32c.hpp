@@ -0,0 +1,9 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+using namespace std;
+
+
+// CRC32C (Castagnoli) of a buffer. Uses the SSE4.2 crc32 instruction when the CPU has it,
+// or the ARMv8 CRC instructions when built for them, and a slicing-by-8 table otherwise
+uint32_t crc32c(const void* data, size_t length);
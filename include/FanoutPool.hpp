@@ -0,0 +1,73 @@
+#pragma once
+#include <stdint.h>
+#include <pthread.h>
+#include <deque>
+#include <queue>
+#include <vector>
+#include <memory>
+#include "Session.hpp"
+#include "defines.hpp"
+using namespace std;
+
+
+// Committed notification waiting to be delivered to the sessions of its followers
+typedef struct __fanout_job {
+
+    shared_ptr<const notification> notif;
+    shared_ptr<const vector<uint32_t> > follower_ids;  // Snapshot taken at commit time
+
+} fanout_job;
+
+typedef struct __fanout_chunk {
+
+    shared_ptr<fanout_job> job;
+    size_t begin;
+    size_t end;
+
+} fanout_chunk;
+
+
+// Pool of workers that delivers committed notifications to session inboxes, off the
+// transaction mutex. Jobs run one after the other so every session still receives
+// notifications in id order, but each job is split in chunks spread over per-worker
+// deques: a worker pops from the back of its own deque and steals from the front of
+// the others when it runs dry, so one large follower list keeps every core busy.
+class FanoutPool
+{
+public:
+    FanoutPool(DeliveryIndex* index, int numWorkers);
+
+    void submit(shared_ptr<const notification> notif, shared_ptr<const vector<uint32_t> > follower_ids);
+
+private:
+    typedef struct __worker_queue {
+        pthread_mutex_t mutex;
+        deque<fanout_chunk> chunks;
+    } worker_queue;
+
+    DeliveryIndex* index;
+    vector<worker_queue*> queues;
+
+    pthread_mutex_t jobsMutex;
+    pthread_cond_t jobsAvailable;
+    queue< shared_ptr<fanout_job> > jobs;
+
+    pthread_mutex_t workMutex;
+    pthread_cond_t workAvailable;
+    pthread_cond_t workDone;
+    size_t remainingChunks;
+    unsigned int workGeneration;
+
+    bool take_chunk(int worker, fanout_chunk* chunk);
+    void run_chunk(const fanout_chunk& chunk);
+    void finish_chunk();
+
+    static void *dispatcherThread(void *pool);
+    static void *workerThread(void *workerArgs);
+};
+
+
+struct fanout_worker_args {
+    FanoutPool* pool;
+    int worker;
+};
@@ -0,0 +1,41 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+using namespace std;
+
+
+// Social graph with usernames interned to dense ids. Both directions are kept
+// as sorted id arrays, so membership is a binary search and fan-out walks a
+// contiguous block of integers instead of a linked list of strings.
+class FollowerGraph
+{
+public:
+    FollowerGraph();
+
+    uint32_t add_user(string user);                 // returns the user id, creating it if needed
+    bool has_user(string user);
+    bool get_id(string user, uint32_t* id);
+    string name_of(uint32_t id);
+    size_t size();
+
+    bool follow(string user, string user_to_follow); // false if the edge already existed
+    bool unfollow(string user, string user_to_unfollow); // false if there was no such edge
+    bool is_follower(uint32_t follower, uint32_t followed);
+
+    const vector<uint32_t>& followers_of(uint32_t id);
+    const vector<uint32_t>& following_of(uint32_t id);
+    size_t followers_count(string user);
+
+private:
+    unordered_map<string, uint32_t> ids;
+    vector<string> names;
+    vector< vector<uint32_t> > followers;   // followers[id]: sorted ids following id
+    vector< vector<uint32_t> > following;   // following[id]: sorted ids followed by id
+
+    static bool insert_sorted(vector<uint32_t>& ids, uint32_t id);
+    static bool erase_sorted(vector<uint32_t>& ids, uint32_t id);
+    static bool contains_sorted(const vector<uint32_t>& ids, uint32_t id);
+};
@@ -0,0 +1,97 @@
+#pragma once
+#include <stdint.h>
+#include <pthread.h>
+#include <string>
+#include <map>
+#include <vector>
+#include <memory>
+#include "Client.hpp"
+#include "ShardMap.hpp"
+#include "BoundedQueue.hpp"
+#include "RttEstimator.hpp"
+#include "defines.hpp"
+using namespace std;
+
+
+// A client connected to the gateway and the session id its frames carry upstream. Frames
+// relayed to it wait in its own queue for its writer thread, a NULL frame stops the writer
+typedef struct __gateway_client {
+
+    __gateway_client(Socket* new_socket) : session(0), socket(new_socket), opened(false), resuming(false),
+        outbound(GATEWAY_CLIENT_QUEUE_CAPACITY) {}
+    ~__gateway_client() { delete socket; }
+
+    uint32_t session;
+    string user;
+    host_address address;       // what the primary knows the session by
+    Socket* socket;
+    bool opened;                // the primary was asked for the session, resumed after a failover
+    bool resuming;              // the primary's answer is for the gateway, not the client
+    BoundedQueue< shared_ptr<Packet> > outbound;
+
+} gateway_client;
+
+
+class Gateway;
+
+// One of the connections the gateway keeps to a shard's primary. Frames sent while the shard
+// has no primary, or that failed to go out, wait for the link thread to find the new one and
+// resume the link's sessions there, so the clients on it never reconnect.
+class UpstreamLink
+{
+public:
+    UpstreamLink(Gateway* gateway, int shard, map<string, int> addresses);
+
+    void send(Packet packet, uint32_t session);
+
+private:
+    Gateway* gateway;
+    int shard;
+    map<string, int> addresses;    // <ip, port> of the shard's members
+
+    ClientSocket* socket;
+    pthread_mutex_t mutex;          // one frame on the wire at a time
+    pthread_cond_t reconnected;
+    bool connected;
+
+    bool connect();
+    bool greet();
+
+    static void *linkThread(void *linkArg);
+};
+
+
+// Terminates client connections and multiplexes their sessions over GATEWAY_UPSTREAM_LINKS
+// links per shard. Clients speak the usual protocol to it as if it were their primary.
+class Gateway
+{
+public:
+    Gateway(ShardMap shardMap);
+
+    void listenForClients(int port);    // never returns
+
+    vector< shared_ptr<gateway_client> > sessions_to_resume(UpstreamLink* link);
+    void relay(Packet* packet);         // frame from upstream to the client of its session
+
+private:
+    ShardMap shardMap;
+    map<int, vector<UpstreamLink*> > links;     // by shard
+
+    pthread_mutex_t clientsMutex;
+    map<uint32_t, shared_ptr<gateway_client> > clients;    // by session
+    uint32_t nextSession;
+
+    UpstreamLink* link_of(gateway_client* client);
+    shared_ptr<gateway_client> add_client(Socket* socket, string user, host_address address, bool resuming);
+    void remove_client(uint32_t session);
+
+    static void *clientHandler(void *handlerArgs);
+    static void *clientWriter(void *clientArg);
+};
+
+
+struct gateway_client_args {
+    Gateway* gateway;
+    Socket* connectedSocket;
+    host_address peer_address;
+};
@@ -0,0 +1,65 @@
+#pragma once
+#include <atomic>
+#include <utility>
+using namespace std;
+
+
+// Unbounded lock-free multi-producer single-consumer queue (Vyukov's intrusive list design).
+// push() may be called from any thread; pop() and empty() only from the single consumer.
+template <typename T>
+class MpscQueue
+{
+public:
+    MpscQueue()
+    {
+        node* stub = new node();
+        head.store(stub, memory_order_relaxed);
+        tail = stub;
+    }
+
+    ~MpscQueue()
+    {
+        T value;
+        while (pop(&value));
+        delete tail;
+    }
+
+    void push(const T& value)
+    {
+        node* n = new node(value);
+        node* previous = head.exchange(n, memory_order_acq_rel);
+        previous->next.store(n, memory_order_release);  // publishes n to the consumer
+    }
+
+    bool pop(T* value)
+    {
+        node* next = tail->next.load(memory_order_acquire);
+        if (next == NULL)
+            return false;
+
+        *value = move(next->value);
+        delete tail;
+        tail = next;    // next becomes the new stub
+        return true;
+    }
+
+    bool empty()
+    {
+        return tail->next.load(memory_order_acquire) == NULL;
+    }
+
+private:
+    struct node {
+        node() : next(NULL) {}
+        node(const T& new_value) : next(NULL), value(new_value) {}
+
+        atomic<node*> next;
+        T value;
+    };
+
+    atomic<node*> head;     // last pushed node, shared by producers
+    node* tail;             // consumer side stub
+
+    MpscQueue(const MpscQueue&);
+    MpscQueue& operator=(const MpscQueue&);
+};
@@ -7,6 +7,15 @@
 #include "defines.hpp"
 
 
+// One operation of an event, as it is staged and applied
+typedef struct _event_op
+{
+    int command; // event packet type
+    char arg1[MAX_EVENT_ARG1];
+    char arg2[MAX_EVENT_ARG2];
+    char arg3[MAX_EVENT_ARG3];
+} event_op;
+
 typedef struct _event 
 {
     uint16_t seqn;
@@ -15,6 +24,10 @@ typedef struct _event
     char arg2[MAX_EVENT_ARG2];
     char arg3[MAX_EVENT_ARG3];
     bool committed;
+    uint8_t num_ops;                // MULTI_OP only, applied and rolled back as a unit
+    uint16_t ops[MAX_EVENT_OPS];    // their commands, every one on arg1..arg3
+    char origin[MAX_EVENT_ARG1];    // CREATE_NOTIFICATION forwarded by another shard: the link it came
+    uint32_t origin_post;           // on and its number there, empty and 0 for a local post
 
     bool operator ==(_event other) const {
 		return seqn == other.seqn && committed == other.committed;
@@ -36,6 +49,9 @@ typedef struct _event
 class Packet {
 
     private:
+        uint32_t checksum;  // CRC32C of the whole frame, computed with this field at 0
+        uint32_t frame;     // Position in the sender's stream to a peer server, 0 elsewhere
+        uint32_t session;   // Client session a gateway link frame belongs to, 0 elsewhere
         uint16_t type;      // See possible types in defines.hpp
         uint16_t seqn;      // Sequence number
         uint16_t length;    // Payload length
@@ -53,7 +69,9 @@ class Packet {
         Packet(uint16_t type, event e);
         Packet(uint16_t type, event e, uint16_t length);
 
-		uint16_t getType();
+		uint16_t getType() const;
+		uint32_t getFrame() const;
+		uint32_t getSession() const;
 		uint16_t getSeqn();
 		uint16_t getLength();
 		time_t getTimestamp();
@@ -62,6 +80,11 @@ class Packet {
         
 
         void setType(uint16_t type);
+        void setFrame(uint32_t frame);
+        void setSession(uint32_t session);
+
+        void seal();        // stores the checksum, right before the frame is written
+        bool intact();      // checksum of a frame that was read matches its content
         void setSeqn(uint16_t seqn);
         void setTimestamp(time_t timestamp);
         void setPayload(char* payload);
@@ -0,0 +1,35 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <map>
+#include <fstream>
+#include "Socket.hpp"
+#include "defines.hpp"
+using namespace std;
+
+
+// Where each shard's primary is, as a server last saw it. Which shard a user belongs to
+// comes from the ShardMap every side builds from ipporta.txt, so this only tracks the part
+// that changes with elections. The version is a hash of the entries: a client sends the
+// one it has cached when connecting and only gets the map back when the server's differs.
+class PartitionMap
+{
+public:
+    PartitionMap();
+
+    void set_primary(int shard, host_address primary);
+    void forget_primary(int shard);
+    bool primary_of(int shard, host_address* primary);
+    bool empty();
+
+    uint64_t version();
+    string version_string();        // hex, what clients send when connecting
+    string serialize();             // "shard=ip:port;..."
+    static PartitionMap parse(string serialized);
+
+    bool load(string filename);
+    void save(string filename);
+
+private:
+    map<int, host_address> primaries;
+};
@@ -0,0 +1,47 @@
+#pragma once
+#include <pthread.h>
+#include <deque>
+#include <memory>
+#include "Socket.hpp"
+#include "defines.hpp"
+using namespace std;
+
+
+// Outbound side of a connection to another server. Packets wait in the peer's own queues,
+// drained by its sender thread, so a backup that stops reading only stalls itself.
+// Broadcast packets are encoded once and shared. Control packets (elections, acks, progress)
+// have a lane of their own that is always written before any queued bulk event traffic.
+// Every frame written is numbered and kept for PEER_RETRANSMIT_WINDOW frames, so when the
+// peer reads a corrupt one it asks for the stream again from there (go-back-N).
+class PeerSender
+{
+public:
+    PeerSender(int peerID, Socket* socket);
+    ~PeerSender();
+
+    bool try_send(shared_ptr<const Packet> packet);    // false when the bulk lane is full
+    void send(shared_ptr<const Packet> packet);        // waits for room in the bulk lane
+    void stop();                                       // sender thread exits after what is queued
+    void retransmit(uint32_t fromFrame);               // drops the connection if it left the window
+
+    static void start(shared_ptr<PeerSender> sender);
+    static bool is_control_packet(uint16_t type);
+
+private:
+    int peerID;
+    Socket* socket;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t notEmpty;
+    pthread_cond_t notFull;
+    deque< shared_ptr<const Packet> > control;
+    deque< shared_ptr<const Packet> > bulk;    // at most PEER_OUTBOUND_QUEUE_CAPACITY packets
+    deque< shared_ptr<const Packet> > resend;  // numbered frames asked for again, before anything else
+    deque< shared_ptr<const Packet> > written; // last PEER_RETRANSMIT_WINDOW numbered frames
+    uint32_t lastFrame;
+    bool stopped;
+
+    bool next_packet(shared_ptr<const Packet>* packet);
+
+    static void *senderThread(void *senderArg);
+};
@@ -0,0 +1,50 @@
+#pragma once
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <map>
+#include <algorithm>
+#include <vector>
+#include "defines.hpp"
+using namespace std;
+
+
+// Smoothed round-trip time of one peer, in microseconds
+typedef struct __rtt_estimate {
+
+    long srtt;
+    long rttvar;
+
+} rtt_estimate;
+
+
+// Per-peer round-trip estimates fed by request/ack pairs the servers already exchange
+// (event and OK, ELECTION and ANSWER, ASK_PRIMARY and its reply). Each sample updates
+// SRTT and RTTVAR the way TCP does, and timeouts are SRTT + RTT_VARIANCE_FACTOR * RTTVAR,
+// clamped by the caller's floor and ceiling.
+class RttEstimator
+{
+public:
+    RttEstimator();
+    ~RttEstimator();
+
+    void record(int peerID, long sampleMicros);
+    void forget(int peerID);
+
+    // control requests with a single outstanding reply per peer
+    void start_probe(int peerID);
+    void finish_probe(int peerID);
+
+    // slowest of the given peers, a peer never measured counts as unmeasuredMicros
+    long timeout_micros(const vector<int>& peers, long floorMicros, long ceilingMicros, long unmeasuredMicros);
+
+    static long elapsed_micros(const struct timespec& since);
+    static void sleep_micros(long micros);     // for timeouts of a second or more too
+
+private:
+    pthread_mutex_t mutex;
+    map<int, rtt_estimate> estimates;
+    map<int, struct timespec> probes;   // <peer id, when the request left>
+
+    void update(int peerID, long sampleMicros);
+};
@@ -2,11 +2,14 @@
 #include <stdint.h>
 #include <pthread.h>
 #include <semaphore.h>
+#include <poll.h>
+#include <fcntl.h>
 #include <list>
 #include <string>
 #include <map>
 #include <vector>
 #include <queue>
+#include <deque>
 #include <iostream>
 #include <algorithm>
 #include <stdlib.h>
@@ -14,36 +17,88 @@
 #include <set>
 #include <thread>
 #include <fstream>
+#include <sstream>
 #include "Socket.hpp"
+#include "FollowerGraph.hpp"
+#include "Session.hpp"
+#include "FanoutPool.hpp"
+#include "BoundedQueue.hpp"
+#include "PeerSender.hpp"
+#include "RttEstimator.hpp"
+#include "StateDigest.hpp"
+#include "ShardMap.hpp"
+#include "ShardLink.hpp"
+#include "PartitionMap.hpp"
 using namespace std;
 
 
+// A connection the accept loop took, before anyone read what it is
+typedef struct __pending_connection {
+    Socket* connectedSocket;
+    struct sockaddr_in cli_addr;
+} pending_connection;
+
+
+// A client session carried by a gateway link
+typedef struct __gateway_session {
+    string user;
+    host_address address;
+    shared_ptr<SessionChannel> channel;
+} gateway_session;
+
+
+// Event received from the primary, waiting for the applier
+typedef struct __replicated_event {
+
+    event e;
+    bool record_only;   // aborted on the primary, only kept in the history
+    string chain;       // live from the primary stream: the order it is passed on in chain replication
+    bool report_progress;   // part of the catch-up stream of a lagging backup
+
+} replicated_event;
+
+// What the primary knows about a backup's position in the event log
+typedef struct __backup_progress {
+
+    bool lagging;           // out of the synchronous set, fed by the catch-up stream
+    uint16_t sent_seqn;     // last event queued to it
+    uint16_t applied_seqn;  // last event it reported as applied
+    deque< shared_ptr<const Packet> > deferred;    // commit decisions its queue had no room for
+    int missed_acks;        // events in a row it did not answer in time
+    int stalled_rounds;     // catch-up rounds with everything sent and applied_seqn not moving
+    uint16_t served_applied;    // applied_seqn as the last catch-up round saw it
+
+    __backup_progress() : lagging(false), sent_seqn(0), applied_seqn(0), missed_acks(0), stalled_rounds(0), served_applied(0) {}
+
+} backup_progress;
 
-typedef struct __notification {
 
-    __notification();
-    __notification(uint32_t new_id, string new_author, time_t new_timestamp, string new_body, uint16_t new_length, uint16_t new_pending) :
-        id(new_id), author(new_author), timestamp(new_timestamp), body(new_body), length(new_length), pending(new_pending) {}
+// A user's state as the primary has it, sent to a backup whose digest differed
+typedef struct __repaired_user {
 
-    uint32_t id; //Identificador da notificação (sugere-se um identificador único)
-    string author; 
-    time_t timestamp; //Timestamp da notificação
-    string body; //Mensagem
-    uint16_t length; //Tamanho da mensagem
-    uint16_t pending; //Quantidade de leitores pendentes
+    vector<string> following;
+    list<host_address> sessions;
+    list<uint32_t> unread;
 
-    bool operator ==(__notification other) const {
-		return id == other.id;
-	}
+} repaired_user;
 
-} notification;
+// STATE_REPAIR records of one bucket, applied once the closing record arrives
+typedef struct __state_repair {
 
+    bool active;
+    int bucket;
+    uint16_t seqn;
+    map<string, repaired_user> users;
+
+    __state_repair() : active(false), bucket(0), seqn(0) {}
+
+} state_repair;
 
 
 class Server
 {
 public:
-    Server(map<string, int> possibleServerAddresses);
+    Server(map<string, int> possibleServerAddresses, ShardMap shardMap);
     Server(host_address addr);
 
     string ip;
@@ -58,44 +113,90 @@ public:
     bool electionStarted;
     bool gotAnsweredInElection;
 
-    int serverConfirmation;
+    map<uint16_t, int> primary_confirmations;  // <event seqn, SOK or SNOK> not yet taken by the applier
+    unsigned int confirmation_generation;       // bumped when pending confirmations are abandoned
     bool autocommit;
     
     map<int, Socket*> connectedServers;         // <id, connected socket object>
-    map<string, int> possibleServerAddresses;   // <Ip address, port>
+    map<int, shared_ptr<PeerSender> > peerSenders;  // <id, outbound queue>, guarded by connectedServersMutex
+    map<int, backup_progress> backups_progress;     // <id, log position>, guarded by connectedServersMutex
+    map<string, int> possibleServerAddresses;   // <Ip address, port> of the own shard's members
+
+    ShardMap shardMap;
+    int shard;                                  // replica group this server belongs to
+    map<int, ShardLink*> shardLinks;            // <shard, link to its primary>, set up before any connection
 
     map<uint16_t, map<int, bool>> confirmedEvents; // <event seqn, <server id, if committed>
+    map<uint16_t, struct timespec> eventsSentAt;   // <event seqn, when it left>, guarded by confirmedEventsMutex
+    RttEstimator peerRtt;
     pthread_mutex_t confirmedEventsMutex;
 
     pthread_mutex_t electionMutex;
+    pthread_cond_t electionStateChanged;        // electionStarted was set or cleared
+    void setElectionStarted(bool started);      // electionMutex held
+    void waitElectionFinished();
+
+    BoundedQueue<pending_connection>* pendingConnections;  // accepted, waiting for an admission worker
 
     bool try_to_start_session(string user, host_address address);
-    bool follow_user(string user, string user_to_follow);
-    bool create_notification(string user, string body, time_t timestamp);
+    bool open_session_and_retrieve_notifications(string user, host_address address);
+    bool follow_user(string user, string user_to_follow, bool* following = NULL);
+    bool route_follow_user(string user, string user_to_follow);
+    string serve_shard_request(Packet* request);
+    bool is_home_shard(string user);
+    bool answer_query(string query, uint16_t min_seqn, vector<string>* answer, uint16_t* applied_seqn);
+    uint16_t last_event_seqn();
+    bool create_notification(string user, string body, time_t timestamp, string origin = "", uint32_t origin_post = 0);
     void close_session(string user, host_address address);
     void retrieve_notifications_from_offline_period(string user, host_address addr);
-    void read_notifications(host_address addr, vector<notification>* notifications);
-
-    bool has_processed_event(event e); // backup use
-    void send_commited_events_to_new_backup(Socket* socket, uint16_t expected_seqn); // primary use
+    void record_delivery(host_address addr, string user, uint32_t delivered_up_to, SessionChannel* channel);
+    void flush_delivery_progress();
+    void send_delivery_progress(string payload);
+    void apply_delivery_progress(string progress);
+    void send_delivery_progress_snapshot(int peerID);
+    shared_ptr<SessionChannel> get_session_channel(host_address addr);
+    shared_ptr<SessionChannel> take_over_delivery(string user, host_address addr, uint16_t min_seqn);
+    void hand_off_delivery(string user, host_address addr);
+    void end_replica_delivery(string user, host_address addr, shared_ptr<SessionChannel> channel);
+    vector<Packet> answer_command(string user, Packet* command);
+    bool open_gateway_session(Packet* request, gateway_session* session);
+
+    void enqueue_replicated_event(event e, bool record_only, string chain, bool report_progress); // backup use
+    void wait_replicated_events_applied(); // backup use
+    void set_primary_confirmation(uint16_t seqn, int confirmation); // backup use
+    void abort_primary_confirmations(); // backup use
+    void send_commited_events_to_new_backup(int peerID, uint16_t expected_seqn); // primary use
     void ask_event_history_to_primary(Socket* connectedSocket);
 
-    bool didAllBackupsRespondedEvent(uint16_t eventSeqn);
-    bool didAllBackupsOkedEvent(uint16_t eventSeqn);
+    bool didAllBackupsRespondedEvent(uint16_t eventSeqn, const vector<int>& backups);
+    bool didAllBackupsOkedEvent(uint16_t eventSeqn, const vector<int>& backups);
+    void record_backup_progress(int peerID, uint16_t appliedSeqn); // primary use
+    void serve_lagging_backups(); // primary use
+    void send_state_digests(); // primary use
+    void send_differing_buckets(string bucketDigest); // primary use
+    void compare_state_digest(uint16_t seqn, string groupDigest); // backup use
+    void receive_state_repair(uint16_t seqn, string record); // backup use
 
     void updatePrimaryServerInfo(string ip, int listeningPort, int id);
     void updatePrimaryServerInfo(string ip, int listeningPort);
     void removeSelfFromPossibleServerAddresses();
+    void joinShard();
+    PartitionMap partitionMap();
     void setAsPrimaryServer();
     void sendPacketToAllServersInTheGroup(Packet p);
     void sendPacketToPrimaryServer(Packet p);
-    void sendElectionPacketForGreaterIds();
-    void sendMessagesForConnectionEstablishment(Socket* peerConnectedSocket, int peerID);
+    void sendPacketToServers(const vector<int>& peerIDs, Packet p);
+    void sendPacketToServer(int peerID, Packet p);
+    void sendElectionPacketToPeers();
+    void request_retransmit(int peerID, uint32_t frame);
+    void retransmit_to_peer(int peerID, uint32_t frame);
+    void sendMessagesForConnectionEstablishment(shared_ptr<PeerSender> sender, int peerID);
 
     static pair<string, int> getIpPortFromAddressString(string addressString);
+    static bool parseSessionAddress(string payload, string* user, host_address* address);
     static int getIdFromAddress(string ip, int port);
     void setAddress(string ip, int port);
-    void addPeerToConnectedServers(int peerID, Socket* connectedSocket);
+    void addPeerToConnectedServers(int peerID, Socket* connectedSocket, bool joining);
     void removePeerFromConnectedServers(int peerID);
 
 
@@ -106,6 +207,19 @@ public:
     static void *communicationHandler(void *handlerArgs);
     static void *readCommandsHandler(void *handlerArgs);
     static void *sendNotificationsHandler(void *handlerArgs);
+    static void *deliveryProgressHandler(void *handlerArgs);
+    static void *eventApplierHandler(void *handlerArgs);
+    static void *asyncReplicationHandler(void *handlerArgs);
+    static void *backupCatchUpHandler(void *handlerArgs);
+    static void *bulkReadMessagesHandler(void *handlerArgs);
+    static void *stateDigestHandler(void *handlerArgs);
+    static void *shardRequestsHandler(void *handlerArgs);
+    static void *queryRequestsHandler(void *handlerArgs);
+    static void *replicaDeliveryHandler(void *handlerArgs);
+    static void *gatewayLinkHandler(void *handlerArgs);
+    static void *gatewayReadHandler(void *handlerArgs);
+    static void *gatewaySendHandler(void *handlerArgs);
+    static void *admissionHandler(void *handlerArgs);
 
     void print_users_unread_notifications();
     void print_sessions();
@@ -125,41 +239,135 @@ private:
     pthread_mutex_t connectedServersMutex;
 
 
-    pthread_cond_t 	cond_notification_empty, cond_notification_full;
     pthread_mutex_t seqn_transaction_serializer;
 
     uint32_t notification_id_counter;
 
     vector<event> event_history; 
+    map<string, deque<event> > recent_posts;   // last QUERY_TIMELINE_LENGTH committed posts by author, oldest first
+    uint16_t applied_watermark;             // every event up to it is in the history
+    pthread_cond_t applied_watermark_advanced;  // with seqn_transaction_serializer
+    atomic<uint16_t> election_seqn;         // applied_watermark, read by elections without the transaction mutex
+
+    StateDigest state_digest;   // of the committed state, guarded by seqn_transaction_serializer
+    state_repair pending_repair;    // bulk reader only
 
     map<string, sem_t> user_sessions_semaphore;
     map< string, list< host_address > > sessions; // {user, [<ip, port>]}
     map< string, list< uint32_t > > users_unread_notifications; // {user, [notification]]}
-    map< string, list<string> > followers;
-    vector<notification> active_notifications;
-    map< host_address, priority_queue< uint32_t, vector<uint32_t>, greater<uint32_t> > > active_users_pending_notifications; // {<ip, port>, min_heap[notification]]}
+    FollowerGraph followers;
+    vector< shared_ptr<const notification> > active_notifications;  // sorted by id
+    unordered_map< session_key, user_session > active_sessions; // {packed <ip, port>, session}
+    map< string, vector< uint32_t > > author_timelines; // {author, [notification]} fanned out on read only
+    map< string, map< string, uint32_t > > read_cursors; // {follower, {author, timeline entries merged or skipped at follow}}
+    map< string, uint32_t > forwarded_posts; // {origin shard link, last post of it applied here}
+
+    // Delivery progress lives outside the transactional state: watermarks only grow, so they
+    // are applied in any order, more than once, without the transaction mutex
+    pthread_mutex_t delivery_progress_mutex;
+    map< session_key, uint32_t > session_watermarks; // {session, delivered up to notification id}
+    map< string, uint32_t > user_watermarks; // {user, delivered up to notification id in any session}
+    map< session_key, pair<string, uint32_t> > unflushed_progress; // {session, <user, watermark>} not yet sent to backups
+
+    DeliveryIndex delivery_index;   // sessions ready to receive, read by the fan-out workers
+    FanoutPool* fanout_pool;
+
+    BoundedQueue<Packet*>* inbound_bulk;                // bulk packets from the primary, off the receiver loop
+    BoundedQueue<replicated_event>* replicated_events;  // filled by the bulk reader, drained in order
+    pthread_mutex_t applier_mutex;
+    pthread_cond_t applier_idle;
+    int unapplied_events;
+    uint16_t applying_seqn;     // primary seqn of the event being replayed, 0 otherwise
+    string forwarding_chain;    // chain order the replayed event came with
+
+    pthread_mutex_t confirmation_mutex;
+    pthread_cond_t confirmation_received;
+
+    BoundedQueue<event>* async_events;  // committed here, not yet sent to the backups
+    pthread_mutex_t async_replication_mutex;
+    pthread_cond_t async_replication_drained;
+    int async_unsent_events;
 
     bool user_exists(string user);
+    bool is_fanned_out_on_read(string author);
+    void merge_author_timelines(string user, pending_queue* pending);
+    vector<uint32_t> online_followers(uint32_t author_id);
+    uint32_t session_watermark(session_key key);
+    uint32_t user_watermark(string user);
+    void prune_delivered(session_key key, pending_queue* pending);
     bool user_is_active(string user);
-    void assign_notification_to_active_sessions(uint32_t notification_id, list<string> followers);
+    bool wait_applied(uint16_t min_seqn);
+    void start_session_delivery(string user, session_key key, user_session& session);
+    void split_followers(string author, const vector<uint32_t>& follower_ids, vector<uint32_t>* local_ids, set<int>* remote_shards);
+    void forward_notification(string author, string body, time_t timestamp, const set<int>& remote_shards);
+    void assign_notification_to_active_sessions(uint32_t notification_id, const vector<uint32_t>& follower_ids);
+    shared_ptr<const notification> find_active_notification(uint32_t notification_id);
     bool wait_primary_commit(event e);
     bool send_backup_change(event e);
+    bool send_backup_change_along_chain(event e);
+    vector<int> send_event_to_live_backups(event e);
+    void mark_silent_backups_lagging(uint16_t eventSeqn, const vector<int>& backups);
+    string chain_order();
+    int chain_successor(string order);
+    int chain_tail(string order);
+    Packet chain_packet(uint16_t type, event e, string order);
+    bool did_backup_ok_event(uint16_t eventSeqn, int peerID);
+    void send_backup_change_async(event e);
+    void wait_async_replication_drained();
+    int count_backup_oks(uint16_t eventSeqn);
+    int backup_quorum();
+    long commit_timeout_micros(const vector<int>& backups);
+    long election_timeout_micros();
+    bool outranks(uint16_t candidateSeqn, int candidateID);
+    void start_event_rtt_probe(uint16_t eventSeqn);
+    static int command_durability(int command);
+    static int durability_of(const event& e);
 
     uint16_t get_current_sequence();
+    bool run_transaction(event e, vector<bool>* results);
+    static vector<event_op> event_operations(const event& e);
+    void deepcopy_operation_state(const event_op& op, bool save);
+    bool stage_operation(const event_op& op);
+    void finish_operation(const event_op& op);
+    bool stage_open_session(string user, host_address address);
+    void stage_read_offline(string user, host_address addr);
+    void finish_read_offline(string user, host_address addr);
+    void apply_replicated_event(const replicated_event& replicated);
+    void record_event(event e);
+
+    void mark_event_dirty(const event& e);
+    void refresh_state_digest();
+    string user_state_digest_input(string user);
+    vector<string> following_names(string user);
+    void send_state_bucket(int peerID, int bucket, uint16_t seqn);
+    static void append_list_records(vector<string>* records, string prefix, const vector<string>& items);
+    void apply_state_repair();
+    void repair_user_state(string user, const repaired_user& state);
+    void drop_user_state(string user);
+
+    vector<string> query_user_list(string title, const vector<string>& names);
+    vector<string> query_stats(string user);
+    vector<string> query_timeline(string user);
 
     map<string, sem_t> COPY_user_sessions_semaphore;
     map< string, list< host_address > > COPY_sessions;
     map< string, list< uint32_t > > COPY_users_unread_notifications;
-    map< string, list<string> > COPY_followers;
-    vector<notification> COPY_active_notifications;
-    map< host_address, priority_queue< uint32_t, vector<uint32_t>, greater<uint32_t> > > COPY_active_users_pending_notifications;
+    FollowerGraph COPY_followers;
+    vector< shared_ptr<const notification> > COPY_active_notifications;
+    unordered_map< session_key, user_session > COPY_active_sessions;
+    map< string, vector< uint32_t > > COPY_author_timelines;   // only the author a post is staged for
+    map< string, map< string, uint32_t > > COPY_read_cursors;  // only the users a transaction is staged for
+    map< string, uint32_t > COPY_forwarded_posts;              // only the origin a forwarded post is staged for
 
     void deepcopy_user_sessions_semaphore(bool save);
     void deepcopy_sessions(bool save);
     void deepcopy_users_unread_notifications(bool save);
     void deepcopy_followers(bool save);
     void deepcopy_active_notifications(bool save);
-    void deepcopy_active_users_pending_notifications(bool save);
+    void deepcopy_active_sessions(bool save);
+    void deepcopy_author_timeline(string author, bool save);
+    void deepcopy_read_cursors(string user, bool save);
+    void deepcopy_forwarded_post(string origin, bool save);
   
 };
 
@@ -169,6 +377,9 @@ struct communiction_handler_args {
 	host_address client_address; 
 	string user;
     Server* server;
+    bool offline_retrieved;
+    bool replica_delivery;      // a backup pushes its notifications, not this connection
+    uint16_t login_seqn;        // replica delivery: event the session was opened at
 };
 
 struct group_communiction_handler_args {
@@ -177,6 +388,18 @@ struct group_communiction_handler_args {
     Server* server;
 };
 
+// Upstream link of a gateway, served by one reader and one sender whatever the number of
+// sessions on it: the channels of all of them post the same wakeup
+struct gateway_link {
+    Socket* connectedSocket;
+    Server* server;
+    pthread_mutex_t send_mutex;         // replies and notifications are written by different threads
+    pthread_mutex_t sessions_mutex;
+    map<uint32_t, gateway_session> sessions;    // by the id the gateway tags their frames with
+    sem_t wakeup;
+    bool closed;                        // the gateway went away
+};
+
 
 class ServerSocket : public Socket {
 	
@@ -184,9 +407,11 @@ class ServerSocket : public Socket {
 		struct sockaddr_in serv_addr;
 
 		void bindAndListen(Server* server);
-		void connectNewClientOrServer(pthread_t *threadID, Server *server);
+		void acceptConnection(Server *server);
+		static void admitConnection(pending_connection connection, Server *server);
         void connectToGroupMembers(Server* server);
-        bool connectToMember(sockaddr_in serv_addr, string ip, Server* server);
+        void joinMember(Socket* peerConnectedSocket, string ip, int port, Server* server);
+        static bool resolveMember(string ip, int port, sockaddr_in* serv_addr);
 
 		ServerSocket();
 };
\ No newline at end of file
@@ -0,0 +1,130 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <queue>
+#include <functional>
+#include <unordered_map>
+#include <memory>
+#include <atomic>
+#include <semaphore.h>
+#include <pthread.h>
+#include <time.h>
+#include "Socket.hpp"
+#include "MpscQueue.hpp"
+using namespace std;
+
+
+// Packed (IPv4, port) identity of a client session: ip in bits 16..47, port in bits 0..15
+typedef uint64_t session_key;
+
+inline session_key make_session_key(string ipv4, int port)
+{
+    uint32_t ip = ntohl(inet_addr(ipv4.c_str()));
+    return ((uint64_t)ip << 16) | (uint16_t)port;
+}
+
+inline session_key make_session_key(host_address address)
+{
+    return make_session_key(address.ipv4, address.port);
+}
+
+
+typedef struct __notification {
+
+    __notification();
+    __notification(uint32_t new_id, string new_author, time_t new_timestamp, string new_body, uint16_t new_length, uint32_t new_pending) :
+        id(new_id), author(new_author), timestamp(new_timestamp), body(new_body), length(new_length), pending(new_pending) {}
+
+    uint32_t id; //Identificador da notificação (sugere-se um identificador único)
+    string author; 
+    time_t timestamp; //Timestamp da notificação
+    string body; //Mensagem
+    uint16_t length; //Tamanho da mensagem
+    uint32_t pending; //Quantidade de leitores pendentes
+
+    bool operator ==(__notification other) const {
+		return id == other.id;
+	}
+
+} notification;
+
+
+// Delivery channel owned by a session. Committed notifications are pushed into a lock-free
+// inbox and the session's sender drains it without touching the transaction mutex. The channel
+// is shared (not copied) between the live and the COPY_ state, so it survives deepcopies.
+class SessionChannel
+{
+public:
+    SessionChannel();
+    ~SessionChannel();
+
+    void push(shared_ptr<const notification> notif);   // any producer thread
+    void close();
+    bool is_closed();
+    bool wait_notifications(vector< shared_ptr<const notification> >* notifications);  // sender thread only, false if closed
+
+    // A sender serving many sessions, like a gateway link, waits on one semaphore for all of
+    // them and drains each channel without blocking
+    void share_wakeup(sem_t* shared);
+    bool drain(vector< shared_ptr<const notification> >* notifications);  // false if closed
+
+private:
+    MpscQueue< shared_ptr<const notification> > inbox;
+    atomic<bool> consumer_waiting;
+    atomic<bool> closed;
+    sem_t wakeup;
+    atomic<sem_t*> shared_wakeup;
+};
+
+
+typedef priority_queue< uint32_t, vector<uint32_t>, greater<uint32_t> > pending_queue;   // min_heap[notification]
+
+// An open client session with the notifications still waiting to be delivered to it
+typedef struct __user_session {
+
+    __user_session() : channel(make_shared<SessionChannel>()) {}
+    __user_session(string new_user, host_address new_address) :
+        user(new_user), address(new_address), channel(make_shared<SessionChannel>()) {}
+
+    string user;
+    host_address address;
+    pending_queue pending;          // Notification ids to send, oldest first. Ids up to the session
+                                    // delivery watermark were already sent and are pruned lazily
+
+    shared_ptr<SessionChannel> channel;  // Delivery to this session's sender only
+
+} user_session;
+
+
+// Registered delivery target of a session, notifications with id below primed_before were
+// already handed to the channel when the session was registered
+typedef struct __delivery_target {
+
+    __delivery_target(session_key new_key, shared_ptr<SessionChannel> new_channel, uint32_t new_primed_before) :
+        key(new_key), channel(new_channel), primed_before(new_primed_before) {}
+
+    session_key key;
+    shared_ptr<SessionChannel> channel;
+    uint32_t primed_before;
+
+} delivery_target;
+
+
+// Sessions that can receive notifications, indexed by follower id. Fan-out workers read it
+// concurrently outside the transaction mutex, sessions are added and removed on commit.
+class DeliveryIndex
+{
+public:
+    DeliveryIndex();
+    ~DeliveryIndex();
+
+    void register_session(uint32_t user_id, session_key key, shared_ptr<SessionChannel> channel, uint32_t primed_before);
+    void unregister_session(uint32_t user_id, session_key key);
+    int deliver(uint32_t user_id, shared_ptr<const notification> notif);  // returns the sessions reached
+    bool empty();
+
+private:
+    pthread_rwlock_t lock;
+    unordered_map< uint32_t, vector<delivery_target> > targets;
+};
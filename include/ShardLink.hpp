@@ -0,0 +1,50 @@
+#pragma once
+#include <pthread.h>
+#include <map>
+#include <string>
+#include "Client.hpp"
+#include "BoundedQueue.hpp"
+#include "RttEstimator.hpp"
+#include "defines.hpp"
+using namespace std;
+
+
+// Connection from this shard's primary to the primary of another shard, for the steps a
+// user's home shard can't take alone: following someone who lives elsewhere, and handing
+// posts to the shards of the author's remote followers. Each request gets one SHARD_REPLY.
+// The link is opened on first use and reopened after any failure through whichever member
+// of the shard answers, following its redirect to the primary.
+// Posts waiting to be handed over live only in this primary's memory, they are not
+// replicated: the ones still queued when it fails never reach the other shard.
+class ShardLink
+{
+public:
+    ShardLink(int shard, int fromShard, map<string, int> addresses);
+
+    bool request(Packet packet, string* reply);    // false if no primary of the shard answered
+    void post(Packet packet);                       // sent in order by the link thread, retried while unreachable
+    bool primary_address(host_address* primary);    // the primary the link is open to, if it is
+
+private:
+    int shard;
+    int fromShard;
+    map<string, int> addresses;    // <ip, port> of the shard's members
+
+    pthread_mutex_t mutex;          // one request on the wire at a time
+    ClientSocket* socket;
+    bool connected;
+
+    pthread_mutex_t addressMutex;   // the address is read while a request may hold the link
+    host_address primary;
+    bool primaryKnown;
+
+    BoundedQueue<Packet>* posted;
+    string origin;          // names this link's posts to the other shard, unique per primary run
+    uint32_t lastPost;      // number of the last post taken by the link thread
+
+    bool connect();
+    bool greet(host_address* reached);
+    void disconnect();
+
+    static void *postThread(void *linkArg);
+};
@@ -0,0 +1,35 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include "defines.hpp"
+using namespace std;
+
+
+// Which replica group owns each user. Servers are listed with their shard in ipporta.txt;
+// every shard is placed SHARD_RING_VNODES times on a hash ring and a user belongs to the
+// first point at or after its own hash, so adding a shard only moves the users that land
+// on its points. Every server and client must read the same file to agree on the owners.
+// Built once at startup, read only afterwards.
+class ShardMap
+{
+public:
+    ShardMap();
+
+    void add_server(string ip, int port, int shard);
+
+    int size();                             // number of shards
+    vector<int> shards();
+    map<string, int> addresses_of(int shard);   // <ip, port>
+    int shard_of_address(string ip);            // -1 if not listed
+    int shard_of_user(const string& user);
+
+private:
+    map<string, pair<int, int> > servers;   // <ip, <port, shard>>
+    vector<int> shard_ids;                  // sorted
+    map<uint64_t, int> ring;                // <point, shard>
+
+    void place_shard(int shard);
+};
@@ -2,14 +2,17 @@
 #define SOCKET_HEADER
 
 #include <stdint.h>
+#include <sys/time.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
 #include <iostream>
 #include <pthread.h>
+#include <time.h>
 #include <string>
 #include "Packet.hpp"
 using namespace std;
@@ -23,7 +26,9 @@ typedef struct address {
 	}
 
     bool operator <(const address& other) const {
-		return port < other.port;
+		if (port != other.port)
+			return port < other.port;
+		return ipv4 < other.ipv4;
 	}
 	
 } host_address;
@@ -34,6 +39,11 @@ class Socket
 {
 	private:
 		int socketfd;
+		uint32_t lastFrame;		// last numbered frame accepted from a peer server
+		struct timespec lastRetransmitRequest;
+
+		static bool readFrame(int socketfd, Packet* pkt);
+		Packet* requestRetransmit(Packet* pkt);
 
 	public:
 		int getSocketfd();
@@ -43,6 +53,7 @@ class Socket
         int sendPacket(Packet packet);
 		int sendPacket(Packet pkt, int socketfd);
 		void reopenSocket();
+		void setReadTimeout(int timeoutMs);	// reads fail after it, 0 waits forever
 		
 		Socket();
 		Socket(int socketfd);
@@ -0,0 +1,39 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include "defines.hpp"
+using namespace std;
+
+
+// Incremental digest of the replicated per-user state. Users are hashed into
+// STATE_DIGEST_BUCKETS buckets, a bucket hash is the sum of its users' hashes, so a
+// change only rehashes the users it touched. Buckets are grouped STATE_DIGEST_GROUP_SIZE
+// at a time under a group hash: replicas compare the group hashes first and only then
+// the buckets of the groups that differ, like the two top levels of a Merkle tree.
+// Not thread safe, the server only touches it under the transaction mutex.
+class StateDigest
+{
+public:
+    StateDigest();
+
+    static int bucket_of(const string& user);
+    static int groups();
+    static uint64_t hash(const string& data);
+
+    void mark_dirty(const string& user);
+    vector<string> take_dirty();
+
+    void set_user(const string& user, uint64_t userHash);
+    void remove_user(const string& user);
+
+    uint64_t bucket_hash(int bucket);
+    uint64_t group_hash(int group);
+
+private:
+    map<string, uint64_t> user_hashes;
+    set<string> dirty;              // changed since the last refresh
+    vector<uint64_t> buckets;
+};
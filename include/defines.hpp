@@ -5,25 +5,47 @@ enum{
     MESSAGE_PKT,                // To communicate command errors and similar stuff 
     COMMAND_FOLLOW_PKT,         // User wants to follow someone
     COMMAND_SEND_PKT,           // User wants to send a notification
-    USER_INFO_PKT,              // Sends a username in the payload
+    USER_INFO_PKT,              // Sends a username in the payload, followed by " replica" when a backup delivers its notifications
     SESSION_OPEN_SUCCEDED,      // When server could connect client to a session
     SESSION_OPEN_FAILED,        // When server could not connect client to a session
-    ALREADY_PRIMARY,            // Message to confirm that client is already connected to primary server
+    ALREADY_PRIMARY,            // Message to confirm that client is already connected to primary server, with the partition map if the client's is outdated
     CURRENT_PRIMARY,            // Message containing who's the current primary server
     USER_INFO_RECONNECT,        // Client message to inform the user it has a session opened before primary went down
     ASK_PRIMARY,                // Backup server sends message asking who's the primary server (what's its port)
     INITIALIZE_STATE,           // Backup server sends message to primary send all committed events on the system
     PRIMARY_SERVER_ADDRESS,     // Answer of what's the address for the primary server, payload format: "addr:port", exaple: "127.0.0.1:4000"
     SERVER_PEER_CONNECTING,     // Used to inform that the established connection is server-server
-    CLIENT_CONNECTING,          //  Used to inform that the established connection is client-server
+    CLIENT_CONNECTING,          //  Used to inform that the established connection is client-server, payload format: cached partition map version
+    DELIVERY_PROGRESS,          // Batch of "session delivered up to id N" watermarks, payload format: "key:N:user;..."
+    CATCH_UP_EVENT,             // Logged event replayed to a backup that fell out of synchronous replication
+    APPLIED_PROGRESS,           // Backup reports the last event seqn it applied, payload format: "seqn"
+    STATE_DIGEST,               // Primary's group hashes at event seqn, payload format: "h0,h1,..." in hex
+    BUCKET_DIGEST,              // Backup's bucket hashes of a group that differs, payload format: "id:group:h0,h1,..."
+    STATE_REPAIR,               // One record of a bucket's state at event seqn, payload format: "kind:..."
+    RETRANSMIT,                 // Asks a peer server to send its frames again from number N on, payload format: "N"
+    CORRUPT_FRAME,              // Never sent: what readPacket returns for a frame that failed its checksum
+    SHARD_CONNECTING,           // The primary of another shard opens a link, payload format: "shard"
+    SHARD_FOLLOW,               // Follow of a user owned by the receiving shard, payload format: "follower:followed"
+    SHARD_NOTIFICATION,         // Post whose author has followers on the receiving shard, author and timestamp in the header
+    SHARD_REPLY,                // Answer to a shard request, payload format: "1" done or "0" not done
+    STALE_PARTITION_MAP,        // A backup tells a client to go to the primary, payload format: "shard=ip:port;..."
+    QUERY_CONNECTING,           // Used to inform that the established connection only carries read-only queries
+    QUERY_PKT,                  // Read-only command, payload format: "COMMAND @user", seqn the replica must have applied
+    QUERY_RESULT,               // One line of a query answer, seqn the replica had applied; an empty one ends it
+    QUERY_STALE,                // The replica did not apply the requested seqn in time, ask the primary
+    DELIVERY_CONNECTING,        // Client connection a replica delivers a session's notifications on, payload format: "user:ip:port", seqn of the login
+    GATEWAY_CONNECTING,         // Upstream link of a gateway, every frame on it carries the client session it belongs to
+    GATEWAY_SESSION_OPEN,       // Client logged in through the gateway, payload format: "user:ip:port"
+    GATEWAY_SESSION_RESUME,     // Session the gateway carried over from a former primary, same payload
+    GATEWAY_SESSION_CLOSED,     // Client of the session left the gateway
     
     // Event packets
     CREATE_NOTIFICATION,
     READ_OFFLINE,
-    READ_NOTIFICATIONS,
     CLOSE_SESSION,
     OPEN_SESSION,
     FOLLOW,
+    MULTI_OP,   // Several of the events above in a single transaction
     
     OK,     // Backup confirmed event modification
     SOK,    // Server confirmed that all backups confirmed event modification
@@ -65,6 +87,11 @@ enum{
 #endif
 
 
+#ifndef MAX_EVENT_OPS
+#define MAX_EVENT_OPS 4
+#endif
+
+
 #ifndef PKT_HEADER_BUFFER_LENGTH
 #define PKT_HEADER_BUFFER_LENGTH 4     
 #endif
@@ -81,14 +108,280 @@ enum{
 #define MAX_TCP_CONNECTIONS 256
 #endif
 
+// A starting server connects to every other member at once. Members that refuse are down, the
+// ones that neither accept nor refuse within PEER_DISCOVERY_TIMEOUT_MS are tried again, and only
+// after PEER_DISCOVERY_ROUNDS silent rounds are they taken as down
+#ifndef PEER_DISCOVERY_TIMEOUT_MS
+#define PEER_DISCOVERY_TIMEOUT_MS 1000
+#endif
+
+#ifndef PEER_DISCOVERY_ROUNDS
+#define PEER_DISCOVERY_ROUNDS 3
+#endif
+
+// Commit and election timeouts follow the measured round-trip time of the peers involved,
+// SRTT + RTT_VARIANCE_FACTOR * RTTVAR, kept between a floor and a ceiling. The values in
+// seconds are used for peers that were not measured yet
+#ifndef RTT_VARIANCE_FACTOR
+#define RTT_VARIANCE_FACTOR 4
+#endif
+
 #ifndef ELECTION_TIMEOUT
 #define ELECTION_TIMEOUT 2
 #endif
 
+#ifndef ELECTION_TIMEOUT_FLOOR_MS
+#define ELECTION_TIMEOUT_FLOOR_MS 300
+#endif
+
+#ifndef ELECTION_TIMEOUT_CEILING_MS
+#define ELECTION_TIMEOUT_CEILING_MS 10000
+#endif
+
 #ifndef BACKUPS_RESPONSE_TIMEOUT
 #define BACKUPS_RESPONSE_TIMEOUT 7
 #endif
 
+#ifndef COMMIT_TIMEOUT_FLOOR_MS
+#define COMMIT_TIMEOUT_FLOOR_MS 200
+#endif
+
+#ifndef COMMIT_TIMEOUT_CEILING_MS
+#define COMMIT_TIMEOUT_CEILING_MS (BACKUPS_RESPONSE_TIMEOUT * 1000)
+#endif
+
+// How long the primary waits before answering the client on each event type
+#ifndef DURABILITY_LEVELS
+#define DURABILITY_LEVELS
+enum{
+    SYNC_ALL = 0,   // every connected backup confirmed the event
+    SYNC_QUORUM,    // enough backups confirmed for a majority of the group
+    ASYNC           // committed locally, streamed to the backups in the background
+};
+#endif
+
+#ifndef DEFAULT_DURABILITY
+#define DEFAULT_DURABILITY SYNC_ALL
+#endif
+
+#ifndef OPEN_SESSION_DURABILITY
+#define OPEN_SESSION_DURABILITY DEFAULT_DURABILITY
+#endif
+
+#ifndef CLOSE_SESSION_DURABILITY
+#define CLOSE_SESSION_DURABILITY DEFAULT_DURABILITY
+#endif
+
+#ifndef READ_OFFLINE_DURABILITY
+#define READ_OFFLINE_DURABILITY DEFAULT_DURABILITY
+#endif
+
+#ifndef FOLLOW_DURABILITY
+#define FOLLOW_DURABILITY DEFAULT_DURABILITY
+#endif
+
+#ifndef CREATE_NOTIFICATION_DURABILITY
+#define CREATE_NOTIFICATION_DURABILITY DEFAULT_DURABILITY
+#endif
+
+// STAR: the primary sends every event to each backup and collects every OK.
+// CHAIN: the primary sends to the first backup, each backup forwards to the next by id
+// and the last one confirms; primary egress stays constant as replicas are added.
+#ifndef REPLICATION_TOPOLOGIES
+#define REPLICATION_TOPOLOGIES
+enum{
+    STAR_TOPOLOGY = 0,
+    CHAIN_TOPOLOGY
+};
+#endif
+
+#ifndef REPLICATION_TOPOLOGY
+#define REPLICATION_TOPOLOGY STAR_TOPOLOGY
+#endif
+
+// Catch-up stream of lagging backups: events sent per round, unapplied events allowed in
+// flight, and how often the primary serves it
+#ifndef CATCH_UP_BATCH
+#define CATCH_UP_BATCH 32
+#endif
+
+#ifndef CATCH_UP_WINDOW
+#define CATCH_UP_WINDOW 256
+#endif
+
+#ifndef CATCH_UP_INTERVAL_MS
+#define CATCH_UP_INTERVAL_MS 50
+#endif
+
+// Rounds a lagging backup that was sent the whole log may go without applying more of it
+// before the stream is sent again from what it applied
+#ifndef CATCH_UP_STALL_ROUNDS
+#define CATCH_UP_STALL_ROUNDS 20
+#endif
+
+// Events in a row a backup may leave unanswered past the commit timeout before it is moved to
+// catch-up. A single late OK is usually the timeout floor, not a slow backup
+#ifndef MISSED_ACKS_BEFORE_LAGGING
+#define MISSED_ACKS_BEFORE_LAGGING 3
+#endif
+
+// Anti-entropy: the primary sends the digest of its per-user state every STATE_DIGEST_INTERVAL_MS
+// and backups ask for the buckets that differ. Users are hashed into STATE_DIGEST_BUCKETS buckets,
+// compared STATE_DIGEST_GROUP_SIZE at a time
+#ifndef STATE_DIGEST_BUCKETS
+#define STATE_DIGEST_BUCKETS 64
+#endif
+
+#ifndef STATE_DIGEST_GROUP_SIZE
+#define STATE_DIGEST_GROUP_SIZE 8
+#endif
+
+#ifndef STATE_DIGEST_INTERVAL_MS
+#define STATE_DIGEST_INTERVAL_MS 5000
+#endif
+
+// Longest STATE_REPAIR record, lists longer than this are split over several packets
+#ifndef STATE_REPAIR_RECORD_LENGTH
+#define STATE_REPAIR_RECORD_LENGTH 200
+#endif
+
+// Frames kept after being written to a peer server, so a corrupt one can be sent again
+#ifndef PEER_RETRANSMIT_WINDOW
+#define PEER_RETRANSMIT_WINDOW 512
+#endif
+
+// While frames after a missing one keep arriving, it is asked for again at most this often, in
+// case the request or the repeated frames were lost too
+#ifndef PEER_RETRANSMIT_RETRY_MS
+#define PEER_RETRANSMIT_RETRY_MS 100
+#endif
+
+// Packets queued for one server before broadcasting to it has to wait
+#ifndef PEER_OUTBOUND_QUEUE_CAPACITY
+#define PEER_OUTBOUND_QUEUE_CAPACITY 1024
+#endif
+
+// Bulk packets a backup buffers off its group receiver; the primary already bounds them
+// through CATCH_UP_WINDOW and one live event in flight, so this only guards memory
+#ifndef INBOUND_BULK_CAPACITY
+#define INBOUND_BULK_CAPACITY 4096
+#endif
+
+// Async events the primary may have committed but not yet sent before new transactions wait
+#ifndef ASYNC_REPLICATION_MAX_LAG
+#define ASYNC_REPLICATION_MAX_LAG 256
+#endif
+
+// Authors with at least this many followers are fanned out on read: their notifications are
+// appended to a timeline that followers merge at delivery time instead of being pushed to each one.
+// Must be the same on every replica, since backups take the same decision when replaying events.
+#ifndef FANOUT_ON_READ_THRESHOLD
+#define FANOUT_ON_READ_THRESHOLD 1000
+#endif
+
+// How often the primary streams delivery watermarks to the backups
+#ifndef DELIVERY_PROGRESS_FLUSH_MS
+#define DELIVERY_PROGRESS_FLUSH_MS 200
+#endif
+
+#ifndef FANOUT_WORKERS
+#define FANOUT_WORKERS 4
+#endif
+
+// Followers per fan-out work item, idle workers steal items from busy ones
+#ifndef FANOUT_CHUNK_SIZE
+#define FANOUT_CHUNK_SIZE 1024
+#endif
+
+// Replicated events a backup buffers before the group receiver stops reading from the primary
+#ifndef APPLY_QUEUE_CAPACITY
+#define APPLY_QUEUE_CAPACITY 1024
+#endif
+
+// Accepted connections wait in a queue of ADMISSION_QUEUE_CAPACITY for one of ADMISSION_WORKERS
+// threads to run their handshake and session admission, the accept loop only accepts and closes
+// what does not fit. A handshake read waits at most ADMISSION_HANDSHAKE_TIMEOUT_MS
+#ifndef ADMISSION_WORKERS
+#define ADMISSION_WORKERS 8
+#endif
+
+#ifndef ADMISSION_QUEUE_CAPACITY
+#define ADMISSION_QUEUE_CAPACITY 256
+#endif
+
+#ifndef ADMISSION_HANDSHAKE_TIMEOUT_MS
+#define ADMISSION_HANDSHAKE_TIMEOUT_MS 5000
+#endif
+
+// Users are split between replica groups by a consistent-hash ring, each shard is placed on it
+// SHARD_RING_VNODES times. Posts for the followers of another shard wait in that shard's
+// queue, retried every SHARD_RETRY_INTERVAL_MS while its primary can't be reached
+#ifndef SHARD_RING_VNODES
+#define SHARD_RING_VNODES 64
+#endif
+
+#ifndef SHARD_FORWARD_QUEUE_CAPACITY
+#define SHARD_FORWARD_QUEUE_CAPACITY 1024
+#endif
+
+#ifndef SHARD_RETRY_INTERVAL_MS
+#define SHARD_RETRY_INTERVAL_MS 500
+#endif
+
+// Read-only queries answered by any replica once it applied the seqn the client last saw,
+// waiting up to QUERY_STALENESS_WAIT_MS for it; TIMELINE lists the last QUERY_TIMELINE_LENGTH posts
+#ifndef QUERY_STALENESS_WAIT_MS
+#define QUERY_STALENESS_WAIT_MS 500
+#endif
+
+#ifndef QUERY_TIMELINE_LENGTH
+#define QUERY_TIMELINE_LENGTH 10
+#endif
+
+// Which server pushes notifications to a client: the primary on the session connection, or a
+// replica of the home shard on a connection of its own, taking the per-session sender off the
+// primary. Writes always go to the primary; replicas send their delivery progress back to it
+#ifndef SESSION_DELIVERY_MODES
+#define SESSION_DELIVERY_MODES
+enum{
+    PRIMARY_DELIVERY = 0,
+    REPLICA_DELIVERY
+};
+#endif
+
+#ifndef SESSION_DELIVERY
+#define SESSION_DELIVERY PRIMARY_DELIVERY
+#endif
+
+// Port app_gateway takes clients on, how many links it keeps open to each shard's primary and
+// how long it waits between attempts to find the primary while a shard elects a new one
+#ifndef GATEWAY_PORT
+#define GATEWAY_PORT 4100
+#endif
+
+#ifndef GATEWAY_UPSTREAM_LINKS
+#define GATEWAY_UPSTREAM_LINKS 2
+#endif
+
+#ifndef GATEWAY_RETRY_INTERVAL_MS
+#define GATEWAY_RETRY_INTERVAL_MS 200
+#endif
+
+// Frames relayed to one client waiting for its writer, a client that falls further behind is dropped
+#ifndef GATEWAY_CLIENT_QUEUE_CAPACITY
+#define GATEWAY_CLIENT_QUEUE_CAPACITY 256
+#endif
+
+// Where clients keep the last partition map they got, relative to the bin folder, and how many
+// servers named by it a client tries before asking the shard members in order
+#ifndef PARTITION_MAP_CACHE_FILE
+#define PARTITION_MAP_CACHE_FILE "partition_map.cache"
+#endif
+
+#ifndef PARTITION_MAP_MAX_HOPS
+#define PARTITION_MAP_MAX_HOPS 3
+#endif
+
 // MUDAR ISSO AQUI QUANDO IMPLEMENTAR O TRECO DO ARQUIVO
 #ifndef SERVER_ADDR1
 #define SERVER_ADDR1 "127.0.0.1"
@@ -5,10 +5,17 @@ using namespace std;
 
 
 
-Client::Client(string user, map<string, int> possibleServerAddresses){
+Client::Client(string user, map<string, int> possibleServerAddresses, int homeShard, bool behindGateway){
     
     this->user = user;
     this->possibleServerAddresses = possibleServerAddresses;
+    this->homeShard = homeShard;
+    this->behindGateway = behindGateway;
+    this->queryConnected = false;
+    this->deliveryConnected = false;
+    this->lastSeenSeqn = 0;
+    if (!this->behindGateway)
+        this->partitionMap.load(PARTITION_MAP_CACHE_FILE);
     this->establishConnection();
 
     pthread_mutex_init(&mutex_print, NULL);
@@ -22,11 +29,12 @@ void Client::establishConnection(){
 
     this->connectToPrimaryServer(false);  // exit(1) if fails to connect
     this->originalClientPort = this->socket.getClientPort();
+    this->originalClientIP = this->socket.getClientIP();
 
     cout << "Connected to server! Trying to send packet with user info..." << "\n\n";
 
     // Send user information to initiate session
-    Packet userInfoPacket = Packet(USER_INFO_PKT, this->user.c_str());
+    Packet userInfoPacket = Packet(USER_INFO_PKT, this->userInfo().c_str());
     this->socket.sendPacket(userInfoPacket);
 
     // Read server answer
@@ -35,6 +43,7 @@ void Client::establishConnection(){
 
     if (serverAnswer != NULL){
         cout << serverAnswer->getPayload() << "\n\n";
+        this->seeSeqn(serverAnswer->getSeqn());
 
         if (serverAnswer->getType() == SESSION_OPEN_SUCCEDED)
             return;
@@ -47,12 +56,27 @@ void Client::establishConnection(){
     }
 }
 
+// the user, and whether the primary should leave its notifications to a replica
+string Client::userInfo(){
+    if (SESSION_DELIVERY == REPLICA_DELIVERY && !this->behindGateway)
+        return this->user + " replica";
+    return this->user;
+}
+
+// the receivers report seqns concurrently, lastSeenSeqn only moves forward. Seqns wrap, so
+// newer is compared as the server does
+void Client::seeSeqn(uint16_t seqn){
+    uint16_t seen = this->lastSeenSeqn.load();
+    while ((seen == 0 || (int16_t)(seqn - seen) > 0) && seqn != 0 && !this->lastSeenSeqn.compare_exchange_weak(seen, seqn))
+        ;
+}
+
 void Client::reestablishConnection(){
     
     this->connectToPrimaryServer(true);  // exit(1) if fails to connect
 
     // Send user information to initiate session
-    Packet userInfoPacket = Packet(USER_INFO_RECONNECT, this->user.c_str());
+    Packet userInfoPacket = Packet(USER_INFO_RECONNECT, this->userInfo().c_str());
     this->socket.sendPacket(userInfoPacket);
 
     // Send previous connected port used to identify session
@@ -70,57 +94,73 @@ void Client::connectToPrimaryServer(bool reestablishingConnection){
     else 
         cout << "Trying to connect to server...\n\n";
 
-    
-    string serverIP;
-    int serverPort;
-    bool noConnections = true;
+    // Straight to the primary the cached map names, no redirect round-trip
+    if (this->connectToCachedPrimary())
+        return;
+
+    // No usable map: any member of the shard answers with a fresh one
     for (auto &possibleAddress : this->possibleServerAddresses){
-        
-        serverIP = possibleAddress.first;
-        serverPort = possibleAddress.second;
 
-        if (this->socket.connectToServer(serverIP.c_str(), serverPort)){
-            noConnections = false;
-            break;
+        this->socket.reopenSocket();
+        if (!this->socket.connectToServer(possibleAddress.first.c_str(), possibleAddress.second))
+            continue;
+
+        if (this->greetServer()){
+            cout << "Connected to new server at " << possibleAddress.first << ":" << possibleAddress.second << "\n\n";
+            return;
         }
+        if (this->connectToCachedPrimary())
+            return;
     }
 
-    if (noConnections){
-        if(reestablishingConnection)
-            cout << "ERROR lost connection to server!\n";
-        else
-            cout << "ERROR all servers seem to be down! Aborting...\n";
-        exit(1);
-    }
+    if(reestablishingConnection)
+        cout << "ERROR lost connection to server!\n";
+    else
+        cout << "ERROR all servers seem to be down! Aborting...\n";
+    exit(1);
+}
 
-    // Else
-    this->socket.sendPacket(Packet(CLIENT_CONNECTING, ""));
+// follows the map while servers answer it is stale, up to PARTITION_MAP_MAX_HOPS servers
+bool Client::connectToCachedPrimary(){
 
-    // Wait for server message telling who's the primary server
-    Packet *primaryServerIpAddress;
-    primaryServerIpAddress = this->socket.readPacket();
-    if (primaryServerIpAddress->getType() == ALREADY_PRIMARY)
-    {
-        cout << "Connected to new server at " << serverIP<<":"<<serverPort << "\n\n";
-        return;
+    host_address primary;
+    for (int hop = 0; hop < PARTITION_MAP_MAX_HOPS; hop++){
+        if (!this->partitionMap.primary_of(this->homeShard, &primary))
+            return false;
+
+        this->socket.reopenSocket();
+        if (!this->socket.connectToServer(primary.ipv4.c_str(), primary.port)){
+            this->partitionMap.forget_primary(this->homeShard);
+            return false;
+        }
+
+        if (this->greetServer()){
+            cout << "Connected to new server at " << primary.ipv4 << ":" << primary.port << "\n\n";
+            return true;
+        }
     }
-    // Else
-    serverIP = primaryServerIpAddress->getPayload();
 
-    Packet *primaryServerPort;
-    primaryServerPort = this->socket.readPacket();
-    serverPort = atoi(primaryServerPort->getPayload());
-    
-    this->socket.reopenSocket();
-    if (!this->socket.connectToServer(serverIP.c_str(), serverPort)){
-        if(reestablishingConnection)
-            cout << "ERROR lost connection to server!\n";
-        else
-            cout << "ERROR while connecting to primary server!\n";
-        exit(1); 
+    return false;
+}
+
+// announces the cached map version, keeps any newer map the server answers with;
+// true if the server is the primary
+bool Client::greetServer(){
+
+    this->socket.sendPacket(Packet(CLIENT_CONNECTING, this->partitionMap.version_string().c_str()));
+
+    Packet *answer = this->socket.readPacket();
+    if (answer == NULL)
+        return false;
+
+    if (strlen(answer->getPayload()) > 0){
+        this->partitionMap = PartitionMap::parse(answer->getPayload());
+        this->partitionMap.save(PARTITION_MAP_CACHE_FILE);
     }
-    this->socket.sendPacket(Packet(CLIENT_CONNECTING, ""));
-    cout << "Connected to new server at " << serverIP<<":"<<serverPort << "\n\n";
+
+    bool isPrimary = answer->getType() == ALREADY_PRIMARY;
+    delete answer;
+    return isPrimary;
 }
 
 
@@ -204,6 +244,102 @@ void Client::executeFollowCommand() {
 }
 
 
+// Answered by a replica of the home shard that applied everything we saw the primary confirm,
+// or by the primary through the session connection when that replica is behind or gone
+void Client::executeQueryCommand(string command, string target) {
+    Packet query = Packet(QUERY_PKT, (command + " " + target).c_str());
+    query.setSeqn(this->lastSeenSeqn);
+
+    if (this->queryReplica(query))
+        return;
+
+    this->socket.sendPacket(query);
+}
+
+bool Client::queryReplica(Packet query) {
+    if (!this->queryConnected && !this->connectToQueryReplica())
+        return false;
+
+    if (this->querySocket.sendPacket(query) < 0){
+        this->queryConnected = false;
+        return false;
+    }
+
+    while (true){
+        Packet *line = this->querySocket.readPacket();
+        if (line == NULL){
+            this->queryConnected = false;
+            return false;
+        }
+        if (line->getType() != QUERY_RESULT){   // QUERY_STALE
+            delete line;
+            return false;
+        }
+
+        this->seeSeqn(line->getSeqn());
+        bool last = strlen(line->getPayload()) == 0;
+        if (!last)
+            cout << line->getPayload() << "\n";
+        delete line;
+        if (last){
+            cout << "\n";
+            return true;
+        }
+    }
+}
+
+bool Client::connectToQueryReplica() {
+    if (!this->connectToReplica(&this->querySocket))
+        return false;
+
+    this->querySocket.sendPacket(Packet(QUERY_CONNECTING, ""));
+    this->queryConnected = true;
+    return true;
+}
+
+// the replica only accepts once it applied our login, so it waits for lastSeenSeqn
+bool Client::connectToDeliveryReplica() {
+    if (!this->connectToReplica(&this->deliverySocket))
+        return false;
+
+    string session = this->user + ":" + this->originalClientIP + ":" + to_string(this->originalClientPort);
+    Packet deliveryPacket = Packet(DELIVERY_CONNECTING, session.c_str());
+    deliveryPacket.setSeqn(this->lastSeenSeqn);
+    this->deliverySocket.sendPacket(deliveryPacket);
+    this->deliveryConnected = true;
+    return true;
+}
+
+// users are spread over the shard's backups by name, the primary is only used when alone
+bool Client::connectToReplica(ClientSocket* replicaSocket) {
+    if (this->behindGateway)    // everything goes through the session
+        return false;
+
+    vector< pair<string, int> > replicas(this->possibleServerAddresses.begin(), this->possibleServerAddresses.end());
+    if (replicas.empty())
+        return false;
+
+    host_address primary;
+    bool primaryKnown = this->partitionMap.primary_of(this->homeShard, &primary);
+    size_t first = hash<string>()(this->user) % replicas.size();
+
+    for (int pass = 0; pass < 2; pass++){
+        for (size_t i = 0; i < replicas.size(); i++){
+            pair<string, int> replica = replicas[(first + i) % replicas.size()];
+            bool isPrimary = primaryKnown && replica.first == primary.ipv4 && replica.second == primary.port;
+            if (isPrimary != (pass == 1))
+                continue;
+
+            replicaSocket->reopenSocket();
+            if (replicaSocket->connectToServer(replica.first.c_str(), replica.second))
+                return true;
+        }
+    }
+
+    return false;
+}
+
+
 void *Client::controlThread(void* arg){
 
     Client *client = (Client*) arg; 
@@ -267,6 +403,19 @@ void *Client::do_threadSender(void* arg){
             //cout << "Done!\n";
         }
             
+        else if (command.compare("FOLLOWERS") == 0 || command.compare("FOLLOWING") == 0 ||
+                 command.compare("STATS") == 0 || command.compare("TIMELINE") == 0) {
+            string target = client->user;   // about ourselves unless a user follows the command
+            if (c == ' ') {
+                target = "";
+                while ((c = getchar()) != LF && c != EOF) {
+                    if (c != CR)
+                        target += c;
+                }
+            }
+            client->executeQueryCommand(command, target);
+        }
+
         else if (command.compare("SEND") == 0) {
             client->executeSendCommand();
             //cout << "Done!\n";
@@ -311,6 +460,11 @@ void *Client::do_threadReceiver(void* arg){
             }
             else if (readPacket->getType() == MESSAGE_PKT){
                 cout << "\n" << readPacket->getPayload() << "\n\n";
+                client->seeSeqn(readPacket->getSeqn());
+            }
+            else if (readPacket->getType() == QUERY_RESULT){
+                cout << readPacket->getPayload() << "\n";
+                client->seeSeqn(readPacket->getSeqn());
             }
         pthread_mutex_unlock(&(client->mutex_print));
     }
@@ -318,6 +472,38 @@ void *Client::do_threadReceiver(void* arg){
 
 
 
+// Notifications of a session whose delivery was moved off the primary. A replica that is gone
+// or does not know the session yet is replaced by the next one in a second
+void *Client::do_threadDeliveryReceiver(void* arg){
+
+    Client *client = (Client*) arg;
+    Packet* readPacket;
+
+    while (true) {
+        if (!client->deliveryConnected && !client->connectToDeliveryReplica()){
+            sleep(1);
+            continue;
+        }
+
+        readPacket = client->deliverySocket.readPacket();
+        if (readPacket == NULL){
+            client->deliveryConnected = false;
+            sleep(1);
+            continue;
+        }
+
+        pthread_mutex_lock(&(client->mutex_print));
+            if (readPacket->getType() == NOTIFICATION_PKT){
+                cout << "Tweet from " << readPacket->getAuthor() << " at " << readPacket->getTimestamp() << ":" << endl;
+                cout << readPacket->getPayload() << "\n\n";
+            }
+        pthread_mutex_unlock(&(client->mutex_print));
+        delete readPacket;
+    }
+}
+
+
+
 bool ClientSocket::connectToServer(){
     struct sockaddr_in serv_addr;
     struct hostent *server;
@@ -358,4 +544,11 @@ int ClientSocket::getClientPort(){
     socklen_t len = sizeof(sin);
     getsockname(this->getSocketfd(), (struct sockaddr *)&sin, &len);
     return ntohs(sin.sin_port);
+}
+
+string ClientSocket::getClientIP(){
+    struct sockaddr_in sin;
+    socklen_t len = sizeof(sin);
+    getsockname(this->getSocketfd(), (struct sockaddr *)&sin, &len);
+    return inet_ntoa(sin.sin_addr);
 }
\ No newline at end of file
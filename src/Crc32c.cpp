@@ -0,0 +1,128 @@
+#include "../include/Crc32c.hpp"
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+
+#define CRC32C_POLY 0x82F63B78     // reflected Castagnoli polynomial
+
+
+typedef uint32_t (*crc32c_function)(uint32_t crc, const unsigned char* data, size_t length);
+
+// tables[k][b]: CRC of byte b followed by k zero bytes, for eight bytes per step
+static uint32_t slicing_tables[8][256];
+
+static bool build_slicing_tables()
+{
+    for (uint32_t b = 0; b < 256; b++)
+    {
+        uint32_t crc = b;
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        slicing_tables[0][b] = crc;
+    }
+
+    for (uint32_t b = 0; b < 256; b++)
+        for (int k = 1; k < 8; k++)
+            slicing_tables[k][b] = (slicing_tables[k - 1][b] >> 8) ^ slicing_tables[0][slicing_tables[k - 1][b] & 0xFF];
+
+    return true;
+}
+
+static uint32_t crc32c_slicing(uint32_t crc, const unsigned char* data, size_t length)
+{
+    static bool tables_ready = build_slicing_tables();
+    (void) tables_ready;
+
+    while (length >= 8)
+    {
+        uint32_t low, high;
+        memcpy(&low, data, 4);
+        memcpy(&high, data + 4, 4);
+        low ^= crc;     // little endian, like every host this runs on
+
+        crc = slicing_tables[7][low & 0xFF] ^ slicing_tables[6][(low >> 8) & 0xFF]
+            ^ slicing_tables[5][(low >> 16) & 0xFF] ^ slicing_tables[4][low >> 24]
+            ^ slicing_tables[3][high & 0xFF] ^ slicing_tables[2][(high >> 8) & 0xFF]
+            ^ slicing_tables[1][(high >> 16) & 0xFF] ^ slicing_tables[0][high >> 24];
+
+        data += 8;
+        length -= 8;
+    }
+
+    while (length-- > 0)
+        crc = (crc >> 8) ^ slicing_tables[0][(crc ^ *data++) & 0xFF];
+
+    return crc;
+}
+
+
+#if defined(__x86_64__)
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hardware(uint32_t crc, const unsigned char* data, size_t length)
+{
+    uint64_t crc64 = crc;
+    while (length >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += 8;
+        length -= 8;
+    }
+
+    crc = (uint32_t) crc64;
+    while (length-- > 0)
+        crc = _mm_crc32_u8(crc, *data++);
+    return crc;
+}
+
+static crc32c_function pick_crc32c()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2") ? crc32c_hardware : crc32c_slicing;
+}
+
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+
+static uint32_t crc32c_hardware(uint32_t crc, const unsigned char* data, size_t length)
+{
+    while (length >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        crc = __crc32cd(crc, word);
+        data += 8;
+        length -= 8;
+    }
+
+    while (length-- > 0)
+        crc = __crc32cb(crc, *data++);
+    return crc;
+}
+
+static crc32c_function pick_crc32c()
+{
+    return crc32c_hardware;     // built for a CPU that has the CRC extension
+}
+
+#else
+
+static crc32c_function pick_crc32c()
+{
+    return crc32c_slicing;
+}
+
+#endif
+
+
+uint32_t crc32c(const void* data, size_t length)
+{
+    static crc32c_function implementation = pick_crc32c();
+    return ~implementation(0xFFFFFFFF, (const unsigned char*) data, length);
+}
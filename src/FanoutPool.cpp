@@ -0,0 +1,177 @@
+#include "../include/FanoutPool.hpp"
+
+
+FanoutPool::FanoutPool(DeliveryIndex* index, int numWorkers)
+{
+    this->index = index;
+    this->remainingChunks = 0;
+    this->workGeneration = 0;
+
+    pthread_mutex_init(&jobsMutex, NULL);
+    pthread_cond_init(&jobsAvailable, NULL);
+    pthread_mutex_init(&workMutex, NULL);
+    pthread_cond_init(&workAvailable, NULL);
+    pthread_cond_init(&workDone, NULL);
+
+    for (int i = 0; i < numWorkers; i++)
+    {
+        worker_queue* workerQueue = new worker_queue();
+        pthread_mutex_init(&workerQueue->mutex, NULL);
+        queues.push_back(workerQueue);
+    }
+
+    pthread_t thread;
+    for (int i = 0; i < numWorkers; i++)
+    {
+        fanout_worker_args *args = (fanout_worker_args *) calloc(1, sizeof(fanout_worker_args));
+        args->pool = this;
+        args->worker = i;
+        pthread_create(&thread, NULL, FanoutPool::workerThread, (void *)args);
+        pthread_detach(thread);
+    }
+
+    pthread_create(&thread, NULL, FanoutPool::dispatcherThread, (void *)this);
+    pthread_detach(thread);
+}
+
+
+// called after the notification transaction committed, never blocks on the fan-out itself
+void FanoutPool::submit(shared_ptr<const notification> notif, shared_ptr<const vector<uint32_t> > follower_ids)
+{
+    shared_ptr<fanout_job> job = make_shared<fanout_job>();
+    job->notif = notif;
+    job->follower_ids = follower_ids;
+
+    pthread_mutex_lock(&jobsMutex);
+    jobs.push(job);
+    pthread_cond_signal(&jobsAvailable);
+    pthread_mutex_unlock(&jobsMutex);
+}
+
+
+bool FanoutPool::take_chunk(int worker, fanout_chunk* chunk)
+{
+    // Own deque first, newest chunk
+    worker_queue* own = queues[worker];
+    pthread_mutex_lock(&own->mutex);
+    if (!own->chunks.empty())
+    {
+        *chunk = own->chunks.back();
+        own->chunks.pop_back();
+        pthread_mutex_unlock(&own->mutex);
+        return true;
+    }
+    pthread_mutex_unlock(&own->mutex);
+
+    // Steal the oldest chunk of another worker
+    for (size_t i = 1; i < queues.size(); i++)
+    {
+        worker_queue* victim = queues[(worker + i) % queues.size()];
+        pthread_mutex_lock(&victim->mutex);
+        if (!victim->chunks.empty())
+        {
+            *chunk = victim->chunks.front();
+            victim->chunks.pop_front();
+            pthread_mutex_unlock(&victim->mutex);
+            return true;
+        }
+        pthread_mutex_unlock(&victim->mutex);
+    }
+
+    return false;
+}
+
+void FanoutPool::run_chunk(const fanout_chunk& chunk)
+{
+    const vector<uint32_t>& follower_ids = *(chunk.job->follower_ids);
+    for (size_t i = chunk.begin; i < chunk.end; i++)
+        index->deliver(follower_ids[i], chunk.job->notif);
+}
+
+void FanoutPool::finish_chunk()
+{
+    pthread_mutex_lock(&workMutex);
+    remainingChunks--;
+    if (remainingChunks == 0)
+        pthread_cond_signal(&workDone);
+    pthread_mutex_unlock(&workMutex);
+}
+
+
+void *FanoutPool::dispatcherThread(void *poolArg)
+{
+    FanoutPool* pool = (FanoutPool*) poolArg;
+
+    while (true)
+    {
+        pthread_mutex_lock(&pool->jobsMutex);
+        while (pool->jobs.empty())
+            pthread_cond_wait(&pool->jobsAvailable, &pool->jobsMutex);
+        shared_ptr<fanout_job> job = pool->jobs.front();
+        pool->jobs.pop();
+        pthread_mutex_unlock(&pool->jobsMutex);
+
+        size_t followers = job->follower_ids->size();
+        size_t numChunks = (followers + FANOUT_CHUNK_SIZE - 1) / FANOUT_CHUNK_SIZE;
+        if (numChunks == 0)
+            continue;
+
+        pthread_mutex_lock(&pool->workMutex);
+        pool->remainingChunks = numChunks;
+        pthread_mutex_unlock(&pool->workMutex);
+
+        for (size_t i = 0; i < numChunks; i++)
+        {
+            fanout_chunk chunk;
+            chunk.job = job;
+            chunk.begin = i * FANOUT_CHUNK_SIZE;
+            chunk.end = min(followers, chunk.begin + FANOUT_CHUNK_SIZE);
+
+            worker_queue* workerQueue = pool->queues[i % pool->queues.size()];
+            pthread_mutex_lock(&workerQueue->mutex);
+            workerQueue->chunks.push_back(chunk);
+            pthread_mutex_unlock(&workerQueue->mutex);
+        }
+
+        // Wait for the whole job before starting the next one, keeping per-session order
+        pthread_mutex_lock(&pool->workMutex);
+        pool->workGeneration++;
+        pthread_cond_broadcast(&pool->workAvailable);
+        while (pool->remainingChunks > 0)
+            pthread_cond_wait(&pool->workDone, &pool->workMutex);
+        pthread_mutex_unlock(&pool->workMutex);
+    }
+
+    return NULL;
+}
+
+
+void *FanoutPool::workerThread(void *workerArgs)
+{
+    struct fanout_worker_args *args = (struct fanout_worker_args *)workerArgs;
+    FanoutPool* pool = args->pool;
+    int worker = args->worker;
+    fanout_chunk chunk;
+
+    while (true)
+    {
+        pthread_mutex_lock(&pool->workMutex);
+        unsigned int generation = pool->workGeneration;
+        pthread_mutex_unlock(&pool->workMutex);
+
+        while (pool->take_chunk(worker, &chunk))
+        {
+            pool->run_chunk(chunk);
+            pool->finish_chunk();
+        }
+        chunk.job.reset();
+
+        // Nothing left to take or steal, sleep until the dispatcher publishes a new job
+        pthread_mutex_lock(&pool->workMutex);
+        while (generation == pool->workGeneration)
+            pthread_cond_wait(&pool->workAvailable, &pool->workMutex);
+        pthread_mutex_unlock(&pool->workMutex);
+    }
+
+    return NULL;
+}
@@ -0,0 +1,133 @@
+#include "../include/FollowerGraph.hpp"
+
+
+FollowerGraph::FollowerGraph()
+{
+
+}
+
+
+uint32_t FollowerGraph::add_user(string user)
+{
+    auto it = ids.find(user);
+    if (it != ids.end())
+        return it->second;
+
+    uint32_t id = names.size();
+    ids.insert({user, id});
+    names.push_back(user);
+    followers.push_back(vector<uint32_t>());
+    following.push_back(vector<uint32_t>());
+    return id;
+}
+
+bool FollowerGraph::has_user(string user)
+{
+    return ids.find(user) != ids.end();
+}
+
+bool FollowerGraph::get_id(string user, uint32_t* id)
+{
+    auto it = ids.find(user);
+    if (it == ids.end())
+        return false;
+
+    *id = it->second;
+    return true;
+}
+
+string FollowerGraph::name_of(uint32_t id)
+{
+    return names[id];
+}
+
+size_t FollowerGraph::size()
+{
+    return names.size();
+}
+
+
+bool FollowerGraph::follow(string user, string user_to_follow)
+{
+    uint32_t follower = add_user(user);
+    uint32_t followed = add_user(user_to_follow);
+
+    if (!insert_sorted(followers[followed], follower))
+        return false;
+
+    insert_sorted(following[follower], followed);
+    return true;
+}
+
+bool FollowerGraph::unfollow(string user, string user_to_unfollow)
+{
+    uint32_t follower, followed;
+    if (!get_id(user, &follower) || !get_id(user_to_unfollow, &followed))
+        return false;
+
+    if (!erase_sorted(followers[followed], follower))
+        return false;
+
+    erase_sorted(following[follower], followed);
+    return true;
+}
+
+bool FollowerGraph::is_follower(uint32_t follower, uint32_t followed)
+{
+    // Search the smaller of the two sides, they hold the same edge
+    if (followers[followed].size() < following[follower].size())
+        return contains_sorted(followers[followed], follower);
+    return contains_sorted(following[follower], followed);
+}
+
+
+const vector<uint32_t>& FollowerGraph::followers_of(uint32_t id)
+{
+    return followers[id];
+}
+
+const vector<uint32_t>& FollowerGraph::following_of(uint32_t id)
+{
+    return following[id];
+}
+
+size_t FollowerGraph::followers_count(string user)
+{
+    uint32_t id;
+    if (!get_id(user, &id))
+        return 0;
+    return followers[id].size();
+}
+
+
+bool FollowerGraph::insert_sorted(vector<uint32_t>& ids, uint32_t id)
+{
+    // Ids are handed out incrementally, so new edges usually land at the end
+    if (ids.empty() || ids.back() < id)
+    {
+        ids.push_back(id);
+        return true;
+    }
+
+    auto it = lower_bound(ids.begin(), ids.end(), id);
+    if (it != ids.end() && *it == id)
+        return false;
+
+    ids.insert(it, id);
+    return true;
+}
+
+bool FollowerGraph::erase_sorted(vector<uint32_t>& ids, uint32_t id)
+{
+    auto it = lower_bound(ids.begin(), ids.end(), id);
+    if (it == ids.end() || *it != id)
+        return false;
+
+    ids.erase(it);
+    return true;
+}
+
+bool FollowerGraph::contains_sorted(const vector<uint32_t>& ids, uint32_t id)
+{
+    return binary_search(ids.begin(), ids.end(), id);
+}
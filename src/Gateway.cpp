@@ -0,0 +1,353 @@
+#include "../include/Gateway.hpp"
+
+
+UpstreamLink::UpstreamLink(Gateway* gateway, int shard, map<string, int> addresses)
+{
+    this->gateway = gateway;
+    this->shard = shard;
+    this->addresses = addresses;
+    this->socket = new ClientSocket();
+    this->connected = false;
+
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&reconnected, NULL);
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, UpstreamLink::linkThread, (void *)this);
+    pthread_detach(thread);
+}
+
+
+// a member that is not the primary answers with the primary's ip and port
+bool UpstreamLink::greet()
+{
+    this->socket->sendPacket(Packet(GATEWAY_CONNECTING, ""));
+
+    Packet* answer = this->socket->readPacket();
+    if (answer == NULL)
+        return false;
+    if (answer->getType() == ALREADY_PRIMARY){
+        delete answer;
+        return true;
+    }
+
+    string primaryIP = answer->getPayload();
+    delete answer;
+    Packet* primaryPort = this->socket->readPacket();
+    if (primaryPort == NULL)
+        return false;
+    int port = atoi(primaryPort->getPayload());
+    delete primaryPort;
+
+    this->socket->reopenSocket();
+    if (!this->socket->connectToServer(primaryIP.c_str(), port))
+        return false;
+
+    this->socket->sendPacket(Packet(GATEWAY_CONNECTING, ""));
+    answer = this->socket->readPacket();
+    bool isPrimary = answer != NULL && answer->getType() == ALREADY_PRIMARY;
+    delete answer;
+    return isPrimary;
+}
+
+bool UpstreamLink::connect()
+{
+    for (auto &address : this->addresses){
+        this->socket->reopenSocket();
+        if (this->socket->connectToServer(address.first.c_str(), address.second) && this->greet())
+            return true;
+    }
+    return false;
+}
+
+
+// waits while the shard has no primary, the link thread resumes the sessions first. A frame
+// that fails to go out takes the link down and is sent again once it is back
+void UpstreamLink::send(Packet packet, uint32_t session)
+{
+    packet.setSession(session);
+
+    pthread_mutex_lock(&mutex);
+    while (true){
+        while (!this->connected)
+            pthread_cond_wait(&reconnected, &mutex);
+
+        if (this->socket->sendPacket(packet) >= 0)
+            break;
+
+        this->connected = false;
+        shutdown(this->socket->getSocketfd(), SHUT_RDWR);    // wakes the link thread's read
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+
+void *UpstreamLink::linkThread(void *linkArg)
+{
+    UpstreamLink* link = (UpstreamLink*) linkArg;
+    bool reported = false;
+
+    while (true){
+        if (!link->connect()){
+            if (!reported)
+                cout << "No primary of shard " << link->shard << " is reachable, retrying...\n";
+            reported = true;
+            RttEstimator::sleep_micros(GATEWAY_RETRY_INTERVAL_MS * 1000L);
+            continue;
+        }
+        reported = false;
+
+        // the sessions go along before any new command of their clients
+        pthread_mutex_lock(&link->mutex);
+        vector< shared_ptr<gateway_client> > resumed = link->gateway->sessions_to_resume(link);
+        for (auto &client : resumed){
+            string session = client->user + ":" + client->address.ipv4 + ":" + to_string(client->address.port);
+            Packet resume = Packet(GATEWAY_SESSION_RESUME, session.c_str());
+            resume.setSession(client->session);
+            link->socket->sendPacket(resume);
+        }
+        link->connected = true;
+        pthread_cond_broadcast(&link->reconnected);
+        pthread_mutex_unlock(&link->mutex);
+
+        cout << "Linked to primary of shard " << link->shard << ", " << resumed.size() << " sessions resumed\n";
+
+        while (true){
+            Packet* packet = link->socket->readPacket();
+            if (packet == NULL)
+                break;
+            if (packet->getType() == CLIENT_MUST_RECONNECT){     // the primary was bullied
+                delete packet;
+                break;
+            }
+            link->gateway->relay(packet);
+            delete packet;
+        }
+
+        pthread_mutex_lock(&link->mutex);
+        link->connected = false;
+        pthread_mutex_unlock(&link->mutex);
+        cout << "Lost primary of shard " << link->shard << ", looking for the new one...\n";
+    }
+
+    return NULL;
+}
+
+
+
+Gateway::Gateway(ShardMap shardMap)
+{
+    this->shardMap = shardMap;
+    this->nextSession = 1;      // 0 tags frames that belong to no session
+    pthread_mutex_init(&clientsMutex, NULL);
+
+    for (int shard : this->shardMap.shards()){
+        for (int i = 0; i < GATEWAY_UPSTREAM_LINKS; i++)
+            this->links[shard].push_back(new UpstreamLink(this, shard, this->shardMap.addresses_of(shard)));
+    }
+}
+
+
+UpstreamLink* Gateway::link_of(gateway_client* client)
+{
+    vector<UpstreamLink*>& shardLinks = this->links[this->shardMap.shard_of_user(client->user)];
+    return shardLinks[client->session % shardLinks.size()];
+}
+
+shared_ptr<gateway_client> Gateway::add_client(Socket* socket, string user, host_address address, bool resuming)
+{
+    shared_ptr<gateway_client> client = make_shared<gateway_client>(socket);
+    client->user = user;
+    client->address = address;
+    client->resuming = resuming;
+
+    pthread_mutex_lock(&clientsMutex);
+    client->session = this->nextSession++;
+    this->clients[client->session] = client;
+    pthread_mutex_unlock(&clientsMutex);
+
+    return client;
+}
+
+void Gateway::remove_client(uint32_t session)
+{
+    pthread_mutex_lock(&clientsMutex);
+    this->clients.erase(session);
+    pthread_mutex_unlock(&clientsMutex);
+}
+
+
+// the link's sessions the primary was already asked for, their answers are the gateway's
+vector< shared_ptr<gateway_client> > Gateway::sessions_to_resume(UpstreamLink* link)
+{
+    vector< shared_ptr<gateway_client> > resumed;
+
+    pthread_mutex_lock(&clientsMutex);
+    for (auto &entry : this->clients){
+        if (entry.second->opened && this->link_of(entry.second.get()) == link){
+            entry.second->resuming = true;
+            resumed.push_back(entry.second);
+        }
+    }
+    pthread_mutex_unlock(&clientsMutex);
+
+    return resumed;
+}
+
+void Gateway::relay(Packet* packet)
+{
+    pthread_mutex_lock(&clientsMutex);
+    auto found = this->clients.find(packet->getSession());
+    shared_ptr<gateway_client> client;
+    if (found != this->clients.end())
+        client = found->second;
+
+    bool answer = packet->getType() == SESSION_OPEN_SUCCEDED || packet->getType() == SESSION_OPEN_FAILED;
+    bool resumeAnswer = client && answer && client->resuming;
+    if (resumeAnswer)
+        client->resuming = false;
+    pthread_mutex_unlock(&clientsMutex);
+
+    if (!client)
+        return;     // the client left meanwhile
+
+    // a session the new primary refused: the client reconnects and asks again
+    if (resumeAnswer){
+        if (packet->getType() == SESSION_OPEN_FAILED)
+            shutdown(client->socket->getSocketfd(), SHUT_RDWR);
+        return;
+    }
+
+    // never waits on the client, the link carries the other sessions too
+    packet->setSession(0);
+    if (!client->outbound.try_push(make_shared<Packet>(*packet))){
+        cout << "Session " << client->session << " is not keeping up, dropping it\n";
+        shutdown(client->socket->getSocketfd(), SHUT_RDWR);
+    }
+}
+
+
+void *Gateway::clientWriter(void *clientArg)
+{
+    shared_ptr<gateway_client>* clientRef = (shared_ptr<gateway_client>*) clientArg;
+    shared_ptr<gateway_client> client = *clientRef;
+    delete clientRef;
+
+    while (true){
+        shared_ptr<Packet> packet = client->outbound.pop();
+        if (!packet)
+            break;
+        client->socket->sendPacket(*packet);
+    }
+    return NULL;
+}
+
+
+void Gateway::listenForClients(int port)
+{
+    Socket listener = Socket();
+    struct sockaddr_in serv_addr;
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_addr.s_addr = INADDR_ANY;
+    serv_addr.sin_port = htons(port);
+    bzero(&(serv_addr.sin_zero), 8);
+
+    if (bind(listener.getSocketfd(), (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0){
+        cout << "ERROR on binding port " << port << "!\n";
+        exit(1);
+    }
+    listen(listener.getSocketfd(), MAX_TCP_CONNECTIONS);
+    cout << "Gateway listening on port " << port << " ...\n";
+
+    while (1){
+        struct sockaddr_in cli_addr;
+        socklen_t clilen = sizeof(struct sockaddr_in);
+        int newsockfd = accept(listener.getSocketfd(), (struct sockaddr *) &cli_addr, &clilen);
+        if (newsockfd == -1){
+            cout << "ERROR on accepting client connection" << endl;
+            continue;
+        }
+
+        gateway_client_args *args = new gateway_client_args();
+        args->gateway = this;
+        args->connectedSocket = new Socket(newsockfd);
+        args->peer_address.ipv4 = inet_ntoa(cli_addr.sin_addr);
+        args->peer_address.port = ntohs(cli_addr.sin_port);
+
+        pthread_t thread;
+        pthread_create(&thread, NULL, Gateway::clientHandler, (void *)args);
+        pthread_detach(thread);
+    }
+}
+
+
+// Greets the client as its primary would, then passes its commands upstream tagged with the session
+void *Gateway::clientHandler(void *handlerArgs)
+{
+    gateway_client_args *args = (gateway_client_args *)handlerArgs;
+    Gateway* gateway = args->gateway;
+    Socket* socket = args->connectedSocket;
+    host_address address = args->peer_address;
+    delete args;
+
+    // no partition map: behind a gateway the client has no primary of its own to go to
+    Packet* hello = socket->readPacket();
+    if (hello == NULL || hello->getType() != CLIENT_CONNECTING){
+        delete hello;
+        delete socket;
+        return NULL;
+    }
+    delete hello;
+    socket->sendPacket(Packet(ALREADY_PRIMARY, ""));
+
+    Packet* userPacket = socket->readPacket();
+    if (userPacket == NULL){
+        delete socket;
+        return NULL;
+    }
+
+    // the gateway delivers every session it carries itself
+    string user = userPacket->getPayload();
+    size_t flag = user.find(" replica");
+    if (flag != string::npos)
+        user = user.substr(0, flag);
+
+    bool resuming = userPacket->getType() == USER_INFO_RECONNECT;
+    delete userPacket;
+    if (resuming){      // the session is named by the port of the client's first connection
+        Packet* originalPort = socket->readPacket();
+        if (originalPort == NULL){
+            delete socket;
+            return NULL;
+        }
+        address.port = atoi(originalPort->getPayload());
+        delete originalPort;
+    }
+
+    shared_ptr<gateway_client> client = gateway->add_client(socket, user, address, resuming);
+    UpstreamLink* link = gateway->link_of(client.get());
+
+    pthread_t writer;
+    pthread_create(&writer, NULL, Gateway::clientWriter, (void *)new shared_ptr<gateway_client>(client));
+    cout << "Session " << client->session << " of " << user << " at " << address.ipv4 << ":" << address.port << "\n";
+
+    string session = user + ":" + address.ipv4 + ":" + to_string(address.port);
+    link->send(Packet(resuming ? GATEWAY_SESSION_RESUME : GATEWAY_SESSION_OPEN, session.c_str()), client->session);
+    client->opened = true;
+
+    while (1){
+        Packet* command = socket->readPacket();
+        if (command == NULL)
+            break;
+        link->send(*command, client->session);
+        delete command;
+    }
+
+    gateway->remove_client(client->session);
+    link->send(Packet(GATEWAY_SESSION_CLOSED, ""), client->session);
+
+    shutdown(socket->getSocketfd(), SHUT_RDWR);     // a writer stuck on the client gives up
+    client->outbound.push(shared_ptr<Packet>());
+    pthread_join(writer, NULL);
+    return NULL;
+}
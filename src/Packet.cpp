@@ -1,7 +1,10 @@
 #include "../include/Packet.hpp"
+#include "../include/Crc32c.hpp"
 
 Packet::Packet(){
-    
+    this->checksum = 0;
+    this->frame = 0;
+    this->session = 0;
 }
 
 Packet::Packet(uint16_t type, char const *payload){
@@ -12,6 +15,9 @@ Packet::Packet(uint16_t type, char const *payload){
         exit(1);
     } 
 
+    this->checksum = 0;
+    this->frame = 0;
+    this->session = 0;
     this->type = type;
     this->seqn = 0; 
     this->length = payloadLength;
@@ -29,6 +35,9 @@ Packet::Packet(uint16_t type, time_t timestamp, char const *payload){
         exit(1);
     } 
 
+    this->checksum = 0;
+    this->frame = 0;
+    this->session = 0;
     this->type = type;
     this->seqn = 0;
     this->length = payloadLength;
@@ -51,6 +60,9 @@ Packet::Packet(uint16_t type, time_t timestamp, char const *payload, char const
         exit(1);
     } 
 
+    this->checksum = 0;
+    this->frame = 0;
+    this->session = 0;
     this->type = type;
     this->seqn = 0;
     this->length = payloadLength;
@@ -61,21 +73,33 @@ Packet::Packet(uint16_t type, time_t timestamp, char const *payload, char const
 
 
 Packet::Packet(uint16_t type, event e){
+    this->checksum = 0;
+    this->frame = 0;
+    this->session = 0;
     this->type = type;
     this->e = e;
 }
 
 
 Packet::Packet(uint16_t type, event e, uint16_t length){
+    this->checksum = 0;
+    this->frame = 0;
+    this->session = 0;
     this->type = type;
     this->e = e;
     this->length = length;
 }
 
 
-uint16_t Packet::getType(){
+uint16_t Packet::getType() const{
     return this->type;
 }
+uint32_t Packet::getFrame() const{
+    return this->frame;
+}
+uint32_t Packet::getSession() const{
+    return this->session;
+}
 uint16_t Packet::getSeqn(){
     return this->seqn;
 }
@@ -96,6 +120,13 @@ char* Packet::getAuthor(){
 void Packet::setType(uint16_t type){
     this->type = type;
 }
+void Packet::setFrame(uint32_t frame){
+    this->frame = frame;
+}
+
+void Packet::setSession(uint32_t session){
+    this->session = session;
+}
 void Packet::setSeqn(uint16_t seqn){
     this->seqn = seqn;
 }
@@ -122,4 +153,18 @@ void Packet::setAuthor(char* const author){
     } 
 
     strcpy(this->author, author);
-}
\ No newline at end of file
+}
+
+
+void Packet::seal(){
+    this->checksum = 0;
+    this->checksum = crc32c(this, sizeof(Packet));
+}
+
+bool Packet::intact(){
+    uint32_t expected = this->checksum;
+    this->checksum = 0;
+    bool matches = crc32c(this, sizeof(Packet)) == expected;
+    this->checksum = expected;
+    return matches;
+}
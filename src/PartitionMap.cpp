@@ -0,0 +1,105 @@
+#include "../include/PartitionMap.hpp"
+#include "../include/StateDigest.hpp"
+
+
+PartitionMap::PartitionMap()
+{
+
+}
+
+
+void PartitionMap::set_primary(int shard, host_address primary)
+{
+    primaries[shard] = primary;
+}
+
+void PartitionMap::forget_primary(int shard)
+{
+    primaries.erase(shard);
+}
+
+bool PartitionMap::primary_of(int shard, host_address* primary)
+{
+    auto it = primaries.find(shard);
+    if (it == primaries.end())
+        return false;
+
+    *primary = it->second;
+    return true;
+}
+
+bool PartitionMap::empty()
+{
+    return primaries.empty();
+}
+
+
+uint64_t PartitionMap::version()
+{
+    if (primaries.empty())
+        return 0;
+    return StateDigest::hash(serialize());
+}
+
+string PartitionMap::version_string()
+{
+    char hex[17];
+    snprintf(hex, sizeof(hex), "%llx", (unsigned long long) version());
+    return hex;
+}
+
+string PartitionMap::serialize()
+{
+    string serialized;
+    for (auto &entry : primaries)
+    {
+        if (!serialized.empty())
+            serialized += ";";
+        serialized += to_string(entry.first) + "=" + entry.second.ipv4 + ":" + to_string(entry.second.port);
+    }
+    return serialized;
+}
+
+// malformed entries are skipped
+PartitionMap PartitionMap::parse(string serialized)
+{
+    PartitionMap parsed;
+    size_t start = 0;
+    while (start < serialized.size())
+    {
+        size_t end = serialized.find(";", start);
+        if (end == string::npos)
+            end = serialized.size();
+        string entry = serialized.substr(start, end - start);
+        start = end + 1;
+
+        size_t equals = entry.find("=");
+        size_t colon = entry.rfind(":");
+        if (equals == string::npos || colon == string::npos || colon < equals)
+            continue;
+
+        host_address primary;
+        primary.ipv4 = entry.substr(equals + 1, colon - equals - 1);
+        primary.port = atoi(entry.substr(colon + 1).c_str());
+        parsed.set_primary(atoi(entry.substr(0, equals).c_str()), primary);
+    }
+    return parsed;
+}
+
+
+bool PartitionMap::load(string filename)
+{
+    ifstream input_file(filename);
+    string serialized;
+    if (!input_file || !getline(input_file, serialized))
+        return false;
+
+    *this = parse(serialized);
+    return !empty();
+}
+
+void PartitionMap::save(string filename)
+{
+    ofstream output_file(filename, ios::trunc);
+    output_file << serialize() << "\n";
+}
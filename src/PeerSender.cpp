@@ -0,0 +1,194 @@
+#include "../include/PeerSender.hpp"
+
+
+PeerSender::PeerSender(int peerID, Socket* socket)
+{
+    this->peerID = peerID;
+    this->socket = socket;
+    this->lastFrame = 0;
+    this->stopped = false;
+
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&notEmpty, NULL);
+    pthread_cond_init(&notFull, NULL);
+}
+
+PeerSender::~PeerSender()
+{
+    pthread_cond_destroy(&notFull);
+    pthread_cond_destroy(&notEmpty);
+    pthread_mutex_destroy(&mutex);
+}
+
+
+// the thread owns a reference, the sender outlives its removal from the group
+void PeerSender::start(shared_ptr<PeerSender> sender)
+{
+    shared_ptr<PeerSender>* threadRef = new shared_ptr<PeerSender>(sender);
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, PeerSender::senderThread, (void *)threadRef);
+    pthread_detach(thread);
+}
+
+
+bool PeerSender::is_control_packet(uint16_t type)
+{
+    switch (type)
+    {
+        case SERVER_PEER_CONNECTING:
+        case ELECTION:
+        case ANSWER:
+        case COORDINATOR:
+        case BULLY:
+        case OK:
+        case SOK:
+        case SNOK:
+        case ASK_PRIMARY:
+        case PRIMARY_SERVER_ADDRESS:
+        case APPLIED_PROGRESS:
+        case RETRANSMIT:
+            return true;
+        default:
+            return false;
+    }
+}
+
+
+bool PeerSender::try_send(shared_ptr<const Packet> packet)
+{
+    pthread_mutex_lock(&mutex);
+    if (is_control_packet(packet->getType()))
+    {
+        control.push_back(packet);     // small and rare, never refused
+    }
+    else
+    {
+        if (bulk.size() >= PEER_OUTBOUND_QUEUE_CAPACITY)
+        {
+            pthread_mutex_unlock(&mutex);
+            return false;
+        }
+        bulk.push_back(packet);
+    }
+    pthread_cond_signal(&notEmpty);
+    pthread_mutex_unlock(&mutex);
+    return true;
+}
+
+void PeerSender::send(shared_ptr<const Packet> packet)
+{
+    pthread_mutex_lock(&mutex);
+    if (is_control_packet(packet->getType()))
+    {
+        control.push_back(packet);
+    }
+    else
+    {
+        while (bulk.size() >= PEER_OUTBOUND_QUEUE_CAPACITY && !stopped)
+            pthread_cond_wait(&notFull, &mutex);
+        bulk.push_back(packet);
+    }
+    pthread_cond_signal(&notEmpty);
+    pthread_mutex_unlock(&mutex);
+}
+
+void PeerSender::stop()
+{
+    pthread_mutex_lock(&mutex);
+    stopped = true;
+    pthread_cond_signal(&notEmpty);
+    pthread_cond_broadcast(&notFull);
+    pthread_mutex_unlock(&mutex);
+}
+
+
+void PeerSender::retransmit(uint32_t fromFrame)
+{
+    pthread_mutex_lock(&mutex);
+    bool inWindow = !written.empty() && written.front()->getFrame() <= fromFrame && fromFrame <= lastFrame;
+    if (inWindow)
+    {
+        resend.clear();
+        for (auto &frame : written)
+            if (frame->getFrame() >= fromFrame)
+                resend.push_back(frame);
+        pthread_cond_signal(&notEmpty);
+    }
+    pthread_mutex_unlock(&mutex);
+
+    if (!inWindow)
+    {
+        // both sides see the connection close, the peer reconnects and catches up
+        cout << "Frame " << fromFrame << " to server " << peerID << " can't be sent again, dropping the connection.\n";
+        shutdown(socket->getSocketfd(), SHUT_RDWR);
+    }
+}
+
+
+// frames to repeat first, then the control lane; false once stopped and drained. New
+// frames are numbered here, under the mutex, so a retransmit request sees every frame
+// the sender thread may already be writing
+bool PeerSender::next_packet(shared_ptr<const Packet>* packet)
+{
+    pthread_mutex_lock(&mutex);
+    while (resend.empty() && control.empty() && bulk.empty() && !stopped)
+        pthread_cond_wait(&notEmpty, &mutex);
+
+    if (!resend.empty())
+    {
+        *packet = resend.front();
+        resend.pop_front();
+        pthread_mutex_unlock(&mutex);
+        return true;
+    }
+
+    shared_ptr<const Packet> next;
+    if (!control.empty())
+    {
+        next = control.front();
+        control.pop_front();
+    }
+    else if (!bulk.empty())
+    {
+        next = bulk.front();
+        bulk.pop_front();
+        pthread_cond_signal(&notFull);
+    }
+
+    if (next && next->getType() == RETRANSMIT)
+    {
+        // never numbered: the peer is skipping numbered frames until its own resend arrives
+        *packet = next;
+    }
+    else if (next)
+    {
+        // broadcast packets are shared between peers, the number goes on this peer's copy
+        shared_ptr<Packet> frame = make_shared<Packet>(*next);
+        frame->setFrame(++lastFrame);
+        written.push_back(frame);
+        if (written.size() > PEER_RETRANSMIT_WINDOW)
+            written.pop_front();
+        *packet = frame;
+    }
+    pthread_mutex_unlock(&mutex);
+    return (bool) next;
+}
+
+
+void *PeerSender::senderThread(void *senderArg)
+{
+    shared_ptr<PeerSender>* threadRef = (shared_ptr<PeerSender>*) senderArg;
+    PeerSender* sender = threadRef->get();
+    shared_ptr<const Packet> packet;
+
+    while (sender->next_packet(&packet))
+    {
+        // a broken connection is noticed by the peer's reader, which stops this sender
+        if (sender->socket->sendPacket(*packet) < 0)
+            cout << "Unable to send packet to server " << sender->peerID << ".\n";
+    }
+
+    delete threadRef;
+    return NULL;
+}
@@ -0,0 +1,111 @@
+#include "../include/RttEstimator.hpp"
+
+
+RttEstimator::RttEstimator()
+{
+    pthread_mutex_init(&mutex, NULL);
+}
+
+RttEstimator::~RttEstimator()
+{
+    pthread_mutex_destroy(&mutex);
+}
+
+
+void RttEstimator::record(int peerID, long sampleMicros)
+{
+    pthread_mutex_lock(&mutex);
+    update(peerID, sampleMicros);
+    pthread_mutex_unlock(&mutex);
+}
+
+void RttEstimator::update(int peerID, long sampleMicros)
+{
+    auto it = estimates.find(peerID);
+    if (it == estimates.end())
+    {
+        rtt_estimate first;
+        first.srtt = sampleMicros;
+        first.rttvar = sampleMicros / 2;
+        estimates.insert({peerID, first});
+    }
+    else
+    {
+        // RTTVAR = 3/4 RTTVAR + 1/4 |SRTT - R|, then SRTT = 7/8 SRTT + 1/8 R
+        long deviation = it->second.srtt - sampleMicros;
+        if (deviation < 0)
+            deviation = -deviation;
+        it->second.rttvar += (deviation - it->second.rttvar) / 4;
+        it->second.srtt += (sampleMicros - it->second.srtt) / 8;
+    }
+}
+
+// a peer that reconnects may be on another host, its old samples say nothing
+void RttEstimator::forget(int peerID)
+{
+    pthread_mutex_lock(&mutex);
+    estimates.erase(peerID);
+    probes.erase(peerID);
+    pthread_mutex_unlock(&mutex);
+}
+
+
+void RttEstimator::start_probe(int peerID)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&mutex);
+    probes[peerID] = now;
+    pthread_mutex_unlock(&mutex);
+}
+
+// replies nobody is waiting for (duplicates, late answers) are not samples
+void RttEstimator::finish_probe(int peerID)
+{
+    pthread_mutex_lock(&mutex);
+    auto it = probes.find(peerID);
+    if (it != probes.end())
+    {
+        update(peerID, elapsed_micros(it->second));
+        probes.erase(it);
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+
+long RttEstimator::timeout_micros(const vector<int>& peers, long floorMicros, long ceilingMicros, long unmeasuredMicros)
+{
+    long timeout = peers.empty() ? unmeasuredMicros : 0;
+
+    pthread_mutex_lock(&mutex);
+    for (int peerID : peers)
+    {
+        auto it = estimates.find(peerID);
+        if (it == estimates.end())
+            timeout = max(timeout, unmeasuredMicros);
+        else
+            timeout = max(timeout, it->second.srtt + RTT_VARIANCE_FACTOR * it->second.rttvar);
+    }
+    pthread_mutex_unlock(&mutex);
+
+    return min(max(timeout, floorMicros), ceilingMicros);
+}
+
+
+long RttEstimator::elapsed_micros(const struct timespec& since)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since.tv_sec) * 1000000 + (now.tv_nsec - since.tv_nsec) / 1000;
+}
+
+// usleep may refuse a second or more, nanosleep takes any length and resumes after signals
+void RttEstimator::sleep_micros(long micros)
+{
+    struct timespec remaining;
+    remaining.tv_sec = micros / 1000000;
+    remaining.tv_nsec = (micros % 1000000) * 1000;
+    while (nanosleep(&remaining, &remaining) < 0 && errno == EINTR)
+        ;
+}
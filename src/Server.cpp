@@ -3,43 +3,132 @@
 using namespace std;
 
 
-Server::Server(map<string, int> possibleServerAddresses)
+Server::Server(map<string, int> possibleServerAddresses, ShardMap shardMap)
 {
     this->electionStarted = false;
     this->gotAnsweredInElection = false;
 
     this->possibleServerAddresses = possibleServerAddresses;
+    this->shardMap = shardMap;
+    this->shard = 0;
 
     this->notification_id_counter = 0;
-    this->serverConfirmation = -1;
+    this->confirmation_generation = 0;
+    this->autocommit = false;
 
     connectedServersMutex = PTHREAD_MUTEX_INITIALIZER;
 
-    pthread_cond_init(&cond_notification_empty, NULL);
-    pthread_cond_init(&cond_notification_full, NULL);
     pthread_mutex_init(&connectedServersMutex, NULL);
     pthread_mutex_init(&electionMutex, NULL);
+    pthread_cond_init(&electionStateChanged, NULL);
     pthread_mutex_init(&confirmedEventsMutex, NULL);
     pthread_mutex_init(&seqn_transaction_serializer, NULL);
+    pthread_mutex_init(&delivery_progress_mutex, NULL);
+    pthread_mutex_init(&applier_mutex, NULL);
+    pthread_cond_init(&applier_idle, NULL);
+    pthread_mutex_init(&confirmation_mutex, NULL);
+    pthread_mutex_init(&async_replication_mutex, NULL);
+    pthread_cond_init(&async_replication_drained, NULL);
+    pthread_cond_init(&confirmation_received, NULL);
+    pthread_cond_init(&applied_watermark_advanced, NULL);
+    this->applied_watermark = 0;
+    this->election_seqn = 0;
+
+    this->fanout_pool = new FanoutPool(&delivery_index, FANOUT_WORKERS);
+
+    pthread_t deliveryProgressThread;
+    pthread_create(&deliveryProgressThread, NULL, Server::deliveryProgressHandler, (void *)this);
+    pthread_detach(deliveryProgressThread);
+
+    this->replicated_events = new BoundedQueue<replicated_event>(APPLY_QUEUE_CAPACITY);
+    this->async_events = new BoundedQueue<event>(ASYNC_REPLICATION_MAX_LAG);
+    this->async_unsent_events = 0;
+    this->inbound_bulk = new BoundedQueue<Packet*>(INBOUND_BULK_CAPACITY);
+    this->unapplied_events = 0;
+    this->applying_seqn = 0;
+
+    pthread_t eventApplierThread;
+    pthread_create(&eventApplierThread, NULL, Server::eventApplierHandler, (void *)this);
+    pthread_detach(eventApplierThread);
+    pthread_create(&eventApplierThread, NULL, Server::asyncReplicationHandler, (void *)this);
+    pthread_detach(eventApplierThread);
+    pthread_create(&eventApplierThread, NULL, Server::backupCatchUpHandler, (void *)this);
+    pthread_detach(eventApplierThread);
+    pthread_create(&eventApplierThread, NULL, Server::bulkReadMessagesHandler, (void *)this);
+    pthread_detach(eventApplierThread);
+    pthread_create(&eventApplierThread, NULL, Server::stateDigestHandler, (void *)this);
+    pthread_detach(eventApplierThread);
+
+    this->pendingConnections = new BoundedQueue<pending_connection>(ADMISSION_QUEUE_CAPACITY);
+    pthread_t admissionThread;
+    for (int i = 0; i < ADMISSION_WORKERS; i++)
+    {
+        pthread_create(&admissionThread, NULL, Server::admissionHandler, (void *)this);
+        pthread_detach(admissionThread);
+    }
 }
 
 Server::Server(host_address address)
 {
-    this->electionStarted - false;
+    this->electionStarted = false;
     this->gotAnsweredInElection = false;
     this->notification_id_counter = 0;
+    this->shard = 0;
 	this->ip = address.ipv4;
 	this->port = address.port;
-    this->serverConfirmation = -1;
+    this->confirmation_generation = 0;
+    this->autocommit = false;
 
     connectedServersMutex = PTHREAD_MUTEX_INITIALIZER;
 
-    pthread_cond_init(&cond_notification_empty, NULL);
-    pthread_cond_init(&cond_notification_full, NULL);
     pthread_mutex_init(&connectedServersMutex, NULL);
     pthread_mutex_init(&electionMutex, NULL);
+    pthread_cond_init(&electionStateChanged, NULL);
     pthread_mutex_init(&confirmedEventsMutex, NULL);
     pthread_mutex_init(&seqn_transaction_serializer, NULL);
+    pthread_mutex_init(&delivery_progress_mutex, NULL);
+    pthread_mutex_init(&applier_mutex, NULL);
+    pthread_cond_init(&applier_idle, NULL);
+    pthread_mutex_init(&confirmation_mutex, NULL);
+    pthread_mutex_init(&async_replication_mutex, NULL);
+    pthread_cond_init(&async_replication_drained, NULL);
+    pthread_cond_init(&confirmation_received, NULL);
+    pthread_cond_init(&applied_watermark_advanced, NULL);
+    this->applied_watermark = 0;
+    this->election_seqn = 0;
+
+    this->fanout_pool = new FanoutPool(&delivery_index, FANOUT_WORKERS);
+
+    pthread_t deliveryProgressThread;
+    pthread_create(&deliveryProgressThread, NULL, Server::deliveryProgressHandler, (void *)this);
+    pthread_detach(deliveryProgressThread);
+
+    this->replicated_events = new BoundedQueue<replicated_event>(APPLY_QUEUE_CAPACITY);
+    this->async_events = new BoundedQueue<event>(ASYNC_REPLICATION_MAX_LAG);
+    this->async_unsent_events = 0;
+    this->inbound_bulk = new BoundedQueue<Packet*>(INBOUND_BULK_CAPACITY);
+    this->unapplied_events = 0;
+    this->applying_seqn = 0;
+
+    pthread_t eventApplierThread;
+    pthread_create(&eventApplierThread, NULL, Server::eventApplierHandler, (void *)this);
+    pthread_detach(eventApplierThread);
+    pthread_create(&eventApplierThread, NULL, Server::asyncReplicationHandler, (void *)this);
+    pthread_detach(eventApplierThread);
+    pthread_create(&eventApplierThread, NULL, Server::backupCatchUpHandler, (void *)this);
+    pthread_detach(eventApplierThread);
+    pthread_create(&eventApplierThread, NULL, Server::bulkReadMessagesHandler, (void *)this);
+    pthread_detach(eventApplierThread);
+    pthread_create(&eventApplierThread, NULL, Server::stateDigestHandler, (void *)this);
+    pthread_detach(eventApplierThread);
+
+    this->pendingConnections = new BoundedQueue<pending_connection>(ADMISSION_QUEUE_CAPACITY);
+    pthread_t admissionThread;
+    for (int i = 0; i < ADMISSION_WORKERS; i++)
+    {
+        pthread_create(&admissionThread, NULL, Server::admissionHandler, (void *)this);
+        pthread_detach(admissionThread);
+    }
 }
 
 
@@ -59,6 +148,40 @@ void Server::removeSelfFromPossibleServerAddresses(){
     this->possibleServerAddresses.erase(this->possibleServerAddresses.find(this->ip));
 }
 
+// Each shard is a group of its own: elections, replication and the event log only involve the
+// members listed with the same shard, the other shards are reached through their primaries
+void Server::joinShard(){
+    this->shard = this->shardMap.shard_of_address(this->ip);
+    this->possibleServerAddresses = this->shardMap.addresses_of(this->shard);
+
+    for (auto otherShard : this->shardMap.shards()){
+        if (otherShard != this->shard)
+            this->shardLinks[otherShard] = new ShardLink(otherShard, this->shard, this->shardMap.addresses_of(otherShard));
+    }
+
+    cout << "Member of shard " << this->shard << " of " << this->shardMap.size() << "\n";
+}
+
+// the primaries this server knows about: its own, unless an election is running, and the
+// ones its links to the other shards are open to
+PartitionMap Server::partitionMap(){
+    PartitionMap current;
+    host_address primary;
+
+    if (!this->electionStarted){
+        primary.ipv4 = this->primarySeverIP;
+        primary.port = this->primarySeverPort;
+        current.set_primary(this->shard, primary);
+    }
+
+    for (auto &link : this->shardLinks){
+        if (link.second->primary_address(&primary))
+            current.set_primary(link.first, primary);
+    }
+
+    return current;
+}
+
 
 pair<string, int> Server::getIpPortFromAddressString(string addressString){
 
@@ -71,6 +194,20 @@ pair<string, int> Server::getIpPortFromAddressString(string addressString){
     return pair<string, int>(ip, port);
 }
 
+// "user:ip:port", how a session is named to a server by anyone but its own connection
+bool Server::parseSessionAddress(string payload, string* user, host_address* address){
+
+    size_t first = payload.find(':');
+    size_t second = payload.rfind(':');
+    if (first == string::npos || second == first)
+        return false;
+
+    *user = payload.substr(0, first);
+    address->ipv4 = payload.substr(first + 1, second - first - 1);
+    address->port = atoi(payload.substr(second + 1).c_str());
+    return true;
+}
+
 
 int Server::getIdFromAddress(string ip, int port){
     int id;
@@ -88,17 +225,40 @@ void Server::setAddress(string ip, int port){
 }
 
 
-void Server::addPeerToConnectedServers(int peerID, Socket* connectedSocket){
+// the joining side queues its handshake before the sender is reachable by anyone else, so it
+// is the first frame on the connection and the sender thread is its only writer
+void Server::addPeerToConnectedServers(int peerID, Socket* connectedSocket, bool joining){
+    shared_ptr<PeerSender> sender = make_shared<PeerSender>(peerID, connectedSocket);
+    if (joining)
+        sendMessagesForConnectionEstablishment(sender, peerID);
+    PeerSender::start(sender);
+
     pthread_mutex_lock(&this->connectedServersMutex);
     this->connectedServers.insert(pair<int, Socket*>(peerID, connectedSocket));
+    this->peerSenders[peerID] = sender;
+    this->backups_progress[peerID] = backup_progress();
     pthread_mutex_unlock(&this->connectedServersMutex);
 }
 
 
 void Server::removePeerFromConnectedServers(int peerID){
+    shared_ptr<PeerSender> sender;
+
     pthread_mutex_lock(&this->connectedServersMutex);
-    this->connectedServers.erase(this->connectedServers.find(peerID));
+    auto it = this->connectedServers.find(peerID);
+    if (it != this->connectedServers.end())
+        this->connectedServers.erase(it);
+    this->backups_progress.erase(peerID);
+    this->peerRtt.forget(peerID);
+    auto senderIt = this->peerSenders.find(peerID);
+    if (senderIt != this->peerSenders.end()){
+        sender = senderIt->second;
+        this->peerSenders.erase(senderIt);
+    }
     pthread_mutex_unlock(&this->connectedServersMutex);
+
+    if (sender)
+        sender->stop();
 }
 
 
@@ -112,74 +272,209 @@ void Server::setAsPrimaryServer(){
 bool Server::try_to_start_session(string user, host_address address)
 {
     cout << "\nTrying to start session\n";
-    pthread_mutex_lock(&seqn_transaction_serializer);
-    uint16_t seqn = get_current_sequence();
 
     event session_event;
-    session_event.seqn = seqn;
     session_event.command = OPEN_SESSION;
     strcpy(session_event.arg1, user.c_str());
     strcpy(session_event.arg2, address.ipv4.c_str());
     strcpy(session_event.arg3, to_string(address.port).c_str());
-    session_event.committed = false; 
+    session_event.num_ops = 0;
 
-    deepcopy_user_sessions_semaphore(true);
-    deepcopy_sessions(true);
-    deepcopy_users_unread_notifications(true);
-    deepcopy_followers(true);
-    deepcopy_active_notifications(true);
-    deepcopy_active_users_pending_notifications(true);
+    vector<bool> results;
+    bool committed = run_transaction(session_event, &results);
+    return committed && results[0];
+}
 
-    if(!user_exists(user))
+// call this function when a client logs in: the session is opened and its offline period
+// notifications are retrieved in a single transaction, with a single backup round
+bool Server::open_session_and_retrieve_notifications(string user, host_address address)
+{
+    cout << "\nTrying to start session and retrieve offline notifications\n";
+
+    event login_event;
+    login_event.command = MULTI_OP;
+    strcpy(login_event.arg1, user.c_str());
+    strcpy(login_event.arg2, address.ipv4.c_str());
+    strcpy(login_event.arg3, to_string(address.port).c_str());
+    login_event.num_ops = 2;
+    login_event.ops[0] = OPEN_SESSION;
+    login_event.ops[1] = READ_OFFLINE;
+
+    vector<bool> results;
+    bool committed = run_transaction(login_event, &results);
+    return committed && results[0];
+}
+
+// a MULTI_OP event carries the commands of its operations, which all run on the event's args.
+// Any other event is a single operation
+vector<event_op> Server::event_operations(const event& e)
+{
+    vector<uint16_t> commands;
+    if (e.command == MULTI_OP)
     {
-        sem_t num_sessions;
-        sem_init(&num_sessions, 0, 2);
-        COPY_user_sessions_semaphore.insert({user, num_sessions}); // user is created with 2 sessions available
-        COPY_sessions.insert({user, list<host_address>()});
-        COPY_followers.insert(pair<string, list<string>>(user, list<string>()));
-        COPY_users_unread_notifications.insert({user, list<uint32_t>()});
-    } 
-    
-    int session_started = sem_trywait(&(COPY_user_sessions_semaphore[user])); // try to consume a session resource
-    if(session_started == 0) // 0 if session started, -1 if not
-    { 
-        COPY_sessions[user].push_back(address);
-        COPY_active_users_pending_notifications.insert({address, priority_queue<uint32_t, vector<uint32_t>, greater<uint32_t>>()});
+        for (int i = 0; i < e.num_ops && i < MAX_EVENT_OPS; i++)
+            commands.push_back(e.ops[i]);
     }
+    else
+        commands.push_back(e.command);
 
-    bool committed;
+    vector<event_op> ops;
+    for (auto command : commands)
+    {
+        event_op op;
+        op.command = command;
+        memcpy(op.arg1, e.arg1, sizeof(op.arg1));
+        memcpy(op.arg2, e.arg2, sizeof(op.arg2));
+        memcpy(op.arg3, e.arg3, sizeof(op.arg3));
+        ops.push_back(op);
+    }
+    return ops;
+}
+
+// Stages every operation of the event on the COPY_ state, replicates the event once and then
+// commits or rolls back all of its operations together. results gets one entry per operation
+bool Server::run_transaction(event e, vector<bool>* results)
+{
+    pthread_mutex_lock(&seqn_transaction_serializer);
+    e.seqn = get_current_sequence();
+    e.committed = false;
+
+    vector<event_op> ops = event_operations(e);
+
+    for (auto &op : ops)
+        deepcopy_operation_state(op, true);
+
+    bool staged = true;
+    for (auto &op : ops)
+    {
+        results->push_back(stage_operation(op));
+        staged = staged && results->back();
+    }
 
+    // nothing was replicated yet: the staged copies are dropped and the seqn is not taken.
+    // A backup replays what the primary staged, it stays in step and lets the primary decide
+    if (!staged && !backupMode)
+    {
+        cout << "An operation of event " << e.seqn << " could not be staged, aborting it.\n";
+        pthread_mutex_unlock(&seqn_transaction_serializer);
+        return false;
+    }
+
+    bool committed;
     if (backupMode)
     {
-        committed = wait_primary_commit(session_event);
+        committed = wait_primary_commit(e);
     }
     else
     {
-
-        committed = send_backup_change(session_event);
+        committed = send_backup_change(e);
     }
 
-    if (committed) 
+    if (committed)
     {
-        deepcopy_user_sessions_semaphore(false);
-        deepcopy_sessions(false);
-        deepcopy_users_unread_notifications(false);
-        deepcopy_followers(false);
-        deepcopy_active_notifications(false);
-        deepcopy_active_users_pending_notifications(false);
+        for (auto &op : ops)
+            deepcopy_operation_state(op, false);
+        for (auto &op : ops)
+            finish_operation(op);
     }
 
-    session_event.committed = committed;
-    event_history.push_back(session_event);  
+    e.committed = committed;
+    record_event(e);
 
     print_events();
-    
+
     pthread_mutex_unlock(&seqn_transaction_serializer);
-    return committed && session_started == 0; 
+    return committed;
+}
+
+void Server::deepcopy_operation_state(const event_op& op, bool save)
+{
+    switch (op.command)
+    {
+        case OPEN_SESSION:
+            deepcopy_user_sessions_semaphore(save);
+            deepcopy_sessions(save);
+            deepcopy_users_unread_notifications(save);
+            deepcopy_followers(save);
+            deepcopy_active_notifications(save);
+            deepcopy_active_sessions(save);
+            break;
+        case READ_OFFLINE:
+            deepcopy_users_unread_notifications(save);
+            deepcopy_active_sessions(save);
+            deepcopy_read_cursors(op.arg1, save);
+            break;
+        default:
+            break;
+    }
+}
+
+// only operations with a stage step may be part of a MULTI_OP event
+bool Server::stage_operation(const event_op& op)
+{
+    host_address addr;
+    addr.ipv4 = op.arg2;
+    addr.port = atoi(op.arg3);
+
+    switch (op.command)
+    {
+        case OPEN_SESSION:
+            return stage_open_session(op.arg1, addr);
+        case READ_OFFLINE:
+            stage_read_offline(op.arg1, addr);
+            return true;
+        default:
+            cout << "WARNING! Operation " << op.command << " can't be staged, ignoring...\n";
+            return false;
+    }
+}
+
+// what a committed operation does outside of the replicated state
+void Server::finish_operation(const event_op& op)
+{
+    host_address addr;
+    addr.ipv4 = op.arg2;
+    addr.port = atoi(op.arg3);
+
+    switch (op.command)
+    {
+        case READ_OFFLINE:
+            finish_read_offline(op.arg1, addr);
+            break;
+        default:
+            break;
+    }
+}
+
+bool Server::stage_open_session(string user, host_address address)
+{
+    if(!user_exists(user))
+    {
+        sem_t num_sessions;
+        sem_init(&num_sessions, 0, 2);
+        COPY_user_sessions_semaphore.insert({user, num_sessions}); // user is created with 2 sessions available
+        COPY_sessions.insert({user, list<host_address>()});
+        COPY_followers.add_user(user);
+        COPY_users_unread_notifications.insert({user, list<uint32_t>()});
+    } 
+    
+    int session_started = sem_trywait(&(COPY_user_sessions_semaphore[user])); // try to consume a session resource
+    if(session_started == 0) // 0 if session started, -1 if not
+    { 
+        COPY_sessions[user].push_back(address);
+        COPY_active_sessions.insert({make_session_key(address), user_session(user, address)});
+    }
+
+    return session_started == 0;
 }
 
 uint16_t Server::get_current_sequence()
 {
+    if(applying_seqn != 0)      // replaying an event of the primary, keep its seqn
+    {
+        return applying_seqn;
+    }
+
     if(event_history.empty())
     {
         return 1;
@@ -194,7 +489,7 @@ bool Server::user_exists(string user)
 }
 
 
-bool Server::didAllBackupsRespondedEvent(uint16_t eventSeqn){
+bool Server::didAllBackupsRespondedEvent(uint16_t eventSeqn, const vector<int>& backups){
     pthread_mutex_lock(&confirmedEventsMutex);
     pthread_mutex_lock(&connectedServersMutex);
     
@@ -213,9 +508,12 @@ bool Server::didAllBackupsRespondedEvent(uint16_t eventSeqn){
     }
 
 
-    for (auto &peer : this->connectedServers)
+    for (auto backup : backups)
     {
-        auto it = eventMap.find(peer.first);
+        if (this->connectedServers.find(backup) == this->connectedServers.end())
+            continue;   // disconnected meanwhile
+
+        auto it = eventMap.find(backup);
 
         if (it == eventMap.end()) // Not found
         {
@@ -231,8 +529,9 @@ bool Server::didAllBackupsRespondedEvent(uint16_t eventSeqn){
 }
 
 
-bool Server::didAllBackupsOkedEvent(uint16_t eventSeqn){
+bool Server::didAllBackupsOkedEvent(uint16_t eventSeqn, const vector<int>& backups){
     pthread_mutex_lock(&confirmedEventsMutex);
+    pthread_mutex_lock(&connectedServersMutex);
 
     map<int, bool> eventMap;
 
@@ -247,9 +546,12 @@ bool Server::didAllBackupsOkedEvent(uint16_t eventSeqn){
         return false;
     }
 
-    for (auto &peer : this->connectedServers){
+    for (auto backup : backups){
 
-        auto it = eventMap.find(peer.first);
+        if (this->connectedServers.find(backup) == this->connectedServers.end())
+            continue;   // disconnected meanwhile
+
+        auto it = eventMap.find(backup);
 
         if (it == eventMap.end())  { // Not found
             cout << "WARNING! Method didAllBackupsOkedEvent() called but a server haven't responded yet!\n";
@@ -272,17 +574,20 @@ bool Server::didAllBackupsOkedEvent(uint16_t eventSeqn){
     return true;
 }
 
-bool Server::has_processed_event(event e)
+uint16_t Server::last_event_seqn()
 {
-    return find(event_history.begin(), event_history.end(), e) != event_history.end();
+    pthread_mutex_lock(&seqn_transaction_serializer);
+    uint16_t seqn = event_history.empty() ? 0 : event_history.back().seqn;
+    pthread_mutex_unlock(&seqn_transaction_serializer);
+    return seqn;
 }
 
-void Server::send_commited_events_to_new_backup(Socket* socket, uint16_t expected_seqn)
+void Server::send_commited_events_to_new_backup(int peerID, uint16_t expected_seqn)
 {
     if (event_history.empty())
     {
         Packet msgPacket = Packet(MESSAGE_PKT, "");
-        socket->sendPacket(msgPacket);
+        sendPacketToServer(peerID, msgPacket);
         cout << "Finished - ";
         cout << msgPacket.getLength();
         cout << "\n";
@@ -292,27 +597,16 @@ void Server::send_commited_events_to_new_backup(Socket* socket, uint16_t expecte
     if(expected_seqn <= event_history.size())
     {
         auto ev = event_history[expected_seqn - 1];
-        if(ev.committed)
-        {
-            Packet eventPacket = Packet(ev.command, ev, 1);
-            socket->sendPacket(eventPacket);
-            cout << "Sent event " << ev.seqn << " to new backup server.\n\n";
-        }
-        else
-        {
-            Packet msgPacket = Packet(MESSAGE_PKT, "Packet to be ignored.");
-            socket->sendPacket(msgPacket);
-            cout << "Finished - ";
-            cout << msgPacket.getLength();
-            cout << "\n";
-        }
-              
+        Packet eventPacket = Packet(ev.command, ev, 1);
+        sendPacketToServer(peerID, eventPacket);
+        cout << "Sent " << (ev.committed ? "" : "aborted ") << "event " << ev.seqn << " to new backup server.\n\n";
     }
     else
     {
         auto ev = event_history[0];
         Packet eventPacket = Packet(ev.command, ev, 0);
-        socket->sendPacket(eventPacket);
+        sendPacketToServer(peerID, eventPacket);
+        send_delivery_progress_snapshot(peerID);
         cout << "Finished\n";
     }
 }
@@ -320,19 +614,48 @@ void Server::send_commited_events_to_new_backup(Socket* socket, uint16_t expecte
 
 bool Server::wait_primary_commit(event e)
 {
-    if(autocommit) return true;
+    int successor = 0;
+    if (REPLICATION_TOPOLOGY == CHAIN_TOPOLOGY && !forwarding_chain.empty())
+        successor = chain_successor(forwarding_chain);
+
+    if(autocommit)
+    {
+        if (successor)
+        {
+            e.committed = true;
+            this->sendPacketToServer(successor, chain_packet(e.command, e, forwarding_chain));
+        }
+        return true;
+    }
 
-    cout << "Confirming event alteration to primary replica.\n";
-    this->sendPacketToPrimaryServer(Packet(OK, e));
-    cout << "Confirmation sent.\n";
-    // Wait primary response
-    while(serverConfirmation == -1)
+    pthread_mutex_lock(&confirmation_mutex);
+    unsigned int generation = confirmation_generation;
+    pthread_mutex_unlock(&confirmation_mutex);
+
+    if (successor)      // the tail confirms for the whole chain
+    {
+        cout << "Forwarding event to server " << successor << " along the chain.\n";
+        this->sendPacketToServer(successor, chain_packet(e.command, e, forwarding_chain));
+    }
+    else
     {
-        // busy wait thread change value;
-        sleep(1);
+        cout << "Confirming event alteration to primary replica.\n";
+        this->sendPacketToPrimaryServer(Packet(OK, e));
+        cout << "Confirmation sent.\n";
     }
-    int s = serverConfirmation;
-    this->serverConfirmation = -1; 
+    // Wait primary response for this event, or give up when the primary is gone. The decisions
+    // of events still queued behind this one may already be in, each is kept under its seqn
+    pthread_mutex_lock(&confirmation_mutex);
+    while(primary_confirmations.find(e.seqn) == primary_confirmations.end() && generation == confirmation_generation)
+        pthread_cond_wait(&confirmation_received, &confirmation_mutex);
+    int s = 0;
+    auto it = primary_confirmations.find(e.seqn);
+    if (it != primary_confirmations.end())
+    {
+        s = it->second;
+        primary_confirmations.erase(it);
+    }
+    pthread_mutex_unlock(&confirmation_mutex);
     
     if (s)
         return true;
@@ -340,258 +663,1440 @@ bool Server::wait_primary_commit(event e)
         return false;
 }
 
-bool Server::send_backup_change(event e)
+void Server::set_primary_confirmation(uint16_t seqn, int confirmation)
 {
-    cout << "Sending event to all backup replicas.\n";
-    // Add event seqn to the map of confirmed events
-    pthread_mutex_lock(&confirmedEventsMutex);
-    confirmedEvents.insert({e.seqn, {}});
-    pthread_mutex_unlock(&confirmedEventsMutex);
+    pthread_mutex_lock(&confirmation_mutex);
+    primary_confirmations[seqn] = confirmation;
+    pthread_cond_signal(&confirmation_received);
+    pthread_mutex_unlock(&confirmation_mutex);
+}
 
-    // Send new event to backup servers
-    Packet eventPacket = Packet(e.command, e);
-    this->sendPacketToAllServersInTheGroup(eventPacket);
+// the event waiting for the primary, if any, is rolled back
+void Server::abort_primary_confirmations()
+{
+    pthread_mutex_lock(&confirmation_mutex);
+    primary_confirmations.clear();
+    confirmation_generation++;
+    pthread_cond_signal(&confirmation_received);
+    pthread_mutex_unlock(&confirmation_mutex);
+}
 
-    time_t startTime = time(0);
-    double secondsSiceStart;
-    // Wait for all backup servers response until timeout
-    while(!didAllBackupsRespondedEvent(e.seqn))
-    {
-        secondsSiceStart = difftime( time(0), startTime);
 
-        if (secondsSiceStart >= BACKUPS_RESPONSE_TIMEOUT)  // Backups response timed out
-        {
-            cout << "Timeout for backup replicas response!\n";
-            sendPacketToAllServersInTheGroup(Packet(SNOK, e));
-            return false;  
-        }
+void Server::enqueue_replicated_event(event e, bool record_only, string chain, bool report_progress)
+{
+    replicated_event replicated;
+    replicated.e = e;
+    replicated.record_only = record_only;
+    replicated.chain = chain;
+    replicated.report_progress = report_progress;
 
-    }
+    pthread_mutex_lock(&applier_mutex);
+    unapplied_events++;
+    pthread_mutex_unlock(&applier_mutex);
 
-    if (didAllBackupsOkedEvent(e.seqn)) {
-        cout << "Responding SOK to backups!\n";
-        sendPacketToAllServersInTheGroup(Packet(SOK, e));
-        return true;
-    }
-    else{
-        cout << "Responding SNOK to backups D:\n";
-        sendPacketToAllServersInTheGroup(Packet(SNOK, e));
-        return false;  
-    }
+    replicated_events->push(replicated);    // blocks the receiver while the applier is behind
 }
 
-// call this function when new notification is created
-bool Server::create_notification(string user, string body, time_t timestamp)
+void Server::wait_replicated_events_applied()
 {
-    cout << "\nNew notification!\n";
-    pthread_mutex_lock(&seqn_transaction_serializer);
-    uint16_t seqn = get_current_sequence();
+    pthread_mutex_lock(&applier_mutex);
+    while (unapplied_events > 0)
+        pthread_cond_wait(&applier_idle, &applier_mutex);
+    pthread_mutex_unlock(&applier_mutex);
+}
 
-    event create_notification_event;
-    create_notification_event.seqn = seqn;
-    create_notification_event.command = CREATE_NOTIFICATION;
-    strcpy(create_notification_event.arg1, user.c_str());
-    strcpy(create_notification_event.arg2, body.c_str());
-    strcpy(create_notification_event.arg3, to_string(timestamp).c_str());
-    create_notification_event.committed = false; 
+void Server::apply_replicated_event(const replicated_event& replicated)
+{
+    event e = replicated.e;
 
-    deepcopy_users_unread_notifications(true);
-    deepcopy_active_notifications(true);
-    deepcopy_active_users_pending_notifications(true);
+    if (replicated.record_only)
+    {
+        pthread_mutex_lock(&seqn_transaction_serializer);
+        e.committed = false;
+        record_event(e);
+        pthread_mutex_unlock(&seqn_transaction_serializer);
+        return;
+    }
+
+    autocommit = e.committed;
+    forwarding_chain = replicated.chain;
+    applying_seqn = e.seqn;
 
-    if (followers[user].size() > 0)
+    host_address addr;
+    addr.ipv4 = e.arg2;
+    addr.port = atoi(e.arg3);
+
+    switch (e.command)
     {
-        uint16_t pending_users{0};
-        for (auto follower : followers[user])
-        {                    
-            COPY_users_unread_notifications[follower].push_back(notification_id_counter);
-            pending_users++;
+        case OPEN_SESSION:
+            cout << "Replicating open session.\n";
+            try_to_start_session(e.arg1, addr);
+            break;
+        case CLOSE_SESSION:
+            cout << "Replicating close session.\n";
+            close_session(e.arg1, addr);
+            break;
+        case FOLLOW:
+            cout << "Replicating FOLLOW command.\n";
+            follow_user(e.arg1, e.arg2);
+            break;
+        case CREATE_NOTIFICATION:
+            cout << "Replicating SEND command.\n";
+            create_notification(e.arg1, e.arg2, atoi(e.arg3), string(e.origin, strnlen(e.origin, sizeof(e.origin))), e.origin_post);
+            break;
+        case READ_OFFLINE:
+            cout << "Replicating read offline notifications.\n";
+            retrieve_notifications_from_offline_period(e.arg1, addr);
+            break;
+        case MULTI_OP: {
+            cout << "Replicating " << (int)e.num_ops << " operations event.\n";
+            vector<bool> results;
+            run_transaction(e, &results);
+            break;
         }
-
-        notification notif(notification_id_counter, user, timestamp, body, body.length(), pending_users);
-        COPY_active_notifications.push_back(notif);
-        assign_notification_to_active_sessions(notification_id_counter, followers[user]);
-        notification_id_counter += 1;
+        default:
+            break;
     }
 
-    bool committed;
-    if (backupMode)
+    applying_seqn = 0;
+}
+
+
+// Caller holds seqn_transaction_serializer. Events are recorded in seqn order, by the primary's
+// transactions or by the single applier of a backup
+void Server::record_event(event e)
+{
+    event_history.push_back(e);
+
+    if (e.seqn == (uint16_t)(applied_watermark + 1))
     {
-        committed = wait_primary_commit(create_notification_event);
+        applied_watermark = e.seqn;
+        election_seqn = applied_watermark;
+        pthread_cond_broadcast(&applied_watermark_advanced);
     }
-    else
+
+    if (e.committed)
+        mark_event_dirty(e);
+
+    if (e.committed && e.command == CREATE_NOTIFICATION)
     {
-        committed = send_backup_change(create_notification_event);
+        deque<event>& posts = recent_posts[e.arg1];
+        posts.push_back(e);
+        if (posts.size() > QUERY_TIMELINE_LENGTH)
+            posts.pop_front();
     }
+}
 
-    if (committed)
+int Server::command_durability(int command)
+{
+    switch (command)
     {
-        deepcopy_users_unread_notifications(false);
-        deepcopy_active_notifications(false);
-        deepcopy_active_users_pending_notifications(false);
-    } 
+        case OPEN_SESSION:          return OPEN_SESSION_DURABILITY;
+        case CLOSE_SESSION:         return CLOSE_SESSION_DURABILITY;
+        case READ_OFFLINE:          return READ_OFFLINE_DURABILITY;
+        case FOLLOW:                return FOLLOW_DURABILITY;
+        case CREATE_NOTIFICATION:   return CREATE_NOTIFICATION_DURABILITY;
+        default:                    return SYNC_ALL;
+    }
+}
 
-    create_notification_event.committed = committed;
-    event_history.push_back(create_notification_event);
+// a MULTI_OP event is as durable as its strictest operation
+int Server::durability_of(const event& e)
+{
+    int durability = ASYNC;
+    for (auto &op : event_operations(e))
+        durability = min(durability, command_durability(op.command));
+    return durability;
+}
 
-    print_events();
+// primary use: the event is already committed here, backups apply it without confirming.
+// Blocks the transaction when more than ASYNC_REPLICATION_MAX_LAG events are still unsent
+void Server::send_backup_change_async(event e)
+{
+    e.committed = true;
 
-    pthread_mutex_unlock(&seqn_transaction_serializer);
-    return committed;
+    pthread_mutex_lock(&async_replication_mutex);
+    async_unsent_events++;
+    pthread_mutex_unlock(&async_replication_mutex);
+
+    async_events->push(e);
 }
 
-// call this function after new notification is created
-void Server::assign_notification_to_active_sessions(uint32_t notification_id, list<string> followers) 
+// primary use: synchronous events must not overtake async ones still waiting to be sent
+void Server::wait_async_replication_drained()
 {
-    cout << "\nAssigning new notification to active sessions...\n";
-    
-    for (auto user : followers)
-    {
-        if(user_is_active(user)) 
-        {
-            for(auto address : sessions[user]) 
-            {
-                COPY_active_users_pending_notifications[address].push(notification_id);
-            }
-            // when all sessions from same user have notification on its entry, remove @ from list
-            list<uint32_t>::iterator it = find(COPY_users_unread_notifications[user].begin(), COPY_users_unread_notifications[user].end(), notification_id);
-            COPY_users_unread_notifications[user].erase(it);
+    pthread_mutex_lock(&async_replication_mutex);
+    while (async_unsent_events > 0)
+        pthread_cond_wait(&async_replication_drained, &async_replication_mutex);
+    pthread_mutex_unlock(&async_replication_mutex);
+}
 
-            // signal as many consumers to send to clients as pending users times possible sessions
-            for(int i = 0; i < followers.size()*2; i++)
-            {
-                pthread_cond_signal(&cond_notification_full);
+int Server::count_backup_oks(uint16_t eventSeqn)
+{
+    int oks = 0;
 
-            }
-        }
+    pthread_mutex_lock(&confirmedEventsMutex);
+    auto it = this->confirmedEvents.find(eventSeqn);
+    if (it != this->confirmedEvents.end())
+    {
+        for (auto &response : it->second)
+            if (response.second)
+                oks++;
     }
+    pthread_mutex_unlock(&confirmedEventsMutex);
 
+    return oks;
 }
 
-bool Server::user_is_active(string user) 
+// backups needed, with the primary, for a majority of the group. Counted on the configured
+// members, not the connected ones, so a partitioned primary cannot commit on its own
+int Server::backup_quorum()
 {
-    return sessions.find(user) != sessions.end() && !(sessions[user].empty());
+    int backups = this->possibleServerAddresses.size();
+    return (backups + 1) / 2;
 }
 
-// call this function when new session is started (after try_to_start_session()) to wake notification producer to client
-void Server::retrieve_notifications_from_offline_period(string user, host_address addr) 
+// long enough for the slowest of the backups to stage the event and answer
+long Server::commit_timeout_micros(const vector<int>& backups)
 {
-    cout << "\nGetting notifications from offline period to active sessions...\n";
-    pthread_mutex_lock(&seqn_transaction_serializer);
-    uint16_t seqn = get_current_sequence();
+    return peerRtt.timeout_micros(backups, COMMIT_TIMEOUT_FLOOR_MS * 1000L,
+                                  COMMIT_TIMEOUT_CEILING_MS * 1000L, BACKUPS_RESPONSE_TIMEOUT * 1000000L);
+}
 
-    event read_from_offline_period_event;
-    read_from_offline_period_event.seqn = seqn;
-    read_from_offline_period_event.command = READ_OFFLINE;
-    strcpy(read_from_offline_period_event.arg1, user.c_str());
-    strcpy(read_from_offline_period_event.arg2, addr.ipv4.c_str());
-    strcpy(read_from_offline_period_event.arg3, to_string(addr.port).c_str());
-    read_from_offline_period_event.committed = false; 
+// long enough for every server that could answer our ELECTION to do so
+long Server::election_timeout_micros()
+{
+    vector<int> peers;
+
+    pthread_mutex_lock(&connectedServersMutex);
+    for (auto &peer : this->connectedServers)
+        peers.push_back(peer.first);
+    pthread_mutex_unlock(&connectedServersMutex);
+
+    return peerRtt.timeout_micros(peers, ELECTION_TIMEOUT_FLOOR_MS * 1000L,
+                                  ELECTION_TIMEOUT_CEILING_MS * 1000L, ELECTION_TIMEOUT * 1000000L);
+}
+
+// Servers are ranked by how far their log goes, then by id: the new primary must hold every
+// event a quorum of backups may have confirmed, a greater id alone does not say it does
+bool Server::outranks(uint16_t candidateSeqn, int candidateID)
+{
+    uint16_t seqn = this->election_seqn;
+    if (seqn != candidateSeqn)
+        return (int16_t)(seqn - candidateSeqn) > 0;
+    return this->id > candidateID;
+}
+
+// primary use: OKs for this event become RTT samples of the backups that send them
+void Server::start_event_rtt_probe(uint16_t eventSeqn)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&confirmedEventsMutex);
+    confirmedEvents.insert({eventSeqn, {}});
+    eventsSentAt[eventSeqn] = now;
+    while (eventsSentAt.size() > CATCH_UP_WINDOW)   // OKs this late are not worth measuring
+        eventsSentAt.erase(eventsSentAt.begin());
+    pthread_mutex_unlock(&confirmedEventsMutex);
+}
+
+// server after this one in the replication chain, backups ordered by id; 0 for the tail
+// primary use: every connected backup, by id. The order is decided here and travels with
+// the event, backups never work it out from their own view of the group
+string Server::chain_order()
+{
+    string order;
+
+    pthread_mutex_lock(&connectedServersMutex);
+    for (auto &peer : this->connectedServers)
+        order += to_string(peer.first) + " ";
+    pthread_mutex_unlock(&connectedServersMutex);
+
+    return order;
+}
+
+// the server after this one in the order, the head when this one is not in it. 0 at the tail
+int Server::chain_successor(string order)
+{
+    istringstream members(order);
+    int member;
+    bool found = false;
+
+    while (members >> member){
+        if (member == this->id)
+            found = true;
+        else if (found || this->id == this->primarySeverID)
+            return member;
+    }
+    return 0;
+}
+
+int Server::chain_tail(string order)
+{
+    istringstream members(order);
+    int member, tail = 0;
+
+    while (members >> member)
+        tail = member;
+    return tail;
+}
+
+// event or SOK along the chain, with the order every server on the way forwards it in
+Packet Server::chain_packet(uint16_t type, event e, string order)
+{
+    Packet packet = Packet(type, e);
+    packet.setPayload((char*) order.c_str());
+    return packet;
+}
+
+bool Server::did_backup_ok_event(uint16_t eventSeqn, int peerID)
+{
+    bool oked = false;
+
+    pthread_mutex_lock(&confirmedEventsMutex);
+    auto it = this->confirmedEvents.find(eventSeqn);
+    if (it != this->confirmedEvents.end())
+    {
+        auto response = it->second.find(peerID);
+        oked = response != it->second.end() && response->second;
+    }
+    pthread_mutex_unlock(&confirmedEventsMutex);
+
+    return oked;
+}
+
+// primary use: the event only leaves through the head, every backup forwards it to the
+// next one and the tail's OK means the whole chain staged it. SOK follows the same path
+bool Server::send_backup_change_along_chain(event e)
+{
+    string order = chain_order();
+    int head = chain_successor(order);
+    int tail = chain_tail(order);
+    if (head == 0)
+        return true;
+
+    struct timespec sentAt;
+    clock_gettime(CLOCK_MONOTONIC, &sentAt);
+    start_event_rtt_probe(e.seqn);
+
+    // the tail's samples cover the whole chain
+    long timeoutMicros = commit_timeout_micros(vector<int>(1, tail));
+
+    cout << "Sending event to the head of the chain, server " << head << ".\n";
+    this->sendPacketToServer(head, chain_packet(e.command, e, order));
+
+    while(!did_backup_ok_event(e.seqn, tail))
+    {
+        if (RttEstimator::elapsed_micros(sentAt) >= timeoutMicros)
+        {
+            // a broken chain would not carry the abort, every backup hears it directly
+            cout << "Timeout for the tail of the chain response!\n";
+            sendPacketToAllServersInTheGroup(Packet(SNOK, e));
+            return false;
+        }
+    }
+
+    long elapsedMicros = RttEstimator::elapsed_micros(sentAt);
+    cout << "Chain acknowledged event " << e.seqn << " in " << elapsedMicros << " us, responding SOK!\n";
+    this->sendPacketToServer(head, chain_packet(SOK, e, order));
+    return true;
+}
+
+bool Server::send_backup_change(event e)
+{
+    int durability = durability_of(e);
+    if (durability == ASYNC)
+    {
+        send_backup_change_async(e);
+        return true;
+    }
+
+    wait_async_replication_drained();
+
+    if (REPLICATION_TOPOLOGY == CHAIN_TOPOLOGY)
+        return send_backup_change_along_chain(e);
+
+    cout << "Sending event to all backup replicas.\n";
+    // Add event seqn to the map of confirmed events
+    struct timespec sentAt;
+    clock_gettime(CLOCK_MONOTONIC, &sentAt);
+    start_event_rtt_probe(e.seqn);
+
+    // Send new event to the backups in the synchronous set, lagging ones get it from the catch-up stream
+    vector<int> recipients = send_event_to_live_backups(e);
+    long timeoutMicros = commit_timeout_micros(recipients);
+    // Wait for all backup servers response until timeout
+    while(!didAllBackupsRespondedEvent(e.seqn, recipients))
+    {
+        if (durability == SYNC_QUORUM && count_backup_oks(e.seqn) >= backup_quorum())
+        {
+            cout << "Quorum of backups reached, responding SOK!\n";
+            sendPacketToServers(recipients, Packet(SOK, e));
+            return true;
+        }
+
+        if (RttEstimator::elapsed_micros(sentAt) >= timeoutMicros)  // Backups response timed out
+        {
+            // the event does not fail for everyone: silent backups commit this event when they
+            // get to it, and leave the synchronous set after missing MISSED_ACKS_BEFORE_LAGGING
+            cout << "Timeout for backup replicas response after " << timeoutMicros / 1000 << " ms!\n";
+            int oks = count_backup_oks(e.seqn);
+            mark_silent_backups_lagging(e.seqn, recipients);
+
+            // without a majority the event may be lost with this primary, it is not committed
+            if (durability == SYNC_QUORUM && oks < backup_quorum())
+            {
+                cout << "Only " << oks << " backups confirmed, responding SNOK to backups D:\n";
+                sendPacketToServers(recipients, Packet(SNOK, e));
+                return false;
+            }
+            break;
+        }
+
+    }
+
+    if (didAllBackupsOkedEvent(e.seqn, recipients)) {
+        cout << "Responding SOK to backups!\n";
+        sendPacketToServers(recipients, Packet(SOK, e));
+        return true;
+    }
+    else{
+        cout << "Responding SNOK to backups D:\n";
+        sendPacketToServers(recipients, Packet(SNOK, e));
+        return false;  
+    }
+}
+
+// primary use: queues the event for every backup in the synchronous set and returns who got
+// it. A backup whose outbound queue is full leaves the set instead of stalling the commit
+vector<int> Server::send_event_to_live_backups(event e)
+{
+    vector<int> recipients;
+    shared_ptr<const Packet> packet = make_shared<const Packet>(Packet(e.command, e));
+
+    pthread_mutex_lock(&connectedServersMutex);
+    for (auto &peer : this->peerSenders){
+        backup_progress& progress = this->backups_progress[peer.first];
+        if (progress.lagging)
+            continue;
+
+        if (peer.second->try_send(packet)){
+            progress.sent_seqn = e.seqn;
+            recipients.push_back(peer.first);
+        }
+        else{
+            cout << "Backup " << peer.first << " is not keeping up, moving it to catch-up.\n";
+            progress.lagging = true;
+        }
+    }
+    pthread_mutex_unlock(&connectedServersMutex);
+
+    return recipients;
+}
+
+void Server::mark_silent_backups_lagging(uint16_t eventSeqn, const vector<int>& backups)
+{
+    pthread_mutex_lock(&confirmedEventsMutex);
+    pthread_mutex_lock(&connectedServersMutex);
+
+    auto responses = this->confirmedEvents.find(eventSeqn);
+    for (auto backup : backups){
+        if (responses == this->confirmedEvents.end())
+            break;
+        if (this->connectedServers.find(backup) == this->connectedServers.end())
+            continue;
+        if (responses->second.find(backup) != responses->second.end())
+            continue;
+
+        responses->second.insert({backup, true});   // its answer is no longer awaited
+        backup_progress& progress = this->backups_progress[backup];
+        if (++progress.missed_acks < MISSED_ACKS_BEFORE_LAGGING){
+            cout << "Backup " << backup << " did not answer event " << eventSeqn << " in time (" << progress.missed_acks << " in a row).\n";
+            continue;
+        }
+        cout << "Backup " << backup << " did not answer event " << eventSeqn << ", moving it to catch-up.\n";
+        progress.lagging = true;
+    }
+
+    pthread_mutex_unlock(&connectedServersMutex);
+    pthread_mutex_unlock(&confirmedEventsMutex);
+}
+
+void Server::record_backup_progress(int peerID, uint16_t appliedSeqn)
+{
+    pthread_mutex_lock(&connectedServersMutex);
+    auto it = this->backups_progress.find(peerID);
+    if (it != this->backups_progress.end()){
+        it->second.missed_acks = 0;
+        if (it->second.applied_seqn < appliedSeqn)
+            it->second.applied_seqn = appliedSeqn;
+        if (it->second.sent_seqn < appliedSeqn)
+            it->second.sent_seqn = appliedSeqn;
+    }
+    pthread_mutex_unlock(&connectedServersMutex);
+}
+
+// primary use: streams the log to lagging backups in ranges of CATCH_UP_BATCH events, never more
+// than CATCH_UP_WINDOW ahead of what they applied. Holding the transaction mutex, a backup
+// that applied the whole log rejoins the synchronous set before any new event is replicated
+void Server::serve_lagging_backups()
+{
+    if (backupMode)
+        return;
+
+    pthread_mutex_lock(&seqn_transaction_serializer);
+    pthread_mutex_lock(&connectedServersMutex);
+
+    uint16_t last_seqn = event_history.empty() ? 0 : event_history.back().seqn;
+    for (auto &entry : this->backups_progress){
+        backup_progress& progress = entry.second;
+        auto sender = this->peerSenders.find(entry.first);
+        if (!progress.lagging || sender == this->peerSenders.end())
+            continue;
+
+        while (!progress.deferred.empty() && sender->second->try_send(progress.deferred.front()))
+            progress.deferred.pop_front();
+        if (!progress.deferred.empty())
+            continue;
+
+        int batch = 0;
+        while (progress.sent_seqn < last_seqn && batch < CATCH_UP_BATCH
+                && progress.sent_seqn - progress.applied_seqn < CATCH_UP_WINDOW){
+            const event& ev = event_history[progress.sent_seqn];  // history index is seqn - 1
+            if (!sender->second->try_send(make_shared<const Packet>(Packet(CATCH_UP_EVENT, ev, 1))))
+                break;
+            progress.sent_seqn++;
+            batch++;
+        }
+
+        // sent is not applied: it rejoins once it reported the whole log applied
+        if (progress.applied_seqn >= last_seqn){
+            cout << "Backup " << entry.first << " caught up, back to synchronous replication.\n";
+            progress.lagging = false;
+            progress.stalled_rounds = 0;
+            continue;
+        }
+
+        // everything went out but it stopped applying: what it lost is sent again
+        if (progress.applied_seqn != progress.served_applied || progress.sent_seqn < last_seqn)
+            progress.stalled_rounds = 0;
+        else if (++progress.stalled_rounds >= CATCH_UP_STALL_ROUNDS){
+            cout << "Backup " << entry.first << " stopped at event " << progress.applied_seqn << ", sending the log again from there.\n";
+            progress.sent_seqn = progress.applied_seqn;
+            progress.stalled_rounds = 0;
+        }
+        progress.served_applied = progress.applied_seqn;
+    }
+
+    pthread_mutex_unlock(&connectedServersMutex);
+    pthread_mutex_unlock(&seqn_transaction_serializer);
+}
+
+// Caller holds seqn_transaction_serializer. Users whose followings, sessions or unread
+// list a committed event changed, rehashed on the next digest
+void Server::mark_event_dirty(const event& e)
+{
+    if (e.command == CREATE_NOTIFICATION)
+    {
+        uint32_t author_id;
+        if (!is_fanned_out_on_read(e.arg1) && followers.get_id(e.arg1, &author_id))
+        {
+            for (auto follower : followers.followers_of(author_id))
+                state_digest.mark_dirty(followers.name_of(follower));
+        }
+        return;
+    }
+
+    for (auto &op : event_operations(e))
+        state_digest.mark_dirty(op.arg1);
+}
+
+// Caller holds seqn_transaction_serializer
+void Server::refresh_state_digest()
+{
+    for (auto &user : state_digest.take_dirty())
+    {
+        if (user_exists(user))
+            state_digest.set_user(user, StateDigest::hash(user_state_digest_input(user)));
+        else
+            state_digest.remove_user(user);
+    }
+}
+
+// graph ids are handed out in arrival order and differ between servers, names do not
+vector<string> Server::following_names(string user)
+{
+    vector<string> names;
+    uint32_t user_id;
+    if (followers.get_id(user, &user_id))
+    {
+        for (auto followed : followers.following_of(user_id))
+            names.push_back(followers.name_of(followed));
+    }
+    sort(names.begin(), names.end());
+    return names;
+}
+
+string Server::user_state_digest_input(string user)
+{
+    string input = user + "\n";
+    for (auto &name : following_names(user))
+        input += name + ",";
+
+    input += "\n";
+    auto user_sessions = sessions.find(user);
+    if (user_sessions != sessions.end())
+    {
+        for (auto &address : user_sessions->second)
+            input += address.ipv4 + ":" + to_string(address.port) + ";";
+    }
+
+    input += "\n";
+    auto unread = users_unread_notifications.find(user);
+    if (unread != users_unread_notifications.end())
+    {
+        for (auto notification_id : unread->second)
+            input += to_string(notification_id) + ",";
+    }
+    return input;
+}
+
+
+// primary use: group hashes of the committed state, to every backup in the synchronous set.
+// Skipped while async events are unsent, the backups could not be at the same event
+void Server::send_state_digests()
+{
+    if (backupMode)
+        return;
+
+    pthread_mutex_lock(&async_replication_mutex);
+    bool async_pending = async_unsent_events > 0;
+    pthread_mutex_unlock(&async_replication_mutex);
+    if (async_pending)
+        return;
+
+    pthread_mutex_lock(&seqn_transaction_serializer);
+    refresh_state_digest();
+
+    string groupHashes;
+    char hex[17];
+    for (int g = 0; g < StateDigest::groups(); g++)
+    {
+        snprintf(hex, sizeof(hex), "%016llx", (unsigned long long) state_digest.group_hash(g));
+        groupHashes += (g == 0 ? "" : ",") + string(hex);
+    }
+
+    Packet digest = Packet(STATE_DIGEST, groupHashes.c_str());
+    digest.setSeqn(event_history.empty() ? 0 : event_history.back().seqn);
+    shared_ptr<const Packet> packet = make_shared<const Packet>(digest);
+
+    // a digest is worth nothing to a backup that is behind, and never worth waiting for
+    pthread_mutex_lock(&connectedServersMutex);
+    for (auto &peer : this->peerSenders){
+        if (!this->backups_progress[peer.first].lagging)
+            peer.second->try_send(packet);
+    }
+    pthread_mutex_unlock(&connectedServersMutex);
+
+    pthread_mutex_unlock(&seqn_transaction_serializer);
+}
+
+// primary use: a backup sent the bucket hashes of a group that differed, the buckets that
+// still differ from the current state are sent in full
+void Server::send_differing_buckets(string bucketDigest)
+{
+    if (backupMode)
+        return;
+
+    size_t idEnd = bucketDigest.find(':');
+    size_t groupEnd = bucketDigest.find(':', idEnd + 1);
+    if (idEnd == string::npos || groupEnd == string::npos)
+        return;
+
+    int peerID = atoi(bucketDigest.substr(0, idEnd).c_str());
+    int group = atoi(bucketDigest.substr(idEnd + 1, groupEnd - idEnd - 1).c_str());
+    if (group < 0 || group >= StateDigest::groups())
+        return;
+
+    pthread_mutex_lock(&seqn_transaction_serializer);
+    refresh_state_digest();
+    uint16_t seqn = event_history.empty() ? 0 : event_history.back().seqn;
+
+    const char* hashes = bucketDigest.c_str() + groupEnd + 1;
+    for (int b = group * STATE_DIGEST_GROUP_SIZE; b < (group + 1) * STATE_DIGEST_GROUP_SIZE; b++)
+    {
+        char* next;
+        uint64_t backupHash = strtoull(hashes, &next, 16);
+        hashes = (*next == ',') ? next + 1 : next;
+
+        if (backupHash != state_digest.bucket_hash(b))
+        {
+            cout << "Backup " << peerID << " diverged in state bucket " << b << ", sending it as of event " << seqn << ".\n";
+            send_state_bucket(peerID, b, seqn);
+        }
+    }
+
+    pthread_mutex_unlock(&seqn_transaction_serializer);
+}
+
+// Caller holds seqn_transaction_serializer. The records of a bucket travel on the bulk
+// lane between the same events as the digest, so the backup sees them at event seqn
+void Server::send_state_bucket(int peerID, int bucket, uint16_t seqn)
+{
+    vector<string> records;
+    records.push_back("B:" + to_string(bucket));
+
+    for (auto &entry : user_sessions_semaphore)
+    {
+        const string& user = entry.first;
+        if (StateDigest::bucket_of(user) != bucket)
+            continue;
+
+        records.push_back("U:" + user);
+        append_list_records(&records, "F:" + user + ":", following_names(user));
+
+        for (auto &address : sessions[user])
+            records.push_back("S:" + user + ":" + address.ipv4 + ":" + to_string(address.port));
+
+        vector<string> unread;
+        for (auto notification_id : users_unread_notifications[user])
+            unread.push_back(to_string(notification_id));
+        append_list_records(&records, "N:" + user + ":", unread);
+    }
+
+    records.push_back("E:" + to_string(bucket));
+
+    vector<int> peer(1, peerID);
+    for (auto &record : records)
+    {
+        Packet repair = Packet(STATE_REPAIR, record.c_str());
+        repair.setSeqn(seqn);
+        sendPacketToServers(peer, repair);
+    }
+}
+
+void Server::append_list_records(vector<string>* records, string prefix, const vector<string>& items)
+{
+    string record = prefix;
+    for (auto &item : items)
+    {
+        if (record.length() + item.length() + 1 > STATE_REPAIR_RECORD_LENGTH)
+        {
+            records->push_back(record);
+            record = prefix;
+        }
+        record += item + ",";
+    }
+
+    if (record.length() > prefix.length())
+        records->push_back(record);
+}
+
+
+// backup use, from the bulk reader: compares the primary's group hashes once every event
+// before the digest is applied, and asks for the bucket hashes of the groups that differ
+void Server::compare_state_digest(uint16_t seqn, string groupDigest)
+{
+    wait_replicated_events_applied();
+
+    vector<string> bucketDigests;
+    pthread_mutex_lock(&seqn_transaction_serializer);
+    uint16_t last_seqn = event_history.empty() ? 0 : event_history.back().seqn;
+    if (last_seqn == seqn)
+    {
+        refresh_state_digest();
+
+        const char* hashes = groupDigest.c_str();
+        char hex[17];
+        for (int g = 0; g < StateDigest::groups(); g++)
+        {
+            char* next;
+            uint64_t primaryHash = strtoull(hashes, &next, 16);
+            hashes = (*next == ',') ? next + 1 : next;
+            if (primaryHash == state_digest.group_hash(g))
+                continue;
+
+            string bucketDigest = to_string(this->id) + ":" + to_string(g) + ":";
+            for (int b = g * STATE_DIGEST_GROUP_SIZE; b < (g + 1) * STATE_DIGEST_GROUP_SIZE; b++)
+            {
+                snprintf(hex, sizeof(hex), "%016llx", (unsigned long long) state_digest.bucket_hash(b));
+                bucketDigest += (b == g * STATE_DIGEST_GROUP_SIZE ? "" : ",") + string(hex);
+            }
+            bucketDigests.push_back(bucketDigest);
+        }
+    }
+    pthread_mutex_unlock(&seqn_transaction_serializer);
+
+    for (auto &bucketDigest : bucketDigests)
+    {
+        cout << "State differs from the primary at event " << seqn << ", comparing buckets.\n";
+        sendPacketToPrimaryServer(Packet(BUCKET_DIGEST, bucketDigest.c_str()));
+    }
+}
+
+// backup use, from the bulk reader: records are gathered until the bucket is closed
+void Server::receive_state_repair(uint16_t seqn, string record)
+{
+    if (record.length() < 2)
+        return;
+
+    string body = record.substr(2);
+    size_t userEnd = body.find(':');
+    string user = body.substr(0, userEnd);
+    string rest = (userEnd == string::npos) ? "" : body.substr(userEnd + 1);
+
+    if (record[0] == 'B')
+    {
+        pending_repair = state_repair();
+        pending_repair.active = true;
+        pending_repair.bucket = atoi(body.c_str());
+        pending_repair.seqn = seqn;
+        return;
+    }
+    if (!pending_repair.active || pending_repair.seqn != seqn)
+        return;
+
+    switch (record[0])
+    {
+        case 'U':
+            pending_repair.users[user];
+            break;
+
+        case 'F':
+        case 'N': {
+            repaired_user& state = pending_repair.users[user];
+            size_t start = 0, end;
+            while ((end = rest.find(',', start)) != string::npos)
+            {
+                string item = rest.substr(start, end - start);
+                if (record[0] == 'F')
+                    state.following.push_back(item);
+                else
+                    state.unread.push_back(strtoul(item.c_str(), NULL, 10));
+                start = end + 1;
+            }
+            break;
+        }
+
+        case 'S': {
+            host_address address;
+            size_t ipEnd = rest.find(':');
+            address.ipv4 = rest.substr(0, ipEnd);
+            address.port = atoi(rest.substr(ipEnd + 1).c_str());
+            pending_repair.users[user].sessions.push_back(address);
+            break;
+        }
+
+        case 'E':
+            apply_state_repair();
+            pending_repair = state_repair();
+            break;
+
+        default:
+            break;
+    }
+}
+
+// the bucket replaces the local one only if this backup is at the event it was taken at
+void Server::apply_state_repair()
+{
+    wait_replicated_events_applied();
+
+    pthread_mutex_lock(&seqn_transaction_serializer);
+    uint16_t last_seqn = event_history.empty() ? 0 : event_history.back().seqn;
+    if (last_seqn == pending_repair.seqn)
+    {
+        vector<string> stale;
+        for (auto &entry : user_sessions_semaphore)
+        {
+            if (StateDigest::bucket_of(entry.first) == pending_repair.bucket
+                    && pending_repair.users.find(entry.first) == pending_repair.users.end())
+                stale.push_back(entry.first);
+        }
+        for (auto &user : stale)
+            drop_user_state(user);
+
+        for (auto &entry : pending_repair.users)
+            repair_user_state(entry.first, entry.second);
+
+        cout << "Repaired state bucket " << pending_repair.bucket << " from the primary at event " << last_seqn << ".\n";
+    }
+    pthread_mutex_unlock(&seqn_transaction_serializer);
+}
+
+// Caller holds seqn_transaction_serializer
+void Server::repair_user_state(string user, const repaired_user& state)
+{
+    if (!user_exists(user))
+    {
+        sem_t num_sessions;
+        sem_init(&num_sessions, 0, 2);
+        user_sessions_semaphore.insert({user, num_sessions});
+        sessions.insert({user, list<host_address>()});
+        followers.add_user(user);
+        users_unread_notifications.insert({user, list<uint32_t>()});
+    }
+
+    vector<string> current = following_names(user);
+    for (auto &followed : current)
+        if (find(state.following.begin(), state.following.end(), followed) == state.following.end())
+            followers.unfollow(user, followed);
+    for (auto &followed : state.following)
+        followers.follow(user, followed);
+
+    list<host_address>& user_sessions = sessions[user];
+    for (auto &address : user_sessions)
+        if (find(state.sessions.begin(), state.sessions.end(), address) == state.sessions.end())
+            active_sessions.erase(make_session_key(address));
+    for (auto &address : state.sessions)
+        if (active_sessions.find(make_session_key(address)) == active_sessions.end())
+            active_sessions.insert({make_session_key(address), user_session(user, address)});
+    user_sessions = state.sessions;
+
+    sem_destroy(&user_sessions_semaphore[user]);
+    sem_init(&user_sessions_semaphore[user], 0, state.sessions.size() < 2 ? 2 - state.sessions.size() : 0);
+
+    users_unread_notifications[user] = state.unread;
+    state_digest.mark_dirty(user);
+}
+
+// Caller holds seqn_transaction_serializer. The user stays interned in the graph, without edges
+void Server::drop_user_state(string user)
+{
+    for (auto &followed : following_names(user))
+        followers.unfollow(user, followed);
+
+    for (auto &address : sessions[user])
+        active_sessions.erase(make_session_key(address));
+
+    sem_destroy(&user_sessions_semaphore[user]);
+    user_sessions_semaphore.erase(user);
+    sessions.erase(user);
+    users_unread_notifications.erase(user);
+    state_digest.mark_dirty(user);
+}
+
+
+// call this function when new notification is created. A post forwarded by another shard names
+// its origin link and post number there; the last one applied per origin is replicated state, so
+// a post retried after a lost reply is taken once, by this primary or by the next one
+bool Server::create_notification(string user, string body, time_t timestamp, string origin, uint32_t origin_post)
+{
+    cout << "\nNew notification!\n";
+    pthread_mutex_lock(&seqn_transaction_serializer);
+
+    // the links send their posts in order, a backup replays what its primary already let through
+    if (!origin.empty() && !backupMode)
+    {
+        auto last = forwarded_posts.find(origin);
+        if (last != forwarded_posts.end() && last->second >= origin_post)
+        {
+            cout << "Post " << origin_post << " of " << origin << " already applied, ignoring.\n";
+            pthread_mutex_unlock(&seqn_transaction_serializer);
+            return true;
+        }
+    }
+
+    uint16_t seqn = get_current_sequence();
+
+    event create_notification_event;
+    create_notification_event.seqn = seqn;
+    create_notification_event.command = CREATE_NOTIFICATION;
+    strcpy(create_notification_event.arg1, user.c_str());
+    strcpy(create_notification_event.arg2, body.c_str());
+    strcpy(create_notification_event.arg3, to_string(timestamp).c_str());
+    create_notification_event.committed = false; 
+    create_notification_event.num_ops = 0;
+    strcpy(create_notification_event.origin, origin.c_str());
+    create_notification_event.origin_post = origin_post;
 
     deepcopy_users_unread_notifications(true);
-    deepcopy_active_users_pending_notifications(true);
-    
-    for(auto notification_id : users_unread_notifications[user]) 
+    deepcopy_active_notifications(true);
+    deepcopy_active_sessions(true);
+    deepcopy_author_timeline(user, true);
+    if (!origin.empty())
     {
-        COPY_active_users_pending_notifications[addr].push(notification_id);
+        deepcopy_forwarded_post(origin, true);
+        COPY_forwarded_posts[origin] = origin_post;
+    }
+
+    shared_ptr<const notification> notif;
+    uint32_t author_id;
+    vector<uint32_t> follower_ids;  // the ones homed on this shard
+    set<int> remote_shards;
+    if (followers.get_id(user, &author_id))
+        split_followers(user, followers.followers_of(author_id), &follower_ids, &remote_shards);
+
+    if (!follower_ids.empty())
+    {
+        notif = make_shared<const notification>(notification_id_counter, user, timestamp, body, body.length(), follower_ids.size());
+        COPY_active_notifications.push_back(notif);
+
+        if (is_fanned_out_on_read(user))
+        {
+            // a single append, followers merge it through their read cursors when delivering
+            COPY_author_timelines[user].push_back(notification_id_counter);
+        }
+        else
+        {
+            for (auto follower : follower_ids)
+            {                    
+                COPY_users_unread_notifications[followers.name_of(follower)].push_back(notification_id_counter);
+            }
+            assign_notification_to_active_sessions(notification_id_counter, follower_ids);
+        }
+        notification_id_counter += 1;
     }
-    
-    (COPY_users_unread_notifications[user]).clear();
 
     bool committed;
     if (backupMode)
     {
-        committed = wait_primary_commit(read_from_offline_period_event);
+        committed = wait_primary_commit(create_notification_event);
     }
     else
     {
-        committed = send_backup_change(read_from_offline_period_event);
+        committed = send_backup_change(create_notification_event);
     }
 
     if (committed)
     {
         deepcopy_users_unread_notifications(false);
-        deepcopy_active_users_pending_notifications(false);
+        deepcopy_active_notifications(false);
+        deepcopy_active_sessions(false);
+        deepcopy_author_timeline(user, false);
+        if (!origin.empty())
+            deepcopy_forwarded_post(origin, false);
+
+        // live delivery is left to the fan-out workers, the client is answered right after commit
+        // backups only deliver to the sessions handed to them by clients. An author fanned out on
+        // read is only pushed to the followers online now, the others merge it when they log in
+        if (notif && (!backupMode || !delivery_index.empty()))
+        {
+            if (is_fanned_out_on_read(user))
+                follower_ids = online_followers(author_id);
+            if (!follower_ids.empty())
+                fanout_pool->submit(notif, make_shared< const vector<uint32_t> >(move(follower_ids)));
+        }
     } 
 
-    read_from_offline_period_event.committed = committed;
-    event_history.push_back(read_from_offline_period_event);
+    create_notification_event.committed = committed;
+    record_event(create_notification_event);
 
     print_events();
 
-    // signal consumer
-    pthread_cond_signal(&cond_notification_full);
+    bool primary = !backupMode;
     pthread_mutex_unlock(&seqn_transaction_serializer);
+
+    // the other shards' queues may be full while one of them is down, only this client waits
+    if (committed && primary && !remote_shards.empty())
+        forward_notification(user, body, timestamp, remote_shards);
+    return committed;
 }
 
-// call this function on consumer thread that will feed the user with its notifications
-void Server::read_notifications(host_address addr, vector<notification>* notifications) 
+// keeps the followers homed on this shard, and for an author homed here, the shards of the others
+void Server::split_followers(string author, const vector<uint32_t>& follower_ids, vector<uint32_t>* local_ids, set<int>* remote_shards)
 {
-    pthread_mutex_lock(&seqn_transaction_serializer);
-    cout << "\nReading notifications of active session...\n";
-
-    while (active_users_pending_notifications[addr].empty()) { 
-        // sleep while user doesn't have notifications to read
-        cout << "No notifications for address " << addr.ipv4 <<":"<< addr.port << ". Sleeping...\n";
-        pthread_cond_wait(&cond_notification_full, &seqn_transaction_serializer); 
+    if (shardMap.size() <= 1)
+    {
+        *local_ids = follower_ids;
+        return;
     }
 
-    cout << "Assembling notifications...\n";
-    uint16_t seqn = get_current_sequence();
-    event read_notification_event;
-    read_notification_event.seqn = seqn;
-    read_notification_event.command = READ_NOTIFICATIONS;
-    strcpy(read_notification_event.arg1, addr.ipv4.c_str());
-    strcpy(read_notification_event.arg2, to_string(addr.port).c_str());
-    strcpy(read_notification_event.arg3, "");
-    read_notification_event.committed = false; 
+    bool home_author = is_home_shard(author);
+    for (auto follower : follower_ids)
+    {
+        int follower_shard = shardMap.shard_of_user(followers.name_of(follower));
+        if (follower_shard == shard)
+            local_ids->push_back(follower);
+        else if (home_author)
+            remote_shards->insert(follower_shard);
+    }
+}
 
-    deepcopy_active_users_pending_notifications(true);
+void Server::forward_notification(string author, string body, time_t timestamp, const set<int>& remote_shards)
+{
+    for (auto remote_shard : remote_shards)
+    {
+        cout << "Forwarding notification of " << author << " to shard " << remote_shard << "\n";
+        shardLinks[remote_shard]->post(Packet(SHARD_NOTIFICATION, timestamp, body.c_str(), author.c_str()));
+    }
+}
 
-    while(!COPY_active_users_pending_notifications[addr].empty()) 
+// call this function after new notification is created
+void Server::assign_notification_to_active_sessions(uint32_t notification_id, const vector<uint32_t>& follower_ids) 
+{
+    cout << "\nAssigning new notification to active sessions...\n";
+    
+    for (auto follower : follower_ids)
     {
-        uint32_t notification_id = (COPY_active_users_pending_notifications[addr]).top();
-        for(auto notif : active_notifications)
+        string user = followers.name_of(follower);
+        if(user_is_active(user)) 
         {
-            if(notif.id == notification_id)
+            for(auto address : sessions[user]) 
             {
-                notifications->push_back(notif);
-                break;
+                auto session = COPY_active_sessions.find(make_session_key(address));
+                if (session != COPY_active_sessions.end())
+                {
+                    prune_delivered(session->first, &(session->second.pending));
+                    session->second.pending.push(notification_id);
+                }
             }
+            // when all sessions from same user have notification on its entry, remove @ from list
+            list<uint32_t>::iterator it = find(COPY_users_unread_notifications[user].begin(), COPY_users_unread_notifications[user].end(), notification_id);
+            COPY_users_unread_notifications[user].erase(it);
         }
-        
-        (COPY_active_users_pending_notifications[addr]).pop();
     }
 
-    bool committed;
-    if (backupMode)
+}
+
+shared_ptr<const notification> Server::find_active_notification(uint32_t notification_id)
+{
+    auto it = lower_bound(active_notifications.begin(), active_notifications.end(), notification_id,
+        [](const shared_ptr<const notification>& notif, uint32_t id) { return notif->id < id; });
+
+    if (it != active_notifications.end() && (*it)->id == notification_id)
+        return *it;
+    return shared_ptr<const notification>();
+}
+
+shared_ptr<SessionChannel> Server::get_session_channel(host_address addr)
+{
+    shared_ptr<SessionChannel> channel;
+
+    pthread_mutex_lock(&seqn_transaction_serializer);
+    auto session = active_sessions.find(make_session_key(addr));
+    if (session != active_sessions.end())
+        channel = session->second.channel;
+    pthread_mutex_unlock(&seqn_transaction_serializer);
+
+    return channel;
+}
+
+bool Server::user_is_active(string user) 
+{
+    return sessions.find(user) != sessions.end() && !(sessions[user].empty());
+}
+
+bool Server::is_fanned_out_on_read(string author)
+{
+    return followers.followers_count(author) >= FANOUT_ON_READ_THRESHOLD;
+}
+
+// Staged on an offline read: adds to pending what the fanned out on read authors posted past the
+// user's cursors and moves the cursors to the end of their timelines, as the unread list is cleared
+void Server::merge_author_timelines(string user, pending_queue* pending)
+{
+    auto cursors = COPY_read_cursors.find(user);
+    if (cursors == COPY_read_cursors.end())
+        return;
+
+    uint32_t delivered_up_to = user_watermark(user);
+    for (auto &cursor : cursors->second)
     {
-        committed = wait_primary_commit(read_notification_event);
+        auto timeline = author_timelines.find(cursor.first);
+        if (timeline == author_timelines.end())
+            continue;
+
+        // entries up to the user's delivery watermark were pushed live to one of its sessions
+        size_t read = upper_bound(timeline->second.begin(), timeline->second.end(), delivered_up_to) - timeline->second.begin();
+        for (size_t i = max((size_t)cursor.second, read); i < timeline->second.size(); i++)
+            pending->push(timeline->second[i]);
+        cursor.second = timeline->second.size();
     }
-    else
+}
+
+// the followers of an author fanned out on read that have a session open here, found from the
+// sessions rather than from the author's whole follower list
+vector<uint32_t> Server::online_followers(uint32_t author_id)
+{
+    vector<uint32_t> online;
+    for (auto &user_sessions : sessions)
     {
-        committed = send_backup_change(read_notification_event);
+        uint32_t user_id;
+        if (user_sessions.second.empty() || !followers.get_id(user_sessions.first, &user_id))
+            continue;
+        const vector<uint32_t>& followed = followers.following_of(user_id);
+        if (binary_search(followed.begin(), followed.end(), author_id))
+            online.push_back(user_id);
     }
+    return online;
+}
 
-    if (committed)
-    {
-        deepcopy_active_users_pending_notifications(false);
-    } 
-    else
+uint32_t Server::session_watermark(session_key key)
+{
+    uint32_t watermark = 0;
+    pthread_mutex_lock(&delivery_progress_mutex);
+    auto it = session_watermarks.find(key);
+    if (it != session_watermarks.end())
+        watermark = it->second;
+    pthread_mutex_unlock(&delivery_progress_mutex);
+    return watermark;
+}
+
+uint32_t Server::user_watermark(string user)
+{
+    uint32_t watermark = 0;
+    pthread_mutex_lock(&delivery_progress_mutex);
+    auto it = user_watermarks.find(user);
+    if (it != user_watermarks.end())
+        watermark = it->second;
+    pthread_mutex_unlock(&delivery_progress_mutex);
+    return watermark;
+}
+
+// drops from the head of pending what the session already delivered
+void Server::prune_delivered(session_key key, pending_queue* pending)
+{
+    if (pending->empty())
+        return;
+
+    uint32_t watermark = session_watermark(key);
+    while (!pending->empty() && pending->top() <= watermark)
+        pending->pop();
+}
+
+// call this function when new session is started (after try_to_start_session()) to wake notification producer to client
+void Server::retrieve_notifications_from_offline_period(string user, host_address addr) 
+{
+    cout << "\nGetting notifications from offline period to active sessions...\n";
+
+    event read_from_offline_period_event;
+    read_from_offline_period_event.command = READ_OFFLINE;
+    strcpy(read_from_offline_period_event.arg1, user.c_str());
+    strcpy(read_from_offline_period_event.arg2, addr.ipv4.c_str());
+    strcpy(read_from_offline_period_event.arg3, to_string(addr.port).c_str());
+    read_from_offline_period_event.num_ops = 0;
+
+    vector<bool> results;
+    run_transaction(read_from_offline_period_event, &results);
+}
+
+// reads the staged state, so it also sees a session opened earlier in the same transaction
+void Server::stage_read_offline(string user, host_address addr)
+{
+    auto session = COPY_active_sessions.find(make_session_key(addr));
+    if (session != COPY_active_sessions.end())
     {
-        notifications->clear();
+        prune_delivered(session->first, &(session->second.pending));
+        for(auto notification_id : COPY_users_unread_notifications[user]) 
+        {
+            session->second.pending.push(notification_id);
+        }
+        merge_author_timelines(user, &(session->second.pending));
     }
     
+    (COPY_users_unread_notifications[user]).clear();
+}
+
+void Server::finish_read_offline(string user, host_address addr)
+{
+    // hand everything still pending to the session sender, which also covers
+    // sessions resumed on this server after a failover
+    auto session = active_sessions.find(make_session_key(addr));
+    if (session != active_sessions.end() && !backupMode)
+        start_session_delivery(user, session->first, session->second);
+}
 
-    read_notification_event.committed = committed;
-    event_history.push_back(read_notification_event);
+// Caller holds seqn_transaction_serializer. Skips what the session watermark says was already
+// sent, by this server or by the one that delivered to the session before
+void Server::start_session_delivery(string user, session_key key, user_session& session)
+{
+    uint32_t user_id;
+    if (!followers.get_id(user, &user_id))
+        return;
 
-    print_events();
+    uint32_t delivered_up_to = session_watermark(key);
+    pending_queue pending = session.pending;
+    while (!pending.empty())
+    {
+        shared_ptr<const notification> notif = find_active_notification(pending.top());
+        if (notif && (delivered_up_to == 0 || notif->id > delivered_up_to))
+            session.channel->push(notif);
+        pending.pop();
+    }
+
+    // from now on fan-out workers deliver what is created after this point
+    delivery_index.register_session(user_id, key, session.channel, notification_id_counter);
+}
 
-    // signal producer
-    pthread_cond_signal(&cond_notification_empty);
-    pthread_cond_signal(&cond_notification_full); // waking someone again can improve client consumption flow
+// A replica takes over the delivery to a session the primary opened, once it applied the login
+shared_ptr<SessionChannel> Server::take_over_delivery(string user, host_address addr, uint16_t min_seqn)
+{
+    shared_ptr<SessionChannel> channel;
+
+    pthread_mutex_lock(&seqn_transaction_serializer);
+    if (wait_applied(min_seqn))
+    {
+        auto session = active_sessions.find(make_session_key(addr));
+        if (session != active_sessions.end() && session->second.user == user)
+        {
+            // a channel of its own, the sender of a connection the client gave up on exits
+            shared_ptr<SessionChannel> previous = session->second.channel;
+            session->second.channel = make_shared<SessionChannel>();
+            previous->close();
+
+            start_session_delivery(user, session->first, session->second);
+            channel = session->second.channel;
+        }
+    }
+    pthread_mutex_unlock(&seqn_transaction_serializer);
+
+    return channel;
+}
+
+// unless the session was taken over again meanwhile
+void Server::end_replica_delivery(string user, host_address addr, shared_ptr<SessionChannel> channel)
+{
+    pthread_mutex_lock(&seqn_transaction_serializer);
+    auto session = active_sessions.find(make_session_key(addr));
+    uint32_t user_id;
+    if (session != active_sessions.end() && session->second.channel == channel && followers.get_id(user, &user_id))
+        delivery_index.unregister_session(user_id, session->first);
+    pthread_mutex_unlock(&seqn_transaction_serializer);
+}
+
+// The primary leaves the session to the replica the client picked
+void Server::hand_off_delivery(string user, host_address addr)
+{
+    pthread_mutex_lock(&seqn_transaction_serializer);
+    uint32_t user_id;
+    if (followers.get_id(user, &user_id))
+        delivery_index.unregister_session(user_id, make_session_key(addr));
+    pthread_mutex_unlock(&seqn_transaction_serializer);
+}
+
+// A session a gateway opens, or resumes after the shard elected this server. One the gateway
+// resumes but this server never saw opened, its login was lost with the former primary, is opened
+bool Server::open_gateway_session(Packet* request, gateway_session* session)
+{
+    if (!parseSessionAddress(request->getPayload(), &session->user, &session->address))
+        return false;
+    if (!is_home_shard(session->user))
+        return false;
+
+    if (request->getType() == GATEWAY_SESSION_RESUME && get_session_channel(session->address))
+        retrieve_notifications_from_offline_period(session->user, session->address);
+    else if (!open_session_and_retrieve_notifications(session->user, session->address))
+        return false;
+
+    session->channel = get_session_channel(session->address);
+    return session->channel != NULL;
+}
+
+// call this function after the session sender delivered notifications to the client. It only
+// raises the session watermark, the flusher thread later ships it to the backups in a batch.
+// A channel closed meanwhile had its watermark dropped by close_session, it is not brought back
+void Server::record_delivery(host_address addr, string user, uint32_t delivered_up_to, SessionChannel* channel) 
+{
+    session_key key = make_session_key(addr);
+
+    pthread_mutex_lock(&delivery_progress_mutex);
+    if (channel->is_closed())
+    {
+        pthread_mutex_unlock(&delivery_progress_mutex);
+        return;
+    }
+    if (session_watermarks[key] < delivered_up_to)
+        session_watermarks[key] = delivered_up_to;
+    if (user_watermarks[user] < delivered_up_to)
+        user_watermarks[user] = delivered_up_to;
+    unflushed_progress[key] = pair<string, uint32_t>(user, session_watermarks[key]);
+    pthread_mutex_unlock(&delivery_progress_mutex);
+}
+
+// sends every watermark raised since the last flush, without waiting for acks
+void Server::flush_delivery_progress()
+{
+    map< session_key, pair<string, uint32_t> > progress;
+
+    pthread_mutex_lock(&delivery_progress_mutex);
+    progress.swap(unflushed_progress);
+    pthread_mutex_unlock(&delivery_progress_mutex);
+
+    if (progress.empty())
+        return;
+
+    string payload;
+    for (auto &entry : progress)
+    {
+        string item = to_string(entry.first) + ":" + to_string(entry.second.second) + ":" + entry.second.first + ";";
+        if (payload.length() + item.length() > MAX_PAYLOAD_LENGTH)
+        {
+            send_delivery_progress(payload);
+            payload = "";
+        }
+        payload += item;
+    }
+    send_delivery_progress(payload);
+}
+
+// a replica delivering sessions reports to the primary, which passes it on to the group
+void Server::send_delivery_progress(string payload)
+{
+    if (backupMode)
+        sendPacketToPrimaryServer(Packet(DELIVERY_PROGRESS, payload.c_str()));
+    else
+        sendPacketToAllServersInTheGroup(Packet(DELIVERY_PROGRESS, payload.c_str()));
+}
+
+// watermarks only move forward, so repeated or reordered batches are harmless
+void Server::apply_delivery_progress(string progress)
+{
+    size_t start = 0, end;
+
+    pthread_mutex_lock(&delivery_progress_mutex);
+    while ((end = progress.find(';', start)) != string::npos)
+    {
+        string item = progress.substr(start, end - start);
+        start = end + 1;
+
+        size_t first = item.find(':');
+        size_t second = item.find(':', first + 1);
+        if (first == string::npos || second == string::npos)
+            continue;
+
+        session_key key = strtoull(item.substr(0, first).c_str(), NULL, 10);
+        uint32_t delivered_up_to = strtoul(item.substr(first + 1, second - first - 1).c_str(), NULL, 10);
+        string user = item.substr(second + 1);
+
+        if (session_watermarks[key] < delivered_up_to)
+        {
+            session_watermarks[key] = delivered_up_to;
+            if (!backupMode)    // reported by a replica delivering the session
+                unflushed_progress[key] = pair<string, uint32_t>(user, delivered_up_to);
+        }
+        if (user_watermarks[user] < delivered_up_to)
+            user_watermarks[user] = delivered_up_to;
+    }
+    pthread_mutex_unlock(&delivery_progress_mutex);
+}
+
+// primary use: brings a backup that just replayed the event history up to date on delivery progress
+void Server::send_delivery_progress_snapshot(int peerID)
+{
+    vector<string> payloads(1);
+
+    // active_sessions belongs to the transactions, sessions closing meanwhile drop their watermark
+    pthread_mutex_lock(&seqn_transaction_serializer);
+    pthread_mutex_lock(&delivery_progress_mutex);
+    for (auto &entry : session_watermarks)
+    {
+        auto session = active_sessions.find(entry.first);
+        if (session == active_sessions.end())
+            continue;
+
+        string item = to_string(entry.first) + ":" + to_string(entry.second) + ":" + session->second.user + ";";
+        if (payloads.back().length() + item.length() > MAX_PAYLOAD_LENGTH)
+            payloads.push_back("");
+        payloads.back() += item;
+    }
+    pthread_mutex_unlock(&delivery_progress_mutex);
     pthread_mutex_unlock(&seqn_transaction_serializer);
+
+    for (auto &payload : payloads)
+        if (!payload.empty())
+            sendPacketToServer(peerID, Packet(DELIVERY_PROGRESS, payload.c_str()));
 }
 
 // call this function when client presses ctrl+c or ctrl+d
@@ -608,16 +2113,22 @@ void Server::close_session(string user, host_address address)
     strcpy(close_session_event.arg2, address.ipv4.c_str());
     strcpy(close_session_event.arg3, to_string(address.port).c_str());
     close_session_event.committed = false; 
+    close_session_event.num_ops = 0;
 
-    deepcopy_active_users_pending_notifications(true);
+    deepcopy_active_sessions(true);
     deepcopy_sessions(true);
     deepcopy_user_sessions_semaphore(true);
 
+    shared_ptr<SessionChannel> closed_session_channel;
     list<host_address>::iterator it = find(COPY_sessions[user].begin(), COPY_sessions[user].end(), address);
     if(it != COPY_sessions[user].end()) // remove address from sessions map and < (ip, port), notification to send > 
     {
+        auto session = COPY_active_sessions.find(make_session_key(address));
+        if (session != COPY_active_sessions.end())
+            closed_session_channel = session->second.channel;
+
         COPY_sessions[user].erase(it);
-        COPY_active_users_pending_notifications.erase(address);
+        COPY_active_sessions.erase(make_session_key(address));
 
         // signal semaphore
         sem_post(&(COPY_user_sessions_semaphore[user]));
@@ -635,63 +2146,272 @@ void Server::close_session(string user, host_address address)
 
     if (committed)
     {
-        deepcopy_active_users_pending_notifications(false);
+        deepcopy_active_sessions(false);
         deepcopy_sessions(false);
         deepcopy_user_sessions_semaphore(false);
+
+        // let the session sender notice it was closed
+        uint32_t user_id;
+        if (followers.get_id(user, &user_id))
+            delivery_index.unregister_session(user_id, make_session_key(address));
+
+        // closed under the same lock, so a sender finishing a batch cannot raise the watermark again
+        pthread_mutex_lock(&delivery_progress_mutex);
+        if (closed_session_channel)
+            closed_session_channel->close();
+        session_watermarks.erase(make_session_key(address));
+        unflushed_progress.erase(make_session_key(address));
+        pthread_mutex_unlock(&delivery_progress_mutex);
     }
 
     close_session_event.committed = committed;
-    event_history.push_back(close_session_event);
+    record_event(close_session_event);
 
     print_events();
 
     pthread_mutex_unlock(&seqn_transaction_serializer);
 }
 
-bool Server::follow_user(string user, string user_to_follow)
+// following, if given, tells whether user follows user_to_follow once the event committed
+bool Server::follow_user(string user, string user_to_follow, bool* following)
 {
     pthread_mutex_lock(&seqn_transaction_serializer);
     uint16_t seqn = get_current_sequence();
 
-    event follow_event;
-    follow_event.seqn = seqn;
-    follow_event.command = FOLLOW;
-    strcpy(follow_event.arg1, user.c_str());
-    strcpy(follow_event.arg2, user_to_follow.c_str());
-    strcpy(follow_event.arg3, "");
-    follow_event.committed = false; 
+    event follow_event;
+    follow_event.seqn = seqn;
+    follow_event.command = FOLLOW;
+    strcpy(follow_event.arg1, user.c_str());
+    strcpy(follow_event.arg2, user_to_follow.c_str());
+    strcpy(follow_event.arg3, "");
+    follow_event.committed = false; 
+    follow_event.num_ops = 0;
+
+    deepcopy_followers(true);
+    deepcopy_read_cursors(user, true);
+
+    // a user of another shard is never created here, its home shard already checked it exists
+    bool followable = user_exists(user_to_follow) || !is_home_shard(user_to_follow);
+    if (followable)
+    {
+        if (COPY_followers.follow(user, user_to_follow))
+        {
+            // only what the followed user posts from now on is unread
+            auto timeline = author_timelines.find(user_to_follow);
+            COPY_read_cursors[user][user_to_follow] = (timeline == author_timelines.end()) ? 0 : timeline->second.size();
+        }
+    }
+
+    bool committed;
+    if (backupMode)
+    {
+        committed = wait_primary_commit(follow_event);
+    }
+    else
+    {
+        committed = send_backup_change(follow_event);
+    }
+
+    if (committed)
+    {
+        deepcopy_followers(false);
+        deepcopy_read_cursors(user, false);
+    }
+    if (following != NULL)
+        *following = committed && followable;
+
+    follow_event.committed = committed;
+    record_event(follow_event);
+
+    print_events();
+
+    pthread_mutex_unlock(&seqn_transaction_serializer);
+
+    return committed;
+}
+
+
+bool Server::is_home_shard(string user)
+{
+    return shardMap.size() <= 1 || shardMap.shard_of_user(user) == shard;
+}
+
+// The edge is kept on both shards: the followed user's one routes its posts to the follower's
+// shard, the follower's one fans them out to the follower's sessions once they arrive. The two
+// are not one transaction: if the local follow fails after the remote one, the other shard keeps
+// forwarding posts that find no follower here, until the user follows again
+bool Server::route_follow_user(string user, string user_to_follow)
+{
+    if (is_home_shard(user_to_follow))
+        return follow_user(user, user_to_follow);
+
+    int target_shard = shardMap.shard_of_user(user_to_follow);
+    string request = user + ":" + user_to_follow;
+    string reply;
+    if (!shardLinks[target_shard]->request(Packet(SHARD_FOLLOW, request.c_str()), &reply) || reply != "1")
+        return false;
+
+    return follow_user(user, user_to_follow);
+}
+
+// requests of the other shards' primaries, all of them about users homed here
+string Server::serve_shard_request(Packet* request)
+{
+    switch (request->getType())
+    {
+        case SHARD_FOLLOW: {
+            string payload = request->getPayload();
+            size_t delimiter = payload.find(":");
+            if (delimiter == string::npos)
+                return "0";
+            bool following = false;
+            follow_user(payload.substr(0, delimiter), payload.substr(delimiter + 1), &following);
+            return following ? "1" : "0";
+        }
+        case SHARD_NOTIFICATION: {
+            // fans out to the local followers of the remote author, never forwarded again. A retry
+            // of a post already applied is answered as applied
+            string origin(request->e.arg1, strnlen(request->e.arg1, sizeof(request->e.arg1)));
+            uint32_t post = strtoul(request->e.arg2, NULL, 10);
+            bool applied = create_notification(request->getAuthor(), request->getPayload(), request->getTimestamp(), origin, post);
+            return applied ? "1" : "0";
+        }
+        default:
+            return "0";
+    }
+}
+
 
-    deepcopy_followers(true);
+// Read-only commands, answered from the committed state by the primary or by any backup once it
+// applied min_seqn, the last seqn the client saw. false if the replica did not get there in time
+bool Server::answer_query(string query, uint16_t min_seqn, vector<string>* answer, uint16_t* applied_seqn)
+{
+    string command = query.substr(0, query.find(" "));
+    string user = (query.find(" ") == string::npos) ? "" : query.substr(query.find(" ") + 1);
 
-    if (find(COPY_followers[user_to_follow].begin(), COPY_followers[user_to_follow].end(), user) == COPY_followers[user_to_follow].end()
-        && user_exists(user_to_follow))
+    pthread_mutex_lock(&seqn_transaction_serializer);
+    if (!wait_applied(min_seqn))
     {
-        COPY_followers[user_to_follow].push_back(user);
+        pthread_mutex_unlock(&seqn_transaction_serializer);
+        return false;
     }
+    *applied_seqn = applied_watermark;
 
-    bool committed;
-    if (backupMode)
+    if (!is_home_shard(user))
+        answer->push_back(user + " is kept by another shard.");
+    else if (!user_exists(user))
+        answer->push_back("No user " + user + ".");
+    else if (command == "FOLLOWERS")
     {
-        committed = wait_primary_commit(follow_event);
+        vector<string> names;
+        uint32_t user_id;
+        if (followers.get_id(user, &user_id))
+            for (auto follower : followers.followers_of(user_id))
+                names.push_back(followers.name_of(follower));
+        sort(names.begin(), names.end());
+        *answer = query_user_list("Followers of " + user, names);
     }
+    else if (command == "FOLLOWING")
+        *answer = query_user_list(user + " follows", following_names(user));
+    else if (command == "STATS")
+        *answer = query_stats(user);
+    else if (command == "TIMELINE")
+        *answer = query_timeline(user);
     else
+        answer->push_back("Unknown query " + command + ".");
+
+    pthread_mutex_unlock(&seqn_transaction_serializer);
+    return true;
+}
+
+// Caller holds seqn_transaction_serializer, released while waiting. false if min_seqn was
+// not applied within QUERY_STALENESS_WAIT_MS
+bool Server::wait_applied(uint16_t min_seqn)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += QUERY_STALENESS_WAIT_MS / 1000;
+    deadline.tv_nsec += (QUERY_STALENESS_WAIT_MS % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
     {
-        committed = send_backup_change(follow_event);
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
     }
 
-    if (committed)
+    // 0 asks for no seqn in particular, any other is compared wrap-aware
+    while (min_seqn != 0 && (int16_t)(applied_watermark - min_seqn) < 0)
     {
-        deepcopy_followers(false);
+        if (pthread_cond_timedwait(&applied_watermark_advanced, &seqn_transaction_serializer, &deadline) == ETIMEDOUT)
+            return false;
     }
+    return true;
+}
 
-    follow_event.committed = committed;
-    event_history.push_back(follow_event);
+// packs the names in as few lines as fit a packet
+vector<string> Server::query_user_list(string title, const vector<string>& names)
+{
+    vector<string> lines;
+    string line = title + " (" + to_string(names.size()) + "):";
+    for (auto &name : names)
+    {
+        if (line.length() + name.length() + 1 >= MAX_PAYLOAD_LENGTH)
+        {
+            lines.push_back(line);
+            line = "";
+        }
+        line += " " + name;
+    }
+    lines.push_back(line);
+    return lines;
+}
 
-    print_events();
+vector<string> Server::query_stats(string user)
+{
+    size_t unread = 0;
+    auto unread_notifications = users_unread_notifications.find(user);
+    if (unread_notifications != users_unread_notifications.end())
+        unread = unread_notifications->second.size();
+
+    string stats = user + ": " + to_string(followers.followers_count(user)) + " followers, "
+        + to_string(following_names(user).size()) + " following, "
+        + to_string(sessions[user].size()) + " open sessions, "
+        + to_string(unread) + " unread notifications";
+    return vector<string>(1, stats);
+}
 
-    pthread_mutex_unlock(&seqn_transaction_serializer);
+// last posts of the users it follows, newest first: only the recent posts of each followed
+// author are looked at, not the whole history
+vector<string> Server::query_timeline(string user)
+{
+    vector<string> lines;
+    uint32_t user_id;
+    if (!followers.get_id(user, &user_id))
+        return lines;
+
+    // ordered by how far behind the applied watermark they are, so a wrapped seqn still sorts
+    vector< pair<uint16_t, const event*> > posts;
+    for (uint32_t author_id : followers.following_of(user_id))
+    {
+        auto author_posts = recent_posts.find(followers.name_of(author_id));
+        if (author_posts == recent_posts.end())
+            continue;
+        for (const event& post : author_posts->second)
+            posts.push_back(make_pair((uint16_t)(applied_watermark - post.seqn), &post));
+    }
+    sort(posts.begin(), posts.end(), [](const pair<uint16_t, const event*>& a, const pair<uint16_t, const event*>& b) {
+        return a.first < b.first;
+    });
 
-    return committed;
+    for (size_t i = 0; i < posts.size() && lines.size() < QUERY_TIMELINE_LENGTH; i++)
+    {
+        const event* post = posts[i].second;
+        string body(post->arg2, strnlen(post->arg2, sizeof(post->arg2)));
+        lines.push_back(string(post->arg1) + " at " + string(post->arg3, strnlen(post->arg3, sizeof(post->arg3))) + ": " + body);
+    }
+
+    if (lines.empty())
+        lines.push_back("Nothing posted by who " + user + " follows.");
+    return lines;
 }
 
 
@@ -784,91 +2504,87 @@ void Server::deepcopy_users_unread_notifications(bool save)
 }
 void Server::deepcopy_followers(bool save) // save or retrieve
 {
-    map<string, list<string>> from;
-    map<string, list<string>>* to;
-
+    // FollowerGraph only holds value types, plain assignment is already a deep copy
     if (save)
-    {
-        from = followers;
-        to = &COPY_followers;
-    }
+        COPY_followers = followers;
     else
-    {
-        from = COPY_followers;
-        to = &followers;
-    }
-
-    to->clear();
-
-    for(auto it = from.begin(); it != from.end(); it++)
-    {
-        list< string> notifications;
-        for(auto itl = (it->second).begin(); itl != (it->second).end(); itl++)
-        {
-            notifications.push_back(*itl);
-        }
-        to->insert({it->first, notifications});
-    }
+        followers = COPY_followers;
 }
 void Server::deepcopy_active_notifications(bool save)
 {
-    vector<notification> from;
-    vector<notification>* to;
+    // notifications are immutable once created, sharing them is enough
+    if (save)
+        COPY_active_notifications = active_notifications;
+    else
+        active_notifications = COPY_active_notifications;
+}
+void Server::deepcopy_active_sessions(bool save)
+{
+    if (save)
+        COPY_active_sessions = active_sessions;
+    else
+        active_sessions = COPY_active_sessions;
+}
 
+// a post only appends to its own author's timeline, the others are neither copied nor touched
+void Server::deepcopy_author_timeline(string author, bool save)
+{
     if (save)
     {
-        from = active_notifications;
-        to = &COPY_active_notifications;
+        COPY_author_timelines.clear();
+        auto timeline = author_timelines.find(author);
+        if (timeline != author_timelines.end())
+            COPY_author_timelines[author] = timeline->second;
     }
     else
     {
-        from = COPY_active_notifications;
-        to = &active_notifications;
-    }
-
-    to->clear();
-
-    for(auto it = from.begin(); it != from.end(); it++)
-    {
-        to->push_back(*it);
+        auto timeline = COPY_author_timelines.find(author);
+        if (timeline != COPY_author_timelines.end())
+            author_timelines[author] = timeline->second;
     }
 }
-void Server::deepcopy_active_users_pending_notifications(bool save)
-{
-    map< host_address, priority_queue< uint32_t, vector<uint32_t>, greater<uint32_t>>> from;
-    map< host_address, priority_queue< uint32_t, vector<uint32_t>, greater<uint32_t>>>* to;
 
+// only the last post of the origin a forwarded post is staged for
+void Server::deepcopy_forwarded_post(string origin, bool save)
+{
     if (save)
     {
-        from = active_users_pending_notifications;
-        to = &COPY_active_users_pending_notifications;
+        auto last = forwarded_posts.find(origin);
+        if (last != forwarded_posts.end())
+            COPY_forwarded_posts[origin] = last->second;
+        else
+            COPY_forwarded_posts.erase(origin);
     }
     else
     {
-        from = COPY_active_users_pending_notifications;
-        to = &active_users_pending_notifications;
+        auto last = COPY_forwarded_posts.find(origin);
+        if (last != COPY_forwarded_posts.end())
+        {
+            forwarded_posts[origin] = last->second;
+            COPY_forwarded_posts.erase(last);
+        }
     }
+}
 
-    to->clear();
-
-    for(auto it = from.begin(); it != from.end(); it++)
+// only the cursors of the user a follow or an offline read is staged for
+void Server::deepcopy_read_cursors(string user, bool save)
+{
+    if (save)
     {
-        vector<uint32_t> notifications;
-        priority_queue< uint32_t, vector<uint32_t>, greater<uint32_t>> temp_queue;
-        while(!((it->second).empty()))
-        {
-            uint32_t notif = (it->second).top();
-            notifications.push_back(notif);
-            temp_queue.push(notif);
-
-            (it->second).pop();
-        }
-        for (auto itv = notifications.begin(); itv != notifications.end(); itv++)
+        auto cursors = read_cursors.find(user);
+        if (cursors != read_cursors.end())
+            COPY_read_cursors[user] = cursors->second;
+        else
+            COPY_read_cursors.erase(user);
+    }
+    else
+    {
+        auto cursors = COPY_read_cursors.find(user);
+        if (cursors != COPY_read_cursors.end())
         {
-            (it->second).push(*itv);
+            read_cursors[user] = cursors->second;
+            COPY_read_cursors.erase(cursors);
         }
-        
-        to->insert({it->first, temp_queue});
     }
 }
 
@@ -890,10 +2606,10 @@ void Server::print_active_users_unread_notifications()
 {
     cout << "Active users notifications to receive: \n";
 
-    for(auto it = active_users_pending_notifications.begin(); it != active_users_pending_notifications.end(); it++)
+    for(auto it = active_sessions.begin(); it != active_sessions.end(); it++)
     {
-        cout << it->first.ipv4 << ":" << it->first.port << ": [";
-        cout << it->second.size() << "]\n";
+        cout << it->second.user << "@" << it->second.address.ipv4 << ":" << it->second.address.port << ": [";
+        cout << it->second.pending.size() << "]\n";
     }
 }
 void Server::print_sessions() 
@@ -916,9 +2632,9 @@ void Server::print_active_notifications()
 
     for(auto it = active_notifications.begin(); it != active_notifications.end(); it++)
     {
-        cout << it->id << "\n";
-        cout << it->author << "\n";
-        cout << it->body << "\n";
+        cout << (*it)->id << "\n";
+        cout << (*it)->author << "\n";
+        cout << (*it)->body << "\n";
         cout << "\n";
     }
 }
@@ -926,12 +2642,12 @@ void Server::print_followers()
 {
     cout << "\nFollowers: " << followers.size() << "\n";
 
-    for(auto it = followers.begin(); it != followers.end(); it++)
+    for(uint32_t id = 0; id < followers.size(); id++)
     {
-        cout << it->first << ": [";
-        for(auto itl = (it->second).begin(); itl != (it->second).end(); itl++)
+        cout << followers.name_of(id) << ": [";
+        for(auto follower : followers.followers_of(id))
         {
-            cout << *itl << ", ";
+            cout << followers.name_of(follower) << ", ";
         }
         cout << "]\n";
     }
@@ -969,10 +2685,10 @@ void Server::print_COPY_active_users_unread_notifications()
 {
     cout << "COPY_Active users notifications to receive: \n";
 
-    for(auto it = COPY_active_users_pending_notifications.begin(); it != COPY_active_users_pending_notifications.end(); it++)
+    for(auto it = COPY_active_sessions.begin(); it != COPY_active_sessions.end(); it++)
     {
-        cout << it->first.ipv4 << ":" << it->first.port << ": [";
-        cout << it->second.size() << "]\n";
+        cout << it->second.user << "@" << it->second.address.ipv4 << ":" << it->second.address.port << ": [";
+        cout << it->second.pending.size() << "]\n";
     }
 }
 void Server::print_COPY_sessions() 
@@ -995,9 +2711,9 @@ void Server::print_COPY_active_notifications()
 
     for(auto it = COPY_active_notifications.begin(); it != COPY_active_notifications.end(); it++)
     {
-        cout << it->id << "\n";
-        cout << it->author << "\n";
-        cout << it->body << "\n";
+        cout << (*it)->id << "\n";
+        cout << (*it)->author << "\n";
+        cout << (*it)->body << "\n";
         cout << "\n";
     }
 }
@@ -1005,48 +2721,117 @@ void Server::print_COPY_followers()
 {
     cout << "\nCOPY_Followers: " << COPY_followers.size() << "\n";
 
-    for(auto it = COPY_followers.begin(); it != COPY_followers.end(); it++)
+    for(uint32_t id = 0; id < COPY_followers.size(); id++)
     {
-        cout << it->first << ": [";
-        for(auto itl = (it->second).begin(); itl != (it->second).end(); itl++)
+        cout << COPY_followers.name_of(id) << ": [";
+        for(auto follower : COPY_followers.followers_of(id))
         {
-            cout << *itl << ", ";
+            cout << COPY_followers.name_of(follower) << ", ";
         }
         cout << "]\n";
     }
 }
 
 
+// Encodes the packet once and queues it for every peer, like sendPacketToServers: the
+// transaction that broadcasts never waits for a peer with a full queue
 void Server::sendPacketToAllServersInTheGroup(Packet p){
 
+    vector<int> peerIDs;
+
     pthread_mutex_lock(&connectedServersMutex);
-    for (auto &peer : this->connectedServers){
-        peer.second->sendPacket(p);
-    }
+    for (auto &peer : this->peerSenders)
+        peerIDs.push_back(peer.first);
     pthread_mutex_unlock(&connectedServersMutex);
+
+    sendPacketToServers(peerIDs, p);
 }
 
-void Server::sendPacketToPrimaryServer(Packet p){
+// Never waits: a backup with a full queue leaves the synchronous set and gets the packet
+// from the catch-up stream, ahead of any log range
+void Server::sendPacketToServers(const vector<int>& peerIDs, Packet p){
+
+    shared_ptr<const Packet> packet = make_shared<const Packet>(p);
 
     pthread_mutex_lock(&connectedServersMutex);
-    for (auto &peer : this->connectedServers){
-        if (peer.first == this->primarySeverID){
-            peer.second->sendPacket(p);
-            break;
+    for (auto peerID : peerIDs){
+        auto it = this->peerSenders.find(peerID);
+        if (it == this->peerSenders.end())
+            continue;
+
+        backup_progress& progress = this->backups_progress[peerID];
+        if (!progress.deferred.empty() || !it->second->try_send(packet)){
+            progress.lagging = true;
+            progress.deferred.push_back(packet);
         }
     }
     pthread_mutex_unlock(&connectedServersMutex);
 }
 
+void Server::sendPacketToPrimaryServer(Packet p){
+    this->sendPacketToServer(this->primarySeverID, p);
+}
 
-void Server::sendElectionPacketForGreaterIds(){
-    for (auto &peer : this->connectedServers){
-        if (peer.first > this->id) {
-            cout << "Sending ELECTION packet to server with ID " << peer.first << "\n";
-            peer.second->sendPacket(Packet(ELECTION, ""));
-        }
-            
+void Server::sendPacketToServer(int peerID, Packet p){
+
+    shared_ptr<PeerSender> sender;
+
+    pthread_mutex_lock(&connectedServersMutex);
+    auto it = this->peerSenders.find(peerID);
+    if (it != this->peerSenders.end())
+        sender = it->second;
+    pthread_mutex_unlock(&connectedServersMutex);
+
+    if (sender)
+        sender->send(make_shared<const Packet>(p));
+}
+
+
+// a frame from this peer failed its checksum, it sends everything again from that frame on
+void Server::request_retransmit(int peerID, uint32_t frame){
+    cout << "Asking server " << peerID << " to send again from frame " << frame << ".\n";
+    sendPacketToServer(peerID, Packet(RETRANSMIT, to_string(frame).c_str()));
+}
+
+void Server::retransmit_to_peer(int peerID, uint32_t frame){
+    shared_ptr<PeerSender> sender;
+
+    pthread_mutex_lock(&connectedServersMutex);
+    auto it = this->peerSenders.find(peerID);
+    if (it != this->peerSenders.end())
+        sender = it->second;
+    pthread_mutex_unlock(&connectedServersMutex);
+
+    if (sender)
+        sender->retransmit(frame);
+}
+
+
+// every peer may outrank us, the ELECTION carries how far our log goes
+void Server::sendElectionPacketToPeers(){
+    shared_ptr<const Packet> election = make_shared<const Packet>(Packet(ELECTION, to_string(this->election_seqn).c_str()));
+
+    pthread_mutex_lock(&connectedServersMutex);
+    for (auto &peer : this->peerSenders){
+        cout << "Sending ELECTION packet to server with ID " << peer.first << "\n";
+        peerRtt.start_probe(peer.first);
+        peer.second->try_send(election);
     }
+    pthread_mutex_unlock(&connectedServersMutex);
+}
+
+
+void Server::setElectionStarted(bool started){
+    this->electionStarted = started;
+    pthread_cond_broadcast(&electionStateChanged);
+}
+
+// connections that need the primary wait here while the group elects one
+void Server::waitElectionFinished(){
+    pthread_mutex_lock(&electionMutex);
+    while (this->electionStarted)
+        pthread_cond_wait(&electionStateChanged, &electionMutex);
+    pthread_mutex_unlock(&electionMutex);
 }
 
 
@@ -1059,19 +2844,21 @@ void *Server::electionTimeoutHandler(void *handlerArgs){
 
     while(true){
 
+        // sleeps until an election starts instead of polling for one
         pthread_mutex_lock(&server->electionMutex);
-        if(server->electionStarted){
-            pthread_mutex_unlock(&server->electionMutex);
-            sleep(ELECTION_TIMEOUT);
-            if(!server->gotAnsweredInElection){
-                cout << "Didn't receive any ANSWER packets before timeout. Autoelecting as primary server...\n\n";
-                pthread_mutex_lock(&server->electionMutex);
-                server->setAsPrimaryServer();
-                server->electionStarted = false;
-                server->gotAnsweredInElection = false;
-                server->sendPacketToAllServersInTheGroup(Packet(COORDINATOR, myAddressString.c_str()));
-                pthread_mutex_unlock(&server->electionMutex);
-            }
+        while (!server->electionStarted)
+            pthread_cond_wait(&server->electionStateChanged, &server->electionMutex);
+        pthread_mutex_unlock(&server->electionMutex);
+
+        RttEstimator::sleep_micros(server->election_timeout_micros());
+
+        pthread_mutex_lock(&server->electionMutex);
+        if(server->electionStarted && !server->gotAnsweredInElection){
+            cout << "Didn't receive any ANSWER packets before timeout. Autoelecting as primary server...\n\n";
+            server->setAsPrimaryServer();
+            server->setElectionStarted(false);
+            server->gotAnsweredInElection = false;
+            server->sendPacketToAllServersInTheGroup(Packet(COORDINATOR, myAddressString.c_str()));
         }
         pthread_mutex_unlock(&server->electionMutex);
     }
@@ -1098,13 +2885,13 @@ void *Server::groupReadMessagesHandler(void *handlerArgs)
             server->removePeerFromConnectedServers(peerID);
 
             if (peerID == server->primarySeverID){
-                server->serverConfirmation = 0;
+                server->abort_primary_confirmations();
                 cout << "\nLost connection with primary server, initializing election... \n";
                 pthread_mutex_lock(&server->electionMutex);
-                server->electionStarted = true;
+                server->setElectionStarted(true);
                 server->gotAnsweredInElection = false;
                 pthread_mutex_unlock(&server->electionMutex);
-                server->sendElectionPacketForGreaterIds();
+                server->sendElectionPacketToPeers();
     
             }
             return NULL;
@@ -1112,17 +2899,26 @@ void *Server::groupReadMessagesHandler(void *handlerArgs)
 
         switch(receivedPacket->getType()){
 
+            case CORRUPT_FRAME:
+                server->request_retransmit(peerID, receivedPacket->getFrame());
+                break;
+
+            case RETRANSMIT:
+                server->retransmit_to_peer(peerID, strtoul(receivedPacket->getPayload(), NULL, 10));
+                break;
+
             case ASK_PRIMARY:
                 primaryServerAddress = server->primarySeverIP + ":" + to_string(server->primarySeverPort);
-                connectedSocket->sendPacket(Packet(PRIMARY_SERVER_ADDRESS, primaryServerAddress.c_str()));
+                server->sendPacketToServer(peerID, Packet(PRIMARY_SERVER_ADDRESS, primaryServerAddress.c_str()));
                 break;
             
             case INITIALIZE_STATE:
                 cout << "INITIALIZE_STATE received...\n";
-                server->send_commited_events_to_new_backup(connectedSocket, atoi(receivedPacket->getPayload()));
+                server->send_commited_events_to_new_backup(peerID, atoi(receivedPacket->getPayload()));
                 break;
             
             case PRIMARY_SERVER_ADDRESS:
+                server->peerRtt.finish_probe(peerID);
                 ipPort = server->getIpPortFromAddressString(receivedPacket->getPayload());
                 server->updatePrimaryServerInfo(ipPort.first, ipPort.second);
                 if(peerID == server->primarySeverID) {
@@ -1131,13 +2927,19 @@ void *Server::groupReadMessagesHandler(void *handlerArgs)
                 break;
             
             case ELECTION:
-                server->serverConfirmation = 0;
+                server->abort_primary_confirmations();
                 cout << "Received ELECTION packet...\n";
-                connectedSocket->sendPacket(Packet(ANSWER, ""));
+                if (server->outranks(atoi(receivedPacket->getPayload()), peerID))
+                    server->sendPacketToServer(peerID, Packet(ANSWER, ""));
+                if (!server->backupMode){   // only that peer lost us, there is nothing to elect
+                    primaryServerAddress = server->ip + ":" + to_string(server->port);
+                    server->sendPacketToServer(peerID, Packet(COORDINATOR, primaryServerAddress.c_str()));
+                }
                 break;
 
             case ANSWER:
                 cout << "Received ANSWER packet... \n";
+                server->peerRtt.finish_probe(peerID);
                 pthread_mutex_lock(&server->electionMutex);
                 server->gotAnsweredInElection = true;
                 pthread_mutex_unlock(&server->electionMutex);
@@ -1149,7 +2951,7 @@ void *Server::groupReadMessagesHandler(void *handlerArgs)
                 ipPort = server->getIpPortFromAddressString(receivedPacket->getPayload());
                 server->updatePrimaryServerInfo(ipPort.first, ipPort.second);
                 pthread_mutex_lock(&server->electionMutex);
-                server->electionStarted = false;
+                server->setElectionStarted(false);
                 pthread_mutex_unlock(&server->electionMutex);
                 break;
 
@@ -1170,160 +2972,70 @@ void *Server::groupReadMessagesHandler(void *handlerArgs)
                     cout << "WARNING! Backup server oked unexisting event! Ignoring...\n";
                 } else {
                     it->second.insert({peerID, true});
+                    auto sentAt = server->eventsSentAt.find(receivedPacket->e.seqn);
+                    if (sentAt != server->eventsSentAt.end())
+                        server->peerRtt.record(peerID, RttEstimator::elapsed_micros(sentAt->second));
                 }
                 pthread_mutex_unlock(&server->confirmedEventsMutex);
+                server->record_backup_progress(peerID, receivedPacket->e.seqn);
                 break;
             }
 
+            case APPLIED_PROGRESS:
+                server->record_backup_progress(peerID, atoi(receivedPacket->getPayload()));
+                break;
+
             // All backups confirmed the event modification in server state
             case SOK:
                 cout << "Received SOK from primary!\n";
-                server->serverConfirmation = 1;
+                if (REPLICATION_TOPOLOGY == CHAIN_TOPOLOGY && receivedPacket->getLength() > 0){
+                    int successor = server->chain_successor(receivedPacket->getPayload());
+                    if (successor)
+                        server->sendPacketToServer(successor, *receivedPacket);
+                }
+                server->set_primary_confirmation(receivedPacket->e.seqn, 1);
                 break;
 
             // At least one backup didn't oked the event modification, need to revert it
             case SNOK:
                 cout << "Received SNOK from primary :( damn!\n";
-                server->serverConfirmation = 0;
-                break;
-
-            case OPEN_SESSION: {
-                cout << "Event "<<receivedPacket->e.seqn<<".\n"; 
-                if (server->has_processed_event(receivedPacket->e)) break;
-                cout << "Replicating open session.\n";                
-                server->autocommit = receivedPacket->e.committed;
-                
-                addrServ.ipv4 = receivedPacket->e.arg2;
-                addrServ.port = atoi(receivedPacket->e.arg3);
-                
-                thread command_thread ([&]()
-                { 
-                    server->try_to_start_session(receivedPacket->e.arg1, addrServ);
-                    cout << "FINISHED Replicating open session.\n";
-                });
-                command_thread.detach();
-                                
-                break;
-            }
-
-            case CLOSE_SESSION: {
-                cout << "Event "<<receivedPacket->e.seqn<<".\n"; 
-                if (server->has_processed_event(receivedPacket->e)) break;
-                cout << "Replicating close session.\n";
-                server->autocommit = receivedPacket->e.committed;
-
-                addrServ.ipv4 = receivedPacket->e.arg2;
-                addrServ.port = atoi(receivedPacket->e.arg3);
-
-                thread command_thread ([&]()
-                { 
-                    server->close_session(receivedPacket->e.arg1, addrServ);
-                    cout << "FINISHED Replicating close session.\n";
-                });
-                command_thread.detach();
-
-                break;
-            }
-
-            case FOLLOW: {
-                cout << "Event "<<receivedPacket->e.seqn<<".\n"; 
-                if (server->has_processed_event(receivedPacket->e)) break;
-                cout << "Replicating FOLLOW command.\n";
-                server->autocommit = receivedPacket->e.committed;
-                
-                thread command_thread ([&]()
-                { 
-                    server->follow_user(receivedPacket->e.arg1, receivedPacket->e.arg2);
-                    cout << "FINISHED Replicating FOLLOW command.\n";
-                });
-                command_thread.detach();
-
+                server->set_primary_confirmation(receivedPacket->e.seqn, 0);
                 break;
-            }
 
-            case CREATE_NOTIFICATION: {
-                cout << "Event "<<receivedPacket->e.seqn<<".\n"; 
-                if (server->has_processed_event(receivedPacket->e)) break;
-                cout << "Replicating SEND command.\n";
-                server->autocommit = receivedPacket->e.committed;
-
-                thread command_thread ([&]()
-                { 
-                    server->create_notification(receivedPacket->e.arg1, 
-                                receivedPacket->e.arg2, atoi(receivedPacket->e.arg3));
-                    cout << "FINISHED Replicating SEND command.\n";
-                });
-                command_thread.detach();
-                
-                break;
-            }
-            
-            case READ_NOTIFICATIONS:{
-                cout << "Event "<<receivedPacket->e.seqn<<".\n"; 
-                if (server->has_processed_event(receivedPacket->e)) break;
-                cout << "Replicating notification read.\n";
-                server->autocommit = receivedPacket->e.committed;
-
-                addrServ.ipv4 = receivedPacket->e.arg1;
-                addrServ.port = atoi(receivedPacket->e.arg2);
-                vector<notification> n;
-
-                thread command_thread ([&]()
-                { 
-                    server->read_notifications(addrServ, &n);
-                    cout << "FINISHED Replicating notification read.\n";
-                });
-                command_thread.detach();
-                
-                break;
-            }
-            
-            case READ_OFFLINE: {
-                cout << "Event "<<receivedPacket->e.seqn<<".\n"; 
-                if (server->has_processed_event(receivedPacket->e)) break;
-                cout << "Replicating read offline notifications.\n";
-                server->autocommit = receivedPacket->e.committed;
-
-                addrServ.ipv4 = receivedPacket->e.arg2;
-                addrServ.port = atoi(receivedPacket->e.arg3);
-
-                thread command_thread ([&]()
-                { 
-                    server->retrieve_notifications_from_offline_period(receivedPacket->e.arg1, addrServ);
-                    cout << "FINISHED Replicating read offline notifications.\n";
-                });
-                command_thread.detach();
-                
-                break;
-            }
+            case OPEN_SESSION:
+            case CLOSE_SESSION:
+            case FOLLOW:
+            case CREATE_NOTIFICATION:
+            case READ_OFFLINE:
+            case MULTI_OP:
+            case CATCH_UP_EVENT:        // log range replayed to this backup while it is out of the synchronous set
+            case DELIVERY_PROGRESS:
+            case STATE_DIGEST:
+            case BUCKET_DIGEST:
+            case STATE_REPAIR:
+                // Bulk traffic is handled on its own thread, this loop stays free for
+                // elections and acks even when the applier is behind
+                server->inbound_bulk->push(receivedPacket);
+                continue;
 
             default:
                 break;
         }
+
+        delete receivedPacket;
     }    
 
 }
 
 
-void Server::sendMessagesForConnectionEstablishment(Socket* connectedSocket, int peerID){
-
-    int connectionStatus = connectedSocket->sendPacket(Packet(SERVER_PEER_CONNECTING, std::to_string(this->id).c_str()));
-    if (connectionStatus < 0){
-        this->removePeerFromConnectedServers(peerID);
-        return;
-    }
-        
-    if (this->backupMode){    // Asks peer who's the primary server
-        int primaryServerPort;
+void Server::sendMessagesForConnectionEstablishment(shared_ptr<PeerSender> sender, int peerID){
 
-        Packet askForPrimary = Packet(ASK_PRIMARY, "");
-        connectionStatus = connectedSocket->sendPacket(askForPrimary);
+    sender->send(make_shared<const Packet>(Packet(SERVER_PEER_CONNECTING, std::to_string(this->id).c_str())));
 
-        if (connectionStatus < 0){
-            this->removePeerFromConnectedServers(peerID);
-            return;
-        }
-    }       
+    if (this->backupMode){    // Asks peer who's the primary server
+        this->peerRtt.start_probe(peerID);
+        sender->send(make_shared<const Packet>(Packet(ASK_PRIMARY, "")));
+    }
 }
 
 void Server::ask_event_history_to_primary(Socket* connectedSocket)
@@ -1334,12 +3046,23 @@ void Server::ask_event_history_to_primary(Socket* connectedSocket)
 
     while (!all_events_received)
     {
-        connectedSocket->sendPacket(Packet(INITIALIZE_STATE, to_string(expected_seqn).c_str()));
+        peerRtt.start_probe(primarySeverID);
+        sendPacketToServer(primarySeverID, Packet(INITIALIZE_STATE, to_string(expected_seqn).c_str()));
         Packet* received_packet = connectedSocket->readPacket();
+        while (received_packet != NULL && received_packet->getType() == CORRUPT_FRAME)
+        {
+            // the answer is on its way again, no new request
+            request_retransmit(primarySeverID, received_packet->getFrame());
+            delete received_packet;
+            received_packet = connectedSocket->readPacket();
+        }
+        peerRtt.finish_probe(primarySeverID);
 
         if(received_packet->getLength() == 0)      // Current server instance has current server primary state
         {
             all_events_received = true;
+            delete received_packet;
+            wait_replicated_events_applied();
 
             if (this->id > this->primarySeverID){
                 cout << "My ID is the highest, bullying the leader out...\n";
@@ -1354,79 +3077,16 @@ void Server::ask_event_history_to_primary(Socket* connectedSocket)
         {
             switch(received_packet->getType())
             {
-                case OPEN_SESSION: {
-                    cout << "Event "<<received_packet->e.seqn<<".\n"; 
-                    if (has_processed_event(received_packet->e)) break;              
-                    autocommit = received_packet->e.committed;
-                    
-                    host_address addrServ;
-                    addrServ.ipv4 = received_packet->e.arg2;
-                    addrServ.port = atoi(received_packet->e.arg3);
-                    
-                    try_to_start_session(received_packet->e.arg1, addrServ);
-                    cout << "FINISHED Replicating open session.\n";
-                                    
-                    break;
-                }
-                case CLOSE_SESSION: {
-                    cout << "Event "<<received_packet->e.seqn<<".\n"; 
-                    if (has_processed_event(received_packet->e)) break;
-                    autocommit = received_packet->e.committed;
-
-                    host_address addrServ;
-                    addrServ.ipv4 = received_packet->e.arg2;
-                    addrServ.port = atoi(received_packet->e.arg3);
-
-                    close_session(received_packet->e.arg1, addrServ);
-                    
-                    break;
-                }
-                case FOLLOW: {
-                    cout << "Event "<<received_packet->e.seqn<<".\n"; 
-                    if (has_processed_event(received_packet->e)) break;
-                    autocommit = received_packet->e.committed;
-                    
-                    follow_user(received_packet->e.arg1, received_packet->e.arg2);
-                    
-                    break;
-                }
-                case CREATE_NOTIFICATION: {
-                    cout << "Event "<<received_packet->e.seqn<<".\n"; 
-                    if (has_processed_event(received_packet->e)) break;
-                    autocommit = received_packet->e.committed;
-
-                    create_notification(received_packet->e.arg1, 
-                                    received_packet->e.arg2, atoi(received_packet->e.arg3));
-                    
-                    break;
-                }
-                case READ_NOTIFICATIONS:{
-                    cout << "Event "<<received_packet->e.seqn<<".\n"; 
-                    if (has_processed_event(received_packet->e)) break;
-                    autocommit = received_packet->e.committed;
-
-                    host_address addrServ;
-                    addrServ.ipv4 = received_packet->e.arg1;
-                    addrServ.port = atoi(received_packet->e.arg2);
-                    vector<notification> n;
-
-                    read_notifications(addrServ, &n);
-                    
-                    break;
-                }
-                case READ_OFFLINE: {
+                case OPEN_SESSION:
+                case CLOSE_SESSION:
+                case FOLLOW:
+                case CREATE_NOTIFICATION:
+                case READ_OFFLINE:
+                case MULTI_OP:
                     cout << "Event "<<received_packet->e.seqn<<".\n"; 
-                    if (has_processed_event(received_packet->e)) break;
-                    autocommit = received_packet->e.committed;
-
-                    host_address addrServ;
-                    addrServ.ipv4 = received_packet->e.arg2;
-                    addrServ.port = atoi(received_packet->e.arg3);
-
-                    retrieve_notifications_from_offline_period(received_packet->e.arg1, addrServ);
-                    
+                    // Aborted events only keep the history aligned with the primary's seqn
+                    enqueue_replicated_event(received_packet->e, !received_packet->e.committed, "", false);
                     break;
-                }
 
                 case PRIMARY_SERVER_ADDRESS: {
                     pair<string, int> ipPort = getIpPortFromAddressString(received_packet->getPayload());
@@ -1438,6 +3098,7 @@ void Server::ask_event_history_to_primary(Socket* connectedSocket)
                     break;
             }// switch 
         }// else
+        delete received_packet;
         expected_seqn++;
     } // while
 }
@@ -1449,60 +3110,168 @@ ServerSocket::ServerSocket() : Socket(){
 }
 
 
-void ServerSocket::connectNewClientOrServer(pthread_t *threadID, Server* server){
+// Only accepts: the handshake and session admission run on the admission workers, so a login
+// waiting on backups or an election does not keep anyone else from connecting
+void ServerSocket::acceptConnection(Server* server){
 
-    int *newsockfd = (int *) calloc(1, sizeof(int));
-    Socket *newConnectionSocket = (Socket *) calloc(1, sizeof(Socket));
+    pending_connection connection;
 	socklen_t clilen;
-	struct sockaddr_in cli_addr;
-    host_address client_address;
-    string user;
-    
+    int newsockfd;
 
-    // Accepting connection to start communicating
     clilen = sizeof(struct sockaddr_in);
-    if ((*newsockfd = accept(this->getSocketfd(), (struct sockaddr *) &cli_addr, &clilen)) == -1) {
+    if ((newsockfd = accept(this->getSocketfd(), (struct sockaddr *) &connection.cli_addr, &clilen)) == -1) {
         std::cout << "ERROR on accepting client or server connection" << std::endl;
         return;
     }
-    newConnectionSocket = new Socket(*newsockfd);
+    connection.connectedSocket = new Socket(newsockfd);
+
+    std::cout << "New connection established on socket: " << newsockfd << "\n\n";
+
+    // every worker is behind: the client retries rather than the accept loop waiting
+    if (!server->pendingConnections->try_push(connection)){
+        std::cout << "Admission queue full, closing socket " << newsockfd << "\n\n";
+        delete connection.connectedSocket;
+    }
+}
+
+
+void *Server::admissionHandler(void *handlerArgs)
+{
+    Server* server = (Server*) handlerArgs;
 
-    std::cout << "New connection established on socket: " << *newsockfd << "\n\n";
+    while (true)
+        ServerSocket::admitConnection(server->pendingConnections->pop(), server);
 
+    return NULL;
+}
+
+
+void ServerSocket::admitConnection(pending_connection connection, Server* server){
 
+    Socket *newConnectionSocket = connection.connectedSocket;
+	struct sockaddr_in cli_addr = connection.cli_addr;
+    host_address client_address;
+    string user;
+    bool offlineRetrieved = false;
+    pthread_t threadID;
+
+    // a peer that connects and stays silent only holds up its own admission; the handlers the
+    // connection is passed to read without a timeout
+    newConnectionSocket->setReadTimeout(ADMISSION_HANDSHAKE_TIMEOUT_MS);
 
     Packet* connectionType = newConnectionSocket->readPacket();
+    if (connectionType == NULL){
+        delete newConnectionSocket;
+        return;
+    }
+    // copied out, the packet is freed on every path
+    uint16_t type = connectionType->getType();
+    string typePayload = connectionType->getPayload();
+    uint16_t typeSeqn = connectionType->getSeqn();
+    delete connectionType;
         
-    if (connectionType->getType() == SERVER_PEER_CONNECTING){
+    if (type == SERVER_PEER_CONNECTING){
+
+        group_communiction_handler_args *args = (group_communiction_handler_args *) calloc(1, sizeof(group_communiction_handler_args));
+        args->peerID = atoi(typePayload.c_str());
+        args->connectedSocket = newConnectionSocket;
+        args->server = server;
+        newConnectionSocket->setReadTimeout(0);
+        server->addPeerToConnectedServers(args->peerID, newConnectionSocket, false);
+
+        pthread_create(&threadID, NULL, Server::groupReadMessagesHandler, (void *)args);
+        pthread_detach(threadID);
+        return;
+    }
 
+
+    // Read-only queries are served by any replica, primary or backup, without waiting for elections
+    if (type == QUERY_CONNECTING){
         group_communiction_handler_args *args = (group_communiction_handler_args *) calloc(1, sizeof(group_communiction_handler_args));
-        args->peerID = atoi(connectionType->getPayload());
         args->connectedSocket = newConnectionSocket;
         args->server = server;
-        server->addPeerToConnectedServers(args->peerID, newConnectionSocket);
 
-        pthread_create(threadID, NULL, Server::groupReadMessagesHandler, (void *)args);
+        newConnectionSocket->setReadTimeout(0);
+        pthread_create(&threadID, NULL, Server::queryRequestsHandler, (void *)args);
+        pthread_detach(threadID);
         return;
     }
 
+    // So is the delivery of a session the client moved off the primary
+    if (type == DELIVERY_CONNECTING){
+        if (!Server::parseSessionAddress(typePayload, &user, &client_address)){
+            delete newConnectionSocket;
+            return;
+        }
+
+        communiction_handler_args *args = (communiction_handler_args *) calloc(1, sizeof(communiction_handler_args));
+        args->connectedSocket = newConnectionSocket;
+        args->server = server;
+        args->user = user;
+        args->client_address = client_address;
+        args->replica_delivery = true;
+        args->login_seqn = typeSeqn;
+
+        newConnectionSocket->setReadTimeout(0);
+        pthread_create(&threadID, NULL, Server::replicaDeliveryHandler, (void *)args);
+        pthread_detach(threadID);
+        return;
+    }
 
     // ELSE (a client is connecting):
     // waits election finishes
-    pthread_mutex_lock(&server->electionMutex);
-    while (server->electionStarted){
-        pthread_mutex_unlock(&server->electionMutex);
-        pthread_mutex_lock(&server->electionMutex);
+    server->waitElectionFinished();
+
+    // Clients get the partition map: from a backup, so they go straight to the primary, and
+    // from the primary only when the version they cached is outdated
+    if (type == CLIENT_CONNECTING){
+        PartitionMap current = server->partitionMap();
+        if (server->backupMode){
+            newConnectionSocket->sendPacket(Packet(STALE_PARTITION_MAP, current.serialize().c_str()));
+            return;
+        }
+        if (current.version_string() == typePayload)
+            newConnectionSocket->sendPacket(Packet(ALREADY_PRIMARY, ""));
+        else
+            newConnectionSocket->sendPacket(Packet(ALREADY_PRIMARY, current.serialize().c_str()));
+    }
+
+    // Sends primary server information to the other shards' primaries
+    else if (server->backupMode){
+        newConnectionSocket->sendPacket(Packet(MESSAGE_PKT, server->primarySeverIP.c_str()));
+        newConnectionSocket->sendPacket(Packet(MESSAGE_PKT, std::to_string(server->primarySeverPort).c_str()));
+        return;
+    }
+    else {
+        newConnectionSocket->sendPacket(Packet(ALREADY_PRIMARY, ""));
     }
-    pthread_mutex_unlock(&server->electionMutex);
 
-    // Sends primary server information
-    if (server->backupMode){
-        newConnectionSocket->sendPacket(Packet(MESSAGE_PKT, server->primarySeverIP.c_str()));
-        newConnectionSocket->sendPacket(Packet(MESSAGE_PKT, std::to_string(server->primarySeverPort).c_str()));
+    if (type == SHARD_CONNECTING){
+        group_communiction_handler_args *args = (group_communiction_handler_args *) calloc(1, sizeof(group_communiction_handler_args));
+        args->peerID = atoi(typePayload.c_str());
+        args->connectedSocket = newConnectionSocket;
+        args->server = server;
+
+        newConnectionSocket->setReadTimeout(0);
+        pthread_create(&threadID, NULL, Server::shardRequestsHandler, (void *)args);
+        pthread_detach(threadID);
         return;
     }
-    else {
-        newConnectionSocket->sendPacket(Packet(ALREADY_PRIMARY, ""));
+
+    // A gateway carries many sessions on one connection, in place of a connection per client
+    if (type == GATEWAY_CONNECTING){
+        gateway_link *link = new gateway_link();
+        link->connectedSocket = newConnectionSocket;
+        link->server = server;
+        link->closed = false;
+        pthread_mutex_init(&link->send_mutex, NULL);
+        pthread_mutex_init(&link->sessions_mutex, NULL);
+        sem_init(&link->wakeup, 0, 0);
+
+        newConnectionSocket->setReadTimeout(0);
+        pthread_create(&threadID, NULL, Server::gatewayLinkHandler, (void *)link);
+        pthread_detach(threadID);
+        return;
     }
 
     
@@ -1510,18 +3279,35 @@ void ServerSocket::connectNewClientOrServer(pthread_t *threadID, Server* server)
     // read client username from socket in 'user' var
     Packet *userPacket = newConnectionSocket->readPacket();
 
+    bool replicaDelivery = false;
+    uint16_t userInfoType = 0;
     if (userPacket == NULL){
         std::cout << "Unable to read user information. Closing connection.\n";
         return;     // destructor automatically closes the socket
-    } else 
+    } else {
         user = userPacket->getPayload();
+        userInfoType = userPacket->getType();
+        delete userPacket;
+        size_t flag = user.find(" replica");
+        if (flag != string::npos){
+            replicaDelivery = true;
+            user = user.substr(0, flag);
+        }
+    }
     
 
-    if (userPacket->getType() == USER_INFO_PKT){
+    if (!server->is_home_shard(user)){
+        std::cout << "User " << user << " belongs to another shard. Closing connection.\n";
+        newConnectionSocket->sendPacket(Packet(SESSION_OPEN_FAILED, "Unable to connect to server: user belongs to another shard."));
+        return;
+    }
+
+    if (userInfoType == USER_INFO_PKT){
         client_address.ipv4 = inet_ntoa(cli_addr.sin_addr);
         client_address.port = ntohs(cli_addr.sin_port);
 
-        bool sessionAvailable = server->try_to_start_session(user, client_address);
+        bool sessionAvailable = server->open_session_and_retrieve_notifications(user, client_address);
+        offlineRetrieved = true;
 
         Packet sessionResultPkt;
         if (!sessionAvailable){
@@ -1530,14 +3316,23 @@ void ServerSocket::connectNewClientOrServer(pthread_t *threadID, Server* server)
             return; // destructor automatically closes the socket
         } else{
             sessionResultPkt = Packet(SESSION_OPEN_SUCCEDED, "Connection succeded! Session established.");
+            sessionResultPkt.setSeqn(server->last_event_seqn());
+            if (replicaDelivery)
+                server->hand_off_delivery(user, client_address);
             newConnectionSocket->sendPacket(sessionResultPkt);
         }
     }
 
     else {// User was already connected, doesn't need to start session again
         Packet *clientOriginalPort = newConnectionSocket->readPacket();
+        if (clientOriginalPort == NULL){
+            std::cout << "Unable to read the original port of " << user << ". Closing connection.\n";
+            delete newConnectionSocket;
+            return;
+        }
         client_address.ipv4 = inet_ntoa(cli_addr.sin_addr);
         client_address.port = atoi(clientOriginalPort->getPayload());
+        delete clientOriginalPort;
     }
     // Build args
     communiction_handler_args *args = (communiction_handler_args *) calloc(1, sizeof(communiction_handler_args));
@@ -1545,32 +3340,123 @@ void ServerSocket::connectNewClientOrServer(pthread_t *threadID, Server* server)
     args->connectedSocket = newConnectionSocket;
     args->user = user;
     args->server = server;
+    args->offline_retrieved = offlineRetrieved;
+    args->replica_delivery = replicaDelivery;
 
-    pthread_create(threadID, NULL, Server::communicationHandler, (void *)args);
+    newConnectionSocket->setReadTimeout(0);
+    pthread_create(&threadID, NULL, Server::communicationHandler, (void *)args);
+    pthread_detach(threadID);
 }
 
 
+// Connects to every other member at once and waits for all of them together, so members that are
+// down cost a single PEER_DISCOVERY_TIMEOUT_MS instead of a TCP timeout each. A member that refuses
+// is down, but one that stays silent may be a live server that is slow to answer: it is tried again
+// for up to PEER_DISCOVERY_ROUNDS rounds before this server may elect itself
 void ServerSocket::connectToGroupMembers(Server* server){
-    struct sockaddr_in serv_addr;
-    struct hostent *serverHost;
-    serv_addr.sin_family = AF_INET;
     
     // Assumes server starts in backup mode and only changes it if there already are server 
     // instances running or its id is the greatest among all group members' id
     server->backupMode = true;
 
-    bool noConnections = true;
+    vector< pair<string, int> > members;
+    vector<struct sockaddr_in> addresses;
+    vector<Socket*> peerSockets;
+    vector<bool> connected;
+    vector<bool> silent;        // neither accepted nor refused yet
+
     for (auto &possibleAddress : server->possibleServerAddresses){
-        
-        // Set IP adress
-        serverHost = gethostbyname(possibleAddress.first.c_str());
-        serv_addr.sin_addr = *((struct in_addr *)serverHost->h_addr);
+        struct sockaddr_in serv_addr;
+        if (!resolveMember(possibleAddress.first, possibleAddress.second, &serv_addr)){
+            cout << "Could not resolve peer server address " << possibleAddress.first << "\n";
+            continue;
+        }
+        members.push_back(possibleAddress);
+        addresses.push_back(serv_addr);
+        peerSockets.push_back(NULL);
+        connected.push_back(false);
+        silent.push_back(true);
+    }
+
+    for (int round = 0; round < PEER_DISCOVERY_ROUNDS && any_of(silent.begin(), silent.end(), [](bool s){ return s; }); round++){
+        if (round > 0)
+            cout << "Some peer servers did not answer, trying them again...\n";
+
+        vector<struct pollfd> attempts(members.size());
+        for (size_t i = 0; i < members.size(); i++){
+            attempts[i].fd = -1;
+            attempts[i].events = POLLOUT;
+            attempts[i].revents = 0;
+            if (!silent[i])
+                continue;
+
+            peerSockets[i] = new Socket();
+            int socketfd = peerSockets[i]->getSocketfd();
+            fcntl(socketfd, F_SETFL, fcntl(socketfd, F_GETFL) | O_NONBLOCK);
+
+            if (connect(socketfd, (struct sockaddr *) &addresses[i], sizeof(addresses[i])) == 0){
+                connected[i] = true;
+                silent[i] = false;
+            }
+            else if (errno == EINPROGRESS)
+                attempts[i].fd = socketfd;
+            else
+                silent[i] = false;      // refused right away
+        }
+
+        // poll skips the attempts already settled, their fd is -1
+        struct timespec start, now;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        while (any_of(attempts.begin(), attempts.end(), [](const struct pollfd& attempt){ return attempt.fd >= 0; })){
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long elapsedMs = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+            if (elapsedMs >= PEER_DISCOVERY_TIMEOUT_MS)
+                break;
+
+            int ready = poll(attempts.data(), attempts.size(), PEER_DISCOVERY_TIMEOUT_MS - elapsedMs);
+            if (ready < 0 && errno == EINTR)
+                continue;
+            if (ready <= 0)
+                break;
+
+            for (size_t i = 0; i < attempts.size(); i++){
+                if (attempts[i].fd < 0 || attempts[i].revents == 0)
+                    continue;
+
+                int error = 0;
+                socklen_t length = sizeof(error);
+                getsockopt(attempts[i].fd, SOL_SOCKET, SO_ERROR, &error, &length);
+                connected[i] = error == 0;
+                silent[i] = false;
+                attempts[i].fd = -1;
+            }
+        }
+
+        // the attempts still silent start over with a new socket next round
+        for (size_t i = 0; i < members.size(); i++){
+            if (peerSockets[i] != NULL && !connected[i]){
+                delete peerSockets[i];
+                peerSockets[i] = NULL;
+            }
+        }
+    }
 
-        // Set port
-        serv_addr.sin_port = htons(possibleAddress.second);
+    bool noConnections = true;
+    for (size_t i = 0; i < members.size(); i++){
+        cout << "Trying to connect to peer server at " << members[i].first << ":" << members[i].second << "... ";
+        if (!connected[i]){
+            if (silent[i])
+                cout << "Failed, no answer after " << PEER_DISCOVERY_ROUNDS << " rounds.\n";
+            else
+                cout << "Failed, no server instance running here.\n";
+            continue;
+        }
+        cout << "Connected!" << "\n";
 
-        if (this->connectToMember(serv_addr, possibleAddress.first, server))
-            noConnections = false;
+        int socketfd = peerSockets[i]->getSocketfd();
+        fcntl(socketfd, F_SETFL, fcntl(socketfd, F_GETFL) & ~O_NONBLOCK);
+        this->joinMember(peerSockets[i], members[i].first, members[i].second, server);
+        noConnections = false;
     }
 
     if (noConnections){
@@ -1581,25 +3467,34 @@ void ServerSocket::connectToGroupMembers(Server* server){
  }
 
 
-bool ServerSocket::connectToMember(sockaddr_in serv_addr, string ip, Server* server){
-
-    Socket *peerConnectedSocket = new Socket();
-    pthread_t serverServerThread;
-    int peerPort = ntohs(serv_addr.sin_port);
+// resolved once, before any connection is attempted
+bool ServerSocket::resolveMember(string ip, int port, sockaddr_in* serv_addr){
 
-    cout << "Trying to connect to peer server at " << ip << ":" << peerPort << "... ";
+    bzero(serv_addr, sizeof(*serv_addr));
+    serv_addr->sin_family = AF_INET;
+    serv_addr->sin_port = htons(port);
+    if (inet_aton(ip.c_str(), &serv_addr->sin_addr))
+        return true;
 
-    if (connect(peerConnectedSocket->getSocketfd(),(struct sockaddr *) &serv_addr,sizeof(serv_addr)) < 0){
-        cout << "Failed, no server instance running here.\n";
+    struct addrinfo hints;
+    struct addrinfo *resolved;
+    bzero(&hints, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(ip.c_str(), NULL, &hints, &resolved) != 0)
         return false;
-    }
 
-    // else 
-    cout << "Connected!" << "\n";
+    serv_addr->sin_addr = ((struct sockaddr_in *) resolved->ai_addr)->sin_addr;
+    freeaddrinfo(resolved);
+    return true;
+}
+
 
+void ServerSocket::joinMember(Socket* peerConnectedSocket, string ip, int peerPort, Server* server){
+
+    pthread_t serverServerThread;
     int peerID = server->getIdFromAddress(ip, peerPort);
-    server->addPeerToConnectedServers(peerID, peerConnectedSocket);
-    server->sendMessagesForConnectionEstablishment(peerConnectedSocket, peerID);
+    server->addPeerToConnectedServers(peerID, peerConnectedSocket, true);
     
     group_communiction_handler_args *args = (group_communiction_handler_args *) calloc(1, sizeof(group_communiction_handler_args));
     args->connectedSocket = peerConnectedSocket;
@@ -1607,7 +3502,7 @@ bool ServerSocket::connectToMember(sockaddr_in serv_addr, string ip, Server* ser
     args->peerID = peerID;
 
     pthread_create(&serverServerThread, NULL, Server::groupReadMessagesHandler, (void *)args);
-    return true;
+    pthread_detach(serverServerThread);
 }
 
 
@@ -1630,6 +3525,7 @@ void ServerSocket::bindAndListen(Server* server){
             cout << "Address " << ip << ":" << port << "  already taken\n";
         } else {
             server->setAddress(ip, port);
+            server->joinShard();
             server->removeSelfFromPossibleServerAddresses();
             bindSucceeded = true;
             break;
@@ -1655,7 +3551,8 @@ void *Server::communicationHandler(void *handlerArgs){
     pthread_t sendNotificationsT;
 
     pthread_create(&readCommandsT, NULL, Server::readCommandsHandler, handlerArgs);
-    pthread_create(&sendNotificationsT, NULL, Server::sendNotificationsHandler, handlerArgs);
+    if (!args->replica_delivery)
+        pthread_create(&sendNotificationsT, NULL, Server::sendNotificationsHandler, handlerArgs);
 
     while(!(args->server->backupMode)){
         sleep(0.1);
@@ -1668,7 +3565,8 @@ void *Server::communicationHandler(void *handlerArgs){
 
 
     pthread_cancel(readCommandsT);  // keeps reading even after socket close, so it must be forced to stop
-    pthread_cancel(sendNotificationsT);  // sleeping waiting for new notifications
+    if (!args->replica_delivery)
+        pthread_cancel(sendNotificationsT);  // sleeping waiting for new notifications
     pthread_mutex_unlock(&(args->server->seqn_transaction_serializer));
 
     return NULL;
@@ -1678,9 +3576,6 @@ void *Server::communicationHandler(void *handlerArgs){
 void *Server::readCommandsHandler(void *handlerArgs){
 	struct communiction_handler_args *args = (struct communiction_handler_args *)handlerArgs;
 
-    string userToFollow;
-    string response;
-
     while(1){
         Packet* receivedPacket = args->connectedSocket->readPacket();
         if (receivedPacket == NULL){  // connection closed
@@ -1690,28 +3585,62 @@ void *Server::readCommandsHandler(void *handlerArgs){
         }
         cout << receivedPacket->getPayload() << "\n\n";
 
-        switch(receivedPacket->getType()){
+        for (auto &responsePacket : args->server->answer_command(args->user, receivedPacket))
+            args->connectedSocket->sendPacket(responsePacket);
+        delete receivedPacket;
+    }
+}
 
-            case COMMAND_FOLLOW_PKT:
-                userToFollow = receivedPacket->getPayload();
-                response = "Followed "+userToFollow+"!";
-                if(args->server->follow_user(args->user, userToFollow))
-                    args->connectedSocket->sendPacket(Packet(MESSAGE_PKT, response.c_str()));
-                else 
-                    args->connectedSocket->sendPacket(Packet(MESSAGE_PKT, "Follow failed, try again."));
-                break;
 
-            case COMMAND_SEND_PKT:
-                if(args->server->create_notification(args->user, receivedPacket->getPayload(), receivedPacket->getTimestamp()))
-                    args->connectedSocket->sendPacket(Packet(MESSAGE_PKT, "Notification sent!"));
-                else
-                    args->connectedSocket->sendPacket(Packet(MESSAGE_PKT, "Send failed, try again."));
-                break;
+// Runs a command a client sent on its session, returns what to answer it with
+vector<Packet> Server::answer_command(string user, Packet* command){
 
-            default:
-                break;
+    vector<Packet> responses;
+    string userToFollow;
+    string response;
+    Packet responsePacket;
+
+    switch(command->getType()){
+
+        case COMMAND_FOLLOW_PKT:
+            userToFollow = command->getPayload();
+            response = "Followed "+userToFollow+"!";
+            if(route_follow_user(user, userToFollow))
+                responsePacket = Packet(MESSAGE_PKT, response.c_str());
+            else 
+                responsePacket = Packet(MESSAGE_PKT, "Follow failed, try again.");
+            // reads on a backup wait until it applied at least this far
+            responsePacket.setSeqn(last_event_seqn());
+            responses.push_back(responsePacket);
+            break;
+
+        case COMMAND_SEND_PKT:
+            if(create_notification(user, command->getPayload(), command->getTimestamp()))
+                responsePacket = Packet(MESSAGE_PKT, "Notification sent!");
+            else
+                responsePacket = Packet(MESSAGE_PKT, "Send failed, try again.");
+            responsePacket.setSeqn(last_event_seqn());
+            responses.push_back(responsePacket);
+            break;
+
+        case QUERY_PKT: {
+            // the replica picked by the client was too far behind, the primary never is
+            vector<string> answer;
+            uint16_t applied_seqn;
+            answer_query(command->getPayload(), 0, &answer, &applied_seqn);
+            for (auto &line : answer){
+                responsePacket = Packet(QUERY_RESULT, line.c_str());
+                responsePacket.setSeqn(applied_seqn);
+                responses.push_back(responsePacket);
+            }
+            break;
         }
+
+        default:
+            break;
     }
+
+    return responses;
 }
 
 
@@ -1722,19 +3651,27 @@ void *Server::sendNotificationsHandler(void *handlerArgs)
     int n;
 
 
-    args->server->retrieve_notifications_from_offline_period(args->user, args->client_address);
+    if (!args->offline_retrieved)    // resumed session, the login transaction did not run here
+        args->server->retrieve_notifications_from_offline_period(args->user, args->client_address);
+
+    shared_ptr<SessionChannel> channel = args->server->get_session_channel(args->client_address);
+    if (!channel)
+        return NULL;
     
     while(1)
     {   
         if (args->server->backupMode)
             return NULL;    
 
-        vector<notification> notifications;
+        vector< shared_ptr<const notification> > notifications;
+
+        // Waits on the session's own inbox, the transaction mutex is not taken here
+        if (!channel->wait_notifications(&notifications))
+            return NULL;    // session closed
 
-        args->server->read_notifications(args->client_address, &notifications);
         for(auto it = std::begin(notifications); it != std::end(notifications); ++it)
         {        
-            notificationPacket = Packet(NOTIFICATION_PKT, it->timestamp, it->body.c_str(), it->author.c_str());
+            notificationPacket = Packet(NOTIFICATION_PKT, (*it)->timestamp, (*it)->body.c_str(), (*it)->author.c_str());
             
             n = args->connectedSocket->sendPacket(notificationPacket);
             if (n<0)
@@ -1744,5 +3681,425 @@ void *Server::sendNotificationsHandler(void *handlerArgs)
                 return NULL;    // otherwise, server was bullyed: session must remain openned
             }
         }
+
+        args->server->record_delivery(args->client_address, args->user, notifications.back()->id, channel.get());
+    }
+}
+
+
+// Delivery connection of a session opened on the primary, served by this replica whatever its
+// role. Leaving the session open when the client goes away is the primary's call
+void *Server::replicaDeliveryHandler(void *handlerArgs)
+{
+    struct communiction_handler_args *args = (struct communiction_handler_args *)handlerArgs;
+    Server* server = args->server;
+
+    shared_ptr<SessionChannel> channel = server->take_over_delivery(args->user, args->client_address, args->login_seqn);
+    if (!channel)
+    {
+        cout << "No session of " << args->user << " to deliver to yet.\n";
+        delete args->connectedSocket;
+        free(args);
+        return NULL;
+    }
+    cout << "Delivering to " << args->user << " at " << args->client_address.ipv4 << ":" << args->client_address.port << "\n";
+
+    while(1)
+    {
+        vector< shared_ptr<const notification> > notifications;
+        if (!channel->wait_notifications(&notifications))
+            break;    // session closed
+
+        bool sent = true;
+        for (auto &notif : notifications)
+        {
+            if (args->connectedSocket->sendPacket(Packet(NOTIFICATION_PKT, notif->timestamp, notif->body.c_str(), notif->author.c_str())) < 0)
+            {
+                sent = false;
+                break;
+            }
+        }
+        if (!sent)
+            break;
+
+        server->record_delivery(args->client_address, args->user, notifications.back()->id, channel.get());
+    }
+
+    server->end_replica_delivery(args->user, args->client_address, channel);
+    delete args->connectedSocket;
+    free(args);
+    return NULL;
+}
+
+
+// Supervises a gateway link like communicationHandler does a client connection. The link is
+// never freed, channels of the sessions it carried may still post its wakeup
+void *Server::gatewayLinkHandler(void *handlerArgs)
+{
+    gateway_link *link = (gateway_link *)handlerArgs;
+
+    pthread_t readT;
+    pthread_t sendT;
+
+    pthread_create(&readT, NULL, Server::gatewayReadHandler, handlerArgs);
+    pthread_create(&sendT, NULL, Server::gatewaySendHandler, handlerArgs);
+
+    while(!link->server->backupMode && !link->closed)
+        usleep(100000);
+
+    // Bullied: the gateway finds the new primary and resumes the sessions there, its clients
+    // never notice
+    if (!link->closed){
+        pthread_mutex_lock(&link->send_mutex);
+        link->connectedSocket->sendPacket(Packet(CLIENT_MUST_RECONNECT, ""));
+        pthread_mutex_unlock(&link->send_mutex);
+        pthread_cancel(readT);
+    }
+    pthread_cancel(sendT);
+
+    return NULL;
+}
+
+
+void *Server::gatewayReadHandler(void *handlerArgs)
+{
+    gateway_link *link = (gateway_link *)handlerArgs;
+    Server* server = link->server;
+
+    while(1){
+        Packet* receivedPacket = link->connectedSocket->readPacket();
+        if (receivedPacket == NULL)
+            break;
+
+        uint32_t id = receivedPacket->getSession();
+        uint16_t type = receivedPacket->getType();
+
+        if (type == GATEWAY_SESSION_OPEN || type == GATEWAY_SESSION_RESUME){
+            gateway_session session;
+            bool opened = server->open_gateway_session(receivedPacket, &session);
+
+            Packet responsePacket;
+            if (opened)
+                responsePacket = Packet(SESSION_OPEN_SUCCEDED, "Connection succeded! Session established.");
+            else
+                responsePacket = Packet(SESSION_OPEN_FAILED, "Unable to connect to server: no sessions available or consistency precaution.");
+            responsePacket.setSeqn(server->last_event_seqn());
+            responsePacket.setSession(id);
+
+            pthread_mutex_lock(&link->send_mutex);
+            link->connectedSocket->sendPacket(responsePacket);
+            pthread_mutex_unlock(&link->send_mutex);
+
+            // notifications only after the answer, the client reads that one first
+            if (opened){
+                pthread_mutex_lock(&link->sessions_mutex);
+                link->sessions[id] = session;
+                pthread_mutex_unlock(&link->sessions_mutex);
+
+                session.channel->share_wakeup(&link->wakeup);
+                sem_post(&link->wakeup);    // for what the login queued before
+            }
+            delete receivedPacket;
+            continue;
+        }
+
+        pthread_mutex_lock(&link->sessions_mutex);
+        auto found = link->sessions.find(id);
+        bool known = found != link->sessions.end();
+        gateway_session session;
+        if (known){
+            session = found->second;
+            if (type == GATEWAY_SESSION_CLOSED)
+                link->sessions.erase(found);
+        }
+        pthread_mutex_unlock(&link->sessions_mutex);
+
+        if (known && type == GATEWAY_SESSION_CLOSED)
+            server->close_session(session.user, session.address);
+
+        else if (known){
+            vector<Packet> responses = server->answer_command(session.user, receivedPacket);
+            pthread_mutex_lock(&link->send_mutex);
+            for (auto &responsePacket : responses){
+                responsePacket.setSession(id);
+                link->connectedSocket->sendPacket(responsePacket);
+            }
+            pthread_mutex_unlock(&link->send_mutex);
+        }
+        delete receivedPacket;
+    }
+
+    // the gateway went away and its clients with it, unless this server was the one bullied
+    if (!server->backupMode){
+        pthread_mutex_lock(&link->sessions_mutex);
+        map<uint32_t, gateway_session> sessions;
+        sessions.swap(link->sessions);
+        pthread_mutex_unlock(&link->sessions_mutex);
+
+        for (auto &session : sessions)
+            server->close_session(session.second.user, session.second.address);
+    }
+    link->closed = true;
+    return NULL;
+}
+
+
+// One sender for every session of the link, woken by whichever of their channels got something
+void *Server::gatewaySendHandler(void *handlerArgs)
+{
+    gateway_link *link = (gateway_link *)handlerArgs;
+    Server* server = link->server;
+
+    while(1)
+    {
+        sem_wait(&link->wakeup);
+
+        pthread_mutex_lock(&link->sessions_mutex);
+        map<uint32_t, gateway_session> sessions = link->sessions;
+        pthread_mutex_unlock(&link->sessions_mutex);
+
+        for (auto &session : sessions)
+        {
+            vector< shared_ptr<const notification> > notifications;
+            session.second.channel->drain(&notifications);
+            if (notifications.empty())
+                continue;
+
+            bool sent = true;
+            pthread_mutex_lock(&link->send_mutex);
+            for (auto &notif : notifications)
+            {
+                Packet notificationPacket = Packet(NOTIFICATION_PKT, notif->timestamp, notif->body.c_str(), notif->author.c_str());
+                notificationPacket.setSession(session.first);
+                if (link->connectedSocket->sendPacket(notificationPacket) < 0)
+                {
+                    sent = false;
+                    break;
+                }
+            }
+            pthread_mutex_unlock(&link->send_mutex);
+
+            if (!sent)
+                return NULL;    // the reader sees the link closed too
+            server->record_delivery(session.second.address, session.second.user, notifications.back()->id, session.second.channel.get());
+        }
+    }
+}
+
+
+void *Server::deliveryProgressHandler(void *handlerArgs)
+{
+    Server* server = (Server*) handlerArgs;
+
+    while(1)
+    {
+        RttEstimator::sleep_micros(DELIVERY_PROGRESS_FLUSH_MS * 1000L);
+        server->flush_delivery_progress();
+    }
+}
+
+
+// Only thread that changes the backup state: events are applied one at a time, in the order
+// the primary sent them, while the group receiver keeps reading
+void *Server::eventApplierHandler(void *handlerArgs)
+{
+    Server* server = (Server*) handlerArgs;
+    uint16_t reported = 0;
+
+    while(1)
+    {
+        replicated_event replicated = server->replicated_events->pop();
+
+        if (replicated.e.seqn <= server->last_event_seqn())
+            cout << "Event " << replicated.e.seqn << " already applied, ignoring.\n";
+        else
+            server->apply_replicated_event(replicated);
+
+        pthread_mutex_lock(&server->applier_mutex);
+        server->unapplied_events--;
+        if (server->unapplied_events == 0)
+            pthread_cond_broadcast(&server->applier_idle);
+        pthread_mutex_unlock(&server->applier_mutex);
+
+        // lets the primary open the catch-up window further, once per batch the log got into.
+        // Skipped or aborted events may step over a multiple of CATCH_UP_BATCH, so is the end
+        // of what was queued, short of a whole batch
+        if (replicated.report_progress)
+        {
+            uint16_t applied = server->last_event_seqn();
+            bool drained = server->replicated_events->size() == 0;
+            if (applied / CATCH_UP_BATCH != reported / CATCH_UP_BATCH || (drained && applied != reported))
+            {
+                server->sendPacketToPrimaryServer(Packet(APPLIED_PROGRESS, to_string(applied).c_str()));
+                reported = applied;
+            }
+        }
+    }
+}
+
+
+// Streams asynchronously replicated events to the backups, in commit order
+void *Server::asyncReplicationHandler(void *handlerArgs)
+{
+    Server* server = (Server*) handlerArgs;
+
+    while(1)
+    {
+        event e = server->async_events->pop();
+        if (REPLICATION_TOPOLOGY == CHAIN_TOPOLOGY){
+            string order = server->chain_order();
+            int head = server->chain_successor(order);
+            if (head)
+                server->sendPacketToServer(head, server->chain_packet(e.command, e, order));
+        }
+        else
+            server->send_event_to_live_backups(e);
+
+        pthread_mutex_lock(&server->async_replication_mutex);
+        server->async_unsent_events--;
+        if (server->async_unsent_events == 0)
+            pthread_cond_broadcast(&server->async_replication_drained);
+        pthread_mutex_unlock(&server->async_replication_mutex);
+    }
+}
+
+
+// Replicated events, catch-up ranges, delivery progress and anti-entropy packets, in arrival order
+void *Server::bulkReadMessagesHandler(void *handlerArgs)
+{
+    Server* server = (Server*) handlerArgs;
+
+    while(1)
+    {
+        Packet* receivedPacket = server->inbound_bulk->pop();
+
+        switch(receivedPacket->getType()){
+
+            case CATCH_UP_EVENT:
+                server->enqueue_replicated_event(receivedPacket->e, !receivedPacket->e.committed, "", true);
+                break;
+
+            case DELIVERY_PROGRESS:
+                server->apply_delivery_progress(receivedPacket->getPayload());
+                break;
+
+            case STATE_DIGEST:
+                server->compare_state_digest(receivedPacket->getSeqn(), receivedPacket->getPayload());
+                break;
+
+            case BUCKET_DIGEST:
+                server->send_differing_buckets(receivedPacket->getPayload());
+                break;
+
+            case STATE_REPAIR:
+                server->receive_state_repair(receivedPacket->getSeqn(), receivedPacket->getPayload());
+                break;
+
+            default: {
+                cout << "Event "<<receivedPacket->e.seqn<<" queued for replication.\n";
+                string chain;
+                if (REPLICATION_TOPOLOGY == CHAIN_TOPOLOGY && receivedPacket->getLength() > 0)
+                    chain = receivedPacket->getPayload();
+                server->enqueue_replicated_event(receivedPacket->e, false, chain, false);
+                break;
+            }
+        }
+
+        delete receivedPacket;
+    }
+}
+
+
+// Requests of another shard's primary, answered one by one. Once bullied the link is dropped
+// so the other shard reconnects to the new primary
+void *Server::shardRequestsHandler(void *handlerArgs)
+{
+    struct group_communiction_handler_args *args = (struct group_communiction_handler_args *)handlerArgs;
+    Server* server = args->server;
+
+    cout << "Shard " << args->peerID << " linked\n";
+
+    while(1)
+    {
+        Packet* request = args->connectedSocket->readPacket();
+        if (request == NULL)
+            break;
+        if (server->backupMode)
+        {
+            delete request;
+            break;
+        }
+
+        string reply = server->serve_shard_request(request);
+        args->connectedSocket->sendPacket(Packet(SHARD_REPLY, reply.c_str()));
+        delete request;
+    }
+
+    cout << "Shard " << args->peerID << " unlinked\n";
+    delete args->connectedSocket;
+    free(args);
+    return NULL;
+}
+
+
+// Read-only connection of a client, each query answered with its lines or QUERY_STALE
+void *Server::queryRequestsHandler(void *handlerArgs)
+{
+    struct group_communiction_handler_args *args = (struct group_communiction_handler_args *)handlerArgs;
+    Server* server = args->server;
+
+    while(1)
+    {
+        Packet* query = args->connectedSocket->readPacket();
+        if (query == NULL)
+            break;
+
+        vector<string> answer;
+        uint16_t applied_seqn = 0;
+        if (query->getType() != QUERY_PKT)
+            answer.push_back("Not a query.");
+        else if (!server->answer_query(query->getPayload(), query->getSeqn(), &answer, &applied_seqn))
+        {
+            args->connectedSocket->sendPacket(Packet(QUERY_STALE, ""));
+            delete query;
+            continue;
+        }
+
+        answer.push_back("");   // closes the answer
+        for (auto &line : answer)
+        {
+            Packet result(QUERY_RESULT, line.c_str());
+            result.setSeqn(applied_seqn);
+            args->connectedSocket->sendPacket(result);
+        }
+        delete query;
+    }
+
+    delete args->connectedSocket;
+    free(args);
+    return NULL;
+}
+
+
+void *Server::stateDigestHandler(void *handlerArgs)
+{
+    Server* server = (Server*) handlerArgs;
+
+    while(1)
+    {
+        RttEstimator::sleep_micros(STATE_DIGEST_INTERVAL_MS * 1000L);
+        server->send_state_digests();
+    }
+}
+
+
+void *Server::backupCatchUpHandler(void *handlerArgs)
+{
+    Server* server = (Server*) handlerArgs;
+
+    while(1)
+    {
+        RttEstimator::sleep_micros(CATCH_UP_INTERVAL_MS * 1000L);
+        server->serve_lagging_backups();
     }
-}
\ No newline at end of file
+}
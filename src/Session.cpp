@@ -0,0 +1,170 @@
+#include "../include/Session.hpp"
+
+
+SessionChannel::SessionChannel() : consumer_waiting(false), closed(false), shared_wakeup(NULL)
+{
+    sem_init(&wakeup, 0, 0);
+}
+
+SessionChannel::~SessionChannel()
+{
+    sem_destroy(&wakeup);
+}
+
+
+void SessionChannel::push(shared_ptr<const notification> notif)
+{
+    inbox.push(notif);
+
+    sem_t* shared = shared_wakeup.load();
+    if (shared != NULL)
+    {
+        sem_post(shared);
+        return;
+    }
+
+    // Only pay for the semaphore when the sender is actually sleeping
+    if (consumer_waiting.exchange(false))
+        sem_post(&wakeup);
+}
+
+void SessionChannel::close()
+{
+    closed.store(true);
+
+    sem_t* shared = shared_wakeup.load();
+    if (shared != NULL)
+        sem_post(shared);
+    if (consumer_waiting.exchange(false))
+        sem_post(&wakeup);
+}
+
+bool SessionChannel::is_closed()
+{
+    return closed.load();
+}
+
+
+bool SessionChannel::wait_notifications(vector< shared_ptr<const notification> >* notifications)
+{
+    shared_ptr<const notification> notif;
+
+    while (true)
+    {
+        while (inbox.pop(&notif))
+            notifications->push_back(notif);
+
+        if (!notifications->empty())
+            return true;
+        if (closed.load())
+            return false;
+
+        // Announce the sleep and check again, so a push racing with us either
+        // lands in the inbox before the check or sees the flag and posts
+        consumer_waiting.store(true);
+        if (!inbox.empty() || closed.load())
+        {
+            consumer_waiting.store(false);
+            continue;
+        }
+
+        sem_wait(&wakeup);  // spurious posts just loop around to an empty drain
+    }
+}
+
+// pushes from now on post the shared semaphore, the caller drains once for the ones before
+void SessionChannel::share_wakeup(sem_t* shared)
+{
+    shared_wakeup.store(shared);
+}
+
+bool SessionChannel::drain(vector< shared_ptr<const notification> >* notifications)
+{
+    shared_ptr<const notification> notif;
+    while (inbox.pop(&notif))
+        notifications->push_back(notif);
+
+    return !closed.load();
+}
+
+
+DeliveryIndex::DeliveryIndex()
+{
+    pthread_rwlock_init(&lock, NULL);
+}
+
+DeliveryIndex::~DeliveryIndex()
+{
+    pthread_rwlock_destroy(&lock);
+}
+
+
+void DeliveryIndex::register_session(uint32_t user_id, session_key key, shared_ptr<SessionChannel> channel, uint32_t primed_before)
+{
+    pthread_rwlock_wrlock(&lock);
+
+    vector<delivery_target>& user_targets = targets[user_id];
+    auto it = user_targets.begin();
+    while (it != user_targets.end() && it->key != key)
+        it++;
+
+    if (it == user_targets.end())
+        user_targets.push_back(delivery_target(key, channel, primed_before));
+    else
+        *it = delivery_target(key, channel, primed_before);    // session resumed
+
+    pthread_rwlock_unlock(&lock);
+}
+
+void DeliveryIndex::unregister_session(uint32_t user_id, session_key key)
+{
+    pthread_rwlock_wrlock(&lock);
+
+    auto user_targets = targets.find(user_id);
+    if (user_targets != targets.end())
+    {
+        vector<delivery_target>& user_sessions = user_targets->second;
+        for (auto it = user_sessions.begin(); it != user_sessions.end(); it++)
+        {
+            if (it->key == key)
+            {
+                user_sessions.erase(it);
+                break;
+            }
+        }
+        if (user_sessions.empty())
+            targets.erase(user_targets);
+    }
+
+    pthread_rwlock_unlock(&lock);
+}
+
+int DeliveryIndex::deliver(uint32_t user_id, shared_ptr<const notification> notif)
+{
+    int reached = 0;
+    pthread_rwlock_rdlock(&lock);
+
+    auto user_targets = targets.find(user_id);
+    if (user_targets != targets.end())
+    {
+        for (auto &target : user_targets->second)
+        {
+            if (notif->id >= target.primed_before)
+            {
+                target.channel->push(notif);
+                reached++;
+            }
+        }
+    }
+
+    pthread_rwlock_unlock(&lock);
+    return reached;
+}
+
+bool DeliveryIndex::empty()
+{
+    pthread_rwlock_rdlock(&lock);
+    bool none = targets.empty();
+    pthread_rwlock_unlock(&lock);
+    return none;
+}
@@ -0,0 +1,160 @@
+#include "../include/ShardLink.hpp"
+
+
+ShardLink::ShardLink(int shard, int fromShard, map<string, int> addresses)
+{
+    this->shard = shard;
+    this->fromShard = fromShard;
+    this->addresses = addresses;
+    this->socket = new ClientSocket();
+    this->connected = false;
+    this->primaryKnown = false;
+    this->posted = new BoundedQueue<Packet>(SHARD_FORWARD_QUEUE_CAPACITY);
+    this->origin = to_string(fromShard) + "." + to_string(time(NULL));
+    this->lastPost = 0;
+
+    pthread_mutex_init(&mutex, NULL);
+    pthread_mutex_init(&addressMutex, NULL);
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, ShardLink::postThread, (void *)this);
+    pthread_detach(thread);
+}
+
+
+// a member that is not the primary answers with the primary's ip and port
+bool ShardLink::greet(host_address* reached)
+{
+    this->socket->sendPacket(Packet(SHARD_CONNECTING, to_string(this->fromShard).c_str()));
+
+    Packet* answer = this->socket->readPacket();
+    if (answer == NULL)
+        return false;
+    if (answer->getType() == ALREADY_PRIMARY){
+        delete answer;
+        return true;
+    }
+
+    string primaryIP = answer->getPayload();
+    delete answer;
+    Packet* primaryPort = this->socket->readPacket();
+    if (primaryPort == NULL)
+        return false;
+    int port = atoi(primaryPort->getPayload());
+    delete primaryPort;
+
+    this->socket->reopenSocket();
+    if (!this->socket->connectToServer(primaryIP.c_str(), port))
+        return false;
+    reached->ipv4 = primaryIP;
+    reached->port = port;
+
+    this->socket->sendPacket(Packet(SHARD_CONNECTING, to_string(this->fromShard).c_str()));
+    answer = this->socket->readPacket();
+    bool isPrimary = answer != NULL && answer->getType() == ALREADY_PRIMARY;
+    delete answer;
+    return isPrimary;
+}
+
+bool ShardLink::connect()
+{
+    for (auto &address : this->addresses){
+        host_address reached;
+        reached.ipv4 = address.first;
+        reached.port = address.second;
+
+        this->socket->reopenSocket();
+        if (this->socket->connectToServer(address.first.c_str(), address.second) && this->greet(&reached)){
+            cout << "Linked to primary of shard " << this->shard << " at " << reached.ipv4 << ":" << reached.port << "\n";
+            this->connected = true;
+
+            pthread_mutex_lock(&addressMutex);
+            this->primary = reached;
+            this->primaryKnown = true;
+            pthread_mutex_unlock(&addressMutex);
+            return true;
+        }
+    }
+
+    cout << "No primary of shard " << this->shard << " is reachable\n";
+    return false;
+}
+
+void ShardLink::disconnect()
+{
+    this->socket->reopenSocket();
+    this->connected = false;
+
+    pthread_mutex_lock(&addressMutex);
+    this->primaryKnown = false;
+    pthread_mutex_unlock(&addressMutex);
+}
+
+
+// a link found broken is reopened once, the shard may have elected a new primary meanwhile
+bool ShardLink::request(Packet packet, string* reply)
+{
+    pthread_mutex_lock(&mutex);
+
+    bool answered = false;
+    for (int attempt = 0; attempt < 2 && !answered; attempt++){
+        if (!this->connected && !this->connect())
+            break;
+
+        Packet* answer = NULL;
+        if (this->socket->sendPacket(packet) >= 0)
+            answer = this->socket->readPacket();
+
+        if (answer != NULL && answer->getType() == SHARD_REPLY){
+            *reply = answer->getPayload();
+            answered = true;
+        }
+        else
+            this->disconnect();
+        delete answer;
+    }
+
+    pthread_mutex_unlock(&mutex);
+    return answered;
+}
+
+bool ShardLink::primary_address(host_address* primary)
+{
+    pthread_mutex_lock(&addressMutex);
+    bool known = this->primaryKnown;
+    if (known)
+        *primary = this->primary;
+    pthread_mutex_unlock(&addressMutex);
+    return known;
+}
+
+void ShardLink::post(Packet packet)
+{
+    this->posted->push(packet);
+}
+
+
+void *ShardLink::postThread(void *linkArg)
+{
+    ShardLink* link = (ShardLink*) linkArg;
+    string reply;
+
+    while (true){
+        Packet packet = link->posted->pop();
+
+        // numbered once, so the other shard can tell a post sent again after a lost reply
+        link->lastPost++;
+        strcpy(packet.e.arg1, link->origin.c_str());
+        strcpy(packet.e.arg2, to_string(link->lastPost).c_str());
+
+        // in order: a post that can't be delivered yet holds back the ones behind it. Only an
+        // unreachable shard is retried, a post its primary refused would be refused again
+        while (!link->request(packet, &reply))
+            RttEstimator::sleep_micros(SHARD_RETRY_INTERVAL_MS * 1000L);
+
+        if (reply != "1")
+            cout << "Shard " << link->shard << " refused post " << link->lastPost << " of " << packet.getAuthor() << ", dropping it.\n";
+    }
+
+    return NULL;
+}
@@ -0,0 +1,66 @@
+#include "../include/ShardMap.hpp"
+#include "../include/StateDigest.hpp"
+
+
+ShardMap::ShardMap()
+{
+
+}
+
+
+void ShardMap::add_server(string ip, int port, int shard)
+{
+    servers[ip] = pair<int, int>(port, shard);
+
+    if (find(shard_ids.begin(), shard_ids.end(), shard) == shard_ids.end())
+    {
+        shard_ids.push_back(shard);
+        sort(shard_ids.begin(), shard_ids.end());
+        place_shard(shard);
+    }
+}
+
+void ShardMap::place_shard(int shard)
+{
+    for (int i = 0; i < SHARD_RING_VNODES; i++)
+        ring[StateDigest::hash(to_string(shard) + "#" + to_string(i))] = shard;
+}
+
+
+int ShardMap::size()
+{
+    return shard_ids.size();
+}
+
+vector<int> ShardMap::shards()
+{
+    return shard_ids;
+}
+
+map<string, int> ShardMap::addresses_of(int shard)
+{
+    map<string, int> addresses;
+    for (auto &server : servers)
+        if (server.second.second == shard)
+            addresses.insert({server.first, server.second.first});
+    return addresses;
+}
+
+int ShardMap::shard_of_address(string ip)
+{
+    auto it = servers.find(ip);
+    if (it == servers.end())
+        return -1;
+    return it->second.second;
+}
+
+int ShardMap::shard_of_user(const string& user)
+{
+    if (ring.empty())
+        return 0;
+
+    auto point = ring.lower_bound(StateDigest::hash(user));
+    if (point == ring.end())
+        point = ring.begin();   // wraps around
+    return point->second;
+}
@@ -2,6 +2,8 @@
 
 
 Socket::Socket(){
+    this->lastFrame = 0;
+    this->lastRetransmitRequest = {0, 0};
     if ((this->socketfd = socket(AF_INET, SOCK_STREAM, 0)) <= 0) {
         std::cout << "ERROR opening socket\n" << std::endl;
         exit(1);
@@ -10,6 +12,8 @@ Socket::Socket(){
 
 Socket::Socket(int socketfd){
     this->socketfd = socketfd;
+    this->lastFrame = 0;
+    this->lastRetransmitRequest = {0, 0};
 }
 
 
@@ -24,37 +28,83 @@ int Socket::getSocketfd(){
 }
 
 
-// returns a pointer to the read Packet object or NULL if connection was closed
-Packet* Socket::readPacket(){
+// reads until a whole frame arrived, a single read() may return part of it
+bool Socket::readFrame(int socketfd, Packet* pkt){
+
+    size_t received = 0;
+    while (received < sizeof(Packet)){
+        int n = read(socketfd, ((char *) pkt) + received, sizeof(Packet) - received);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0){
+            //std::cout << "ERROR reading from socket: " << socketfd  << std::endl;
+            return false;
+        }
+        if (n == 0){
+            std::cout << "Connection closed." << std::endl;
+            return false;
+        }
+        received += n;
+    }
 
-    Packet* pkt = new Packet();
-    memset(pkt, 0, sizeof (Packet));
-    int n = read(this->socketfd, pkt, sizeof(Packet));
+    return true;
+}
 
-    if (n<0){
-        //std::cout << "ERROR reading from socket: " << this->socketfd  << std::endl;
-        return NULL;
-    }
-    else if(n == 0){
-        std::cout << "Connection closed." << std::endl;
-        return NULL;
-    }
 
+// turns pkt into the CORRUPT_FRAME the caller answers with a RETRANSMIT of the frame expected next
+Packet* Socket::requestRetransmit(Packet* pkt){
+    *pkt = Packet(CORRUPT_FRAME, "");
+    pkt->setFrame(this->lastFrame + 1);
+    clock_gettime(CLOCK_MONOTONIC, &this->lastRetransmitRequest);
     return pkt;
 }
 
+// returns a pointer to the read Packet object or NULL if connection was closed. A frame that fails
+// its checksum comes back as a CORRUPT_FRAME packet carrying the number of the frame to re-request;
+// frames of a peer server that follow it are skipped until that one is sent again, and while they
+// keep coming it is re-requested every PEER_RETRANSMIT_RETRY_MS
+Packet* Socket::readPacket(){
+
+    Packet* pkt = new Packet();
+    while (true){
+        *pkt = Packet();
+        if (!readFrame(this->socketfd, pkt)){
+            delete pkt;
+            return NULL;
+        }
+
+        if (!pkt->intact()){
+            std::cout << "Corrupt frame on socket " << this->socketfd << ", dropping it." << std::endl;
+            return requestRetransmit(pkt);
+        }
+
+        uint32_t frame = pkt->getFrame();
+        if (frame == 0)             // not part of a numbered stream
+            return pkt;
+        if (frame == this->lastFrame + 1){
+            this->lastFrame = frame;
+            return pkt;
+        }
+        if (frame <= this->lastFrame)
+            continue;           // already seen
+
+        // sent after a frame that never arrived intact, the peer may not know yet
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long sinceRequestMs = (now.tv_sec - this->lastRetransmitRequest.tv_sec) * 1000
+                            + (now.tv_nsec - this->lastRetransmitRequest.tv_nsec) / 1000000;
+        if (sinceRequestMs >= PEER_RETRANSMIT_RETRY_MS)
+            return requestRetransmit(pkt);
+    }
+}
+
 
 Packet* Socket::readPacket(int socketfd){
 
     Packet* pkt = new Packet();
-    memset(pkt, 0, sizeof (Packet));
-    int n = read(socketfd, pkt, sizeof(Packet));
-    if (n<0){
-        std::cout << "ERROR reading from socket: " << socketfd  << std::endl;
-        return NULL;
-    }
-    else if(n == 0){
-        std::cout << "Connection closed." << std::endl;
+    *pkt = Packet();
+    if (!readFrame(socketfd, pkt) || !pkt->intact()){
+        delete pkt;
         return NULL;
     }
 
@@ -64,6 +114,7 @@ Packet* Socket::readPacket(int socketfd){
 
 // return the n value gotten from send primitive
 int Socket::sendPacket(Packet pkt){
+    pkt.seal();
     int n = send(this->socketfd, &pkt, sizeof(pkt), MSG_NOSIGNAL); 
     if (n < 0) 
         std::cout << "ERROR writing to socket: " << this->socketfd << std::endl;
@@ -73,6 +124,7 @@ int Socket::sendPacket(Packet pkt){
 
 // overloading for non-initialized Socket object
 int Socket::sendPacket(Packet pkt, int socketfd){
+    pkt.seal();
     int n = send(socketfd, &pkt, sizeof(pkt), MSG_NOSIGNAL); 
     if (n < 0) {
         std::cout << "ERROR writing to socket: " << this->socketfd << std::endl;
@@ -82,6 +134,14 @@ int Socket::sendPacket(Packet pkt, int socketfd){
 }
 
 
+void Socket::setReadTimeout(int timeoutMs){
+    struct timeval timeout;
+    timeout.tv_sec = timeoutMs / 1000;
+    timeout.tv_usec = (timeoutMs % 1000) * 1000;
+    setsockopt(this->socketfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
+
+
 void Socket::reopenSocket(){
     close(this->socketfd);
     if ((this->socketfd = socket(AF_INET, SOCK_STREAM, 0)) <= 0) {
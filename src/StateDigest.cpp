@@ -0,0 +1,85 @@
+#include "../include/StateDigest.hpp"
+
+
+StateDigest::StateDigest() : buckets(STATE_DIGEST_BUCKETS, 0)
+{
+
+}
+
+
+int StateDigest::bucket_of(const string& user)
+{
+    return hash(user) % STATE_DIGEST_BUCKETS;
+}
+
+int StateDigest::groups()
+{
+    return STATE_DIGEST_BUCKETS / STATE_DIGEST_GROUP_SIZE;
+}
+
+// 64-bit FNV-1a
+uint64_t StateDigest::hash(const string& data)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (unsigned char c : data)
+    {
+        h ^= c;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+
+void StateDigest::mark_dirty(const string& user)
+{
+    dirty.insert(user);
+}
+
+vector<string> StateDigest::take_dirty()
+{
+    vector<string> users(dirty.begin(), dirty.end());
+    dirty.clear();
+    return users;
+}
+
+
+void StateDigest::set_user(const string& user, uint64_t userHash)
+{
+    uint64_t& bucket = buckets[bucket_of(user)];
+
+    auto it = user_hashes.find(user);
+    if (it != user_hashes.end())
+    {
+        bucket -= it->second;
+        it->second = userHash;
+    }
+    else
+    {
+        user_hashes.insert({user, userHash});
+    }
+    bucket += userHash;
+}
+
+void StateDigest::remove_user(const string& user)
+{
+    auto it = user_hashes.find(user);
+    if (it == user_hashes.end())
+        return;
+
+    buckets[bucket_of(user)] -= it->second;
+    user_hashes.erase(it);
+}
+
+
+uint64_t StateDigest::bucket_hash(int bucket)
+{
+    return buckets[bucket];
+}
+
+uint64_t StateDigest::group_hash(int group)
+{
+    string bucketHashes;
+    for (int b = group * STATE_DIGEST_GROUP_SIZE; b < (group + 1) * STATE_DIGEST_GROUP_SIZE; b++)
+        bucketHashes.append((const char*) &buckets[b], sizeof(uint64_t));
+    return hash(bucketHashes);
+}
@@ -1,4 +1,6 @@
 #include "../include/Client.hpp"
+#include "../include/ShardMap.hpp"
+#include <sstream>
 
 inline bool do_file_exists (const std::string& name) {
     return ( access( name.c_str(), F_OK ) != -1 );
@@ -14,7 +16,7 @@ int main(int argc, char **argv) {
 
 
   if (argc < 2) {
-    fprintf(stderr,"ERROR you must provide the '@username' argument.\n");
+    fprintf(stderr,"ERROR you must provide the '@username' argument, optionally followed by a gateway's 'ip port'.\n");
     exit(0);
   }
 
@@ -36,20 +38,44 @@ int main(int argc, char **argv) {
     exit(1);
   }
 
-	string ip, port;
-	while (input_file >> ip >> port){
+	// "ip port [shard]" per line, servers without a shard belong to shard 0
+	ShardMap shardMap;
+	string line, ip, port;
+	while (getline(input_file, line)){
+		istringstream fields(line);
+		int shard = 0;
+		if (!(fields >> ip >> port))
+			continue;
+		fields >> shard;
 		possibleServerAddresses.insert(pair<string, int>(ip, atoi(port.c_str())));
+		shardMap.add_server(ip, atoi(port.c_str()), shard);
 	}
 	
 	input_file.close();
 	// FIM DA LEITURA DAS INFORMAÇÕES DE UM ARQUIVO DE CONFIGURAÇÃ
 
 
-  client = new Client(user, possibleServerAddresses);
+  // Only the members of the user's home shard can open its session
+  if (shardMap.size() > 1)
+    possibleServerAddresses = shardMap.addresses_of(shardMap.shard_of_user(user));
+
+  // A gateway stands in for all of them and finds the primary itself
+  bool behindGateway = argc > 3;
+  if (behindGateway){
+    possibleServerAddresses.clear();
+    possibleServerAddresses.insert(pair<string, int>(argv[2], atoi(argv[3])));
+  }
+
+  client = new Client(user, possibleServerAddresses, shardMap.shard_of_user(user), behindGateway);
 
   pthread_create(&threadControl, NULL, Client::controlThread, (void *)client);
   pthread_create(&threadReceiver, NULL, Client::do_threadReceiver, (void *)client);
   pthread_create(&threadSender, NULL, Client::do_threadSender, (void *)client);
+  if (SESSION_DELIVERY == REPLICA_DELIVERY && !behindGateway){
+    pthread_t threadDelivery;
+    pthread_create(&threadDelivery, NULL, Client::do_threadDeliveryReceiver, (void *)client);
+    pthread_detach(threadDelivery);
+  }
 
   pthread_join(threadControl, NULL);
   pthread_join(threadReceiver, NULL);
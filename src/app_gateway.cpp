@@ -0,0 +1,42 @@
+#include "../include/Gateway.hpp"
+#include <sstream>
+
+inline bool do_file_exists (const std::string& name) {
+    return ( access( name.c_str(), F_OK ) != -1 );
+}
+
+int main(int argc, char **argv){
+
+	int port = GATEWAY_PORT;
+	if (argc > 1)
+		port = atoi(argv[1]);
+
+	// INÍCIO DA LEITURA DAS INFORMAÇÕES DE UM ARQUIVO DE CONFIGURAÇÃO
+	string filename("../ipporta.txt");
+	ifstream input_file(filename);
+
+	if (!do_file_exists(filename)){
+		cout << "ERROR config file not found. You should cd to ./bin/ folder!\n";
+		exit(1);
+	}
+
+	// "ip port [shard]" per line, servers without a shard belong to shard 0
+	ShardMap shardMap;
+	string line, ip, serverPort;
+	while (getline(input_file, line)){
+		istringstream fields(line);
+		int shard = 0;
+		if (!(fields >> ip >> serverPort))
+			continue;
+		fields >> shard;
+		shardMap.add_server(ip, atoi(serverPort.c_str()), shard);
+	}
+	
+	input_file.close();
+	// FIM DA LEITURA DAS INFORMAÇÕES DE UM ARQUIVO DE CONFIGURAÇÃO
+
+	Gateway* gateway = new Gateway(shardMap);
+	gateway->listenForClients(port);
+
+	return 0;
+}
@@ -1,4 +1,5 @@
 #include "../include/Server.hpp"
+#include <sstream>
 
 inline bool do_file_exists (const std::string& name) {
     return ( access( name.c_str(), F_OK ) != -1 );
@@ -17,23 +18,28 @@ int main(){
 		exit(1);
 	}
 
-	string ip, port;
-	while (input_file >> ip >> port){
+	// "ip port [shard]" per line, servers without a shard belong to shard 0
+	ShardMap shardMap;
+	string line, ip, port;
+	while (getline(input_file, line)){
+		istringstream fields(line);
+		int shard = 0;
+		if (!(fields >> ip >> port))
+			continue;
+		fields >> shard;
 		possibleServerAddresses.insert(pair<string, int>(ip, atoi(port.c_str())));
+		shardMap.add_server(ip, atoi(port.c_str()), shard);
 	}
 	
 	input_file.close();
 	// FIM DA LEITURA DAS INFORMAÇÕES DE UM ARQUIVO DE CONFIGURAÇÃO
 	
 	ServerSocket serverSocket = ServerSocket();
-	Server* server = new Server(possibleServerAddresses);
+	Server* server = new Server(possibleServerAddresses, shardMap);
 
 
-    pthread_t threadConnections[MAX_TCP_CONNECTIONS];
 	pthread_t electionMonitorThread;
 
-	int i = 0;
-
 	serverSocket.bindAndListen(server);
 
 	// Initialize election thread
@@ -47,8 +53,7 @@ int main(){
 	
 
 	while (1){
-		serverSocket.connectNewClientOrServer(&threadConnections[i], server);
-		i++;
+		serverSocket.acceptConnection(server);
 	}
 	
 	pthread_join(electionMonitorThread, NULL);